@@ -0,0 +1,212 @@
+/*
+ * alignbench.c - Aligned allocation benchmark
+ *
+ * Runs the same random stream of allocations and frees over a working set
+ * of slots three times: once with mm_memalign, once aligning by hand the
+ * way programs do without it (malloc align - 1 extra bytes and round the
+ * pointer up), and once with plain mm_malloc as a baseline. This is done
+ * for every power-of-two alignment from 32 bytes up to the requested one,
+ * and reports the throughput and the peak heap footprint of each method,
+ * with utilization measured as in mdriver: peak live payload bytes over
+ * peak heap bytes.
+ *
+ * The benchmark is linked with the driver build of mm.c, so that memlib
+ * can account for every byte of the heap:
+ *
+ *     unix> make alignbench
+ *     unix> ./alignbench -a 4096
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Defaults, overridable on the command line */
+#define DEFAULT_ALIGN 4096
+#define DEFAULT_OPS 1000000
+#define DEFAULT_SLOTS 1024
+#define DEFAULT_MAXSIZE 512
+
+/* How a block is allocated */
+typedef enum
+{
+    MEMALIGN,
+    MANUAL,
+    PLAIN
+} method_t;
+
+static const char *method_names[] = {"memalign", "manual", "malloc"};
+
+/* Results of one run */
+typedef struct
+{
+    double secs;     /* Time taken by the whole run */
+    size_t peak;     /* Peak heap footprint, in bytes */
+    size_t max_live; /* Peak live payload, in bytes */
+} result_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * run - Perform `ops` random mallocs and frees over `slots` slots with one
+ *     method, checking the alignment of every block and touching its first
+ *     byte.
+ */
+static result_t run(method_t method, size_t align, long ops, int slots,
+                    size_t maxsize)
+{
+    char **raw = calloc(slots, sizeof(char *));     /* What to free */
+    size_t *sizes = calloc(slots, sizeof(size_t)); /* Payload asked for */
+    unsigned int seed = 12345;
+    size_t live = 0;
+    result_t result = {0, 0, 0};
+    long i;
+
+    if (raw == NULL || sizes == NULL)
+    {
+        fprintf(stderr, "calloc failed in run\n");
+        exit(1);
+    }
+    mem_reset_brk();
+    if (!mm_init())
+    {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    double start = now();
+    for (i = 0; i < ops; i++)
+    {
+        int s = rand_r(&seed) % slots;
+        if (raw[s] != NULL)
+        {
+            mm_free(raw[s]);
+            raw[s] = NULL;
+            live -= sizes[s];
+            continue;
+        }
+
+        size_t size = 1 + rand_r(&seed) % maxsize;
+        char *p;
+        switch (method)
+        {
+        case MEMALIGN:
+            p = raw[s] = mm_memalign(align, size);
+            break;
+        case MANUAL:
+            raw[s] = mm_malloc(size + align - 1);
+            p = (char *)(((uintptr_t)raw[s] + align - 1) & ~(align - 1));
+            break;
+        default:
+            p = raw[s] = mm_malloc(size);
+            break;
+        }
+        if (raw[s] == NULL)
+        {
+            fprintf(stderr, "%s of %zu bytes failed\n", method_names[method],
+                    size);
+            exit(1);
+        }
+        if (method != PLAIN && ((uintptr_t)p & (align - 1)) != 0)
+        {
+            fprintf(stderr, "%s returned %p, not aligned to %zu\n",
+                    method_names[method], (void *)p, align);
+            exit(1);
+        }
+        p[0] = (char)s;
+        sizes[s] = size;
+        live += size;
+        if (live > result.max_live)
+            result.max_live = live;
+    }
+    result.secs = now() - start;
+    result.peak = mem_peak_heapsize();
+
+    for (i = 0; i < slots; i++)
+        mm_free(raw[i]);
+    free(raw);
+    free(sizes);
+    return result;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-a <align>] [-n <ops>] [-w <slots>] "
+                    "[-s <size>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <align>  Largest alignment, a power of two "
+                    "(default %d).\n", DEFAULT_ALIGN);
+    fprintf(stderr, "\t-n <ops>    Operations per run (default %d).\n",
+            DEFAULT_OPS);
+    fprintf(stderr, "\t-w <slots>  Working set (default %d).\n",
+            DEFAULT_SLOTS);
+    fprintf(stderr, "\t-s <size>   Largest request size (default %d).\n",
+            DEFAULT_MAXSIZE);
+    fprintf(stderr, "\t-h          Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxalign = DEFAULT_ALIGN;
+    long ops = DEFAULT_OPS;
+    int slots = DEFAULT_SLOTS;
+    size_t maxsize = DEFAULT_MAXSIZE;
+    int c;
+
+    while ((c = getopt(argc, argv, "ha:n:w:s:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'a':
+            maxalign = (size_t)atol(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'w':
+            slots = atoi(optarg);
+            break;
+        case 's':
+            maxsize = (size_t)atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (maxalign < 32 || (maxalign & (maxalign - 1)) != 0 || ops < 1 ||
+        slots < 1 || maxsize < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    mem_init(false);
+    printf("%8s %10s %10s %10s %8s\n", "align", "method", "Kops/s", "peakKB",
+           "util");
+    for (size_t align = 32; align <= maxalign; align *= 2)
+    {
+        for (method_t m = MEMALIGN; m <= PLAIN; m++)
+        {
+            result_t r = run(m, align, ops, slots, maxsize);
+            printf("%8zu %10s %10.0f %10.0f %7.1f%%\n", align,
+                   method_names[m], ops / (r.secs * 1000.0), r.peak / 1024.0,
+                   100.0 * r.max_live / r.peak);
+        }
+    }
+    mem_deinit();
+    return 0;
+}
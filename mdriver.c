@@ -10,14 +10,17 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <getopt.h>
 #include <math.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -29,6 +32,7 @@
 #include "fcyc.h"
 #include "memlib.h"
 #include "mm.h"
+#include "perfctr.h"
 #include "stree.h"
 
 /**********************
@@ -45,6 +49,11 @@
 #define REF_ONLY 0
 #endif
 
+/* The directory of the sources, set by the Makefile */
+#ifndef BUILD_SRCDIR
+#define BUILD_SRCDIR "."
+#endif
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -57,6 +66,9 @@ typedef enum
     WPERF
 } weight_t;
 
+/* Names of the weights in --json and --csv records */
+static const char *weight_names[] = {"none", "all", "util", "perf"};
+
 /******************************
  * The key compound data types
  *****************************/
@@ -98,10 +110,14 @@ typedef struct
     {
         ALLOC,
         FREE,
-        REALLOC
+        REALLOC,
+        ALLOC_BATCH,
+        FREE_BATCH,
+        TRIM
     } type;      /* type of request */
     int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
+    size_t size; /* byte size of alloc/realloc request, or trim pad */
+    int count;   /* number of blocks (ids index...) in a batch request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -111,6 +127,7 @@ typedef struct
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
+    int num_calls;        /* number of blocks those requests allocate/free */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
@@ -129,6 +146,40 @@ typedef struct
     range_set_t *ranges;
 } speed_t;
 
+/*
+ * Latency histograms (with -L). As in HdrHistogram, every power of two of
+ * nanoseconds is split into LAT_SUB linear buckets, so a bucket is within
+ * 1/LAT_SUB of every value it holds, from 1 ns up, in a fixed number of
+ * counters.
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/* The requests a latency histogram is kept for */
+typedef enum
+{
+    LAT_MALLOC,
+    LAT_FREE,
+    LAT_REALLOC,
+    LAT_MALLOC_BATCH,
+    LAT_FREE_BATCH,
+    LAT_TRIM,
+    LAT_ALL, /* every request of the trace */
+    LAT_TYPES
+} lat_type_t;
+
+static const char *lat_names[LAT_TYPES] = {
+    "malloc", "free", "realloc", "malloc_batch", "free_batch", "trim",
+    "all"};
+
+typedef struct
+{
+    uint64_t count;                /* requests timed */
+    uint64_t max;                  /* slowest of them in ns */
+    uint64_t buckets[LAT_BUCKETS]; /* requests per bucket */
+} lat_hist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct
 {
@@ -144,6 +195,17 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double lat_p999; /* 99.9th percentile op latency in ns (with -L) */
+    double lat_max;  /* worst op latency in ns (with -L) */
+    lat_hist_t *latency; /* op latencies by lat_type_t (with -L) */
+    double heap_peak;  /* largest heap size in bytes */
+    double heap_final; /* heap size in bytes at the end of the trace */
+    double heap_avg;   /* heap size in bytes averaged over all ops */
+    double sbrks;      /* number of mem_sbrk calls made by the trace */
+    double quick_hits;    /* mallocs served by a quick list */
+    double quick_flushes; /* consolidations of the quick lists */
+    struct mm_stats counters; /* allocator counters (mm.c with MM_STATS) */
+    double perf[PERFCTR_COUNT]; /* performance counters of a replay (-P) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -188,6 +250,16 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool latency_mode = false; /* Time every op and report the tail */
+static double timer_ns = 0; /* Cost of reading the clock, taken off each op */
+static bool heap_mode = false; /* Report peak, final and average heap size */
+static bool quick_mode = false; /* Report quick list hits and consolidations */
+static bool stats_mode = false; /* Report the allocator counters per trace */
+static char *event_file = NULL; /* Dump allocator events of each trace here */
+static bool perf_mode = false; /* Read the performance counters per trace */
+static int perf_hardware = 0;  /* Hardware counters the kernel gave us */
+static char *json_file = NULL; /* Append the results to this as JSON */
+static char *csv_file = NULL;  /* Append the results to this as CSV */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -255,11 +327,20 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static double calibrate_timer(void);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printcounters(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printperf(int n, stats_t *stats);
+static void record_results(int n, stats_t *stats, const char *driver,
+                           bool checkpoint, double util, double tput,
+                           double perfindex);
+static bool find_cpu_type(char *cpu_type);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -305,7 +386,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+        mm_stats[i].ops = trace->num_calls;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0)
@@ -336,7 +417,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -344,6 +425,14 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (latency_mode && !sparse_mode)
+                eval_mm_latency(trace, &mm_stats[i]);
+            if (perf_mode && !sparse_mode)
+            {
+                perfctr_start();
+                eval_mm_speed(speed_params);
+                perfctr_stop(mm_stats[i].perf);
+            }
         }
 
 #if 0
@@ -385,10 +474,16 @@ int main(int argc, char **argv)
 #if !REF_ONLY
 
     char c;
+    /* Long options only, with values no short option uses */
+    static struct option long_options[] = {
+        {"json", required_argument, NULL, 'J'},
+        {"csv", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}};
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt_long(argc, argv, "d:f:c:s:t:v:R:hpCOVAlDTLHQSP",
+                            long_options, NULL)) != EOF)
     {
         switch (c)
         {
@@ -449,6 +544,38 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'L':
+            latency_mode = true;
+            break;
+
+        case 'H':
+            heap_mode = true;
+            break;
+
+        case 'Q':
+            quick_mode = true;
+            break;
+
+        case 'S':
+            stats_mode = true;
+            break;
+
+        case 'R':
+            event_file = optarg;
+            break;
+
+        case 'P':
+            perf_mode = true;
+            break;
+
+        case 'J':
+            json_file = optarg;
+            break;
+
+        case 'K':
+            csv_file = optarg;
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -477,6 +604,20 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    if (latency_mode)
+    {
+        timer_ns = calibrate_timer();
+    }
+
+    if (perf_mode)
+    {
+        perf_hardware = perfctr_open();
+        if (perf_hardware == 0)
+            fprintf(stderr, "No hardware performance counters (denied by "
+                            "perf_event_paranoid, or none\non this machine); "
+                            "reading the software counters only\n");
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -582,6 +723,21 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (stats_mode)
+            {
+                printcounters(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (latency_mode && !sparse_mode)
+            {
+                printlatency(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (perf_mode && !sparse_mode)
+            {
+                printperf(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
         }
     }
 
@@ -727,6 +883,12 @@ int main(int argc, char **argv)
         printf("Terminated with %d errors\n", errors);
     }
 
+    /* Optionally append the results to the history files */
+    if (json_file != NULL || csv_file != NULL)
+        record_results(num_global_tracefiles, mm_stats, argv[0], checkpoint,
+                       avg_mm_util, avg_mm_harm_throughput,
+                       checkpoint ? perfindex_checkpoint : perfindex);
+
     /* Optionally emit autoresult string */
     double score = checkpoint ? perfindex_checkpoint : perfindex;
     /* Scoreboard shows: score, deductions, throughput, utilization */
@@ -806,9 +968,10 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -1018,6 +1181,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     size_t size;
     int max_index = 0;
     int op_index;
+    int count;
     int ignore = 0;
 
     if (verbose > 1)
@@ -1069,6 +1233,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->num_calls = 0;
     while (fscanf(tracefile, "%s", type) != EOF)
     {
         switch (type[0])
@@ -1092,10 +1257,36 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'A':
+            ignore += fscanf(tracefile, "%u %u %lu", &index, &count, &size);
+            trace->ops[op_index].type = ALLOC_BATCH;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].count = count;
+            trace->ops[op_index].size = size;
+            index += count - 1;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'F':
+            ignore += fscanf(tracefile, "%u %u", &index, &count);
+            trace->ops[op_index].type = FREE_BATCH;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].count = count;
+            break;
+        case 't':
+            ignore += fscanf(tracefile, "%lu", &size);
+            trace->ops[op_index].type = TRIM;
+            trace->ops[op_index].index = 0;
+            trace->ops[op_index].size = size;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
         }
+        if (trace->ops[op_index].type == ALLOC_BATCH ||
+            trace->ops[op_index].type == FREE_BATCH)
+            trace->num_calls += trace->ops[op_index].count;
+        else
+            trace->num_calls++;
         op_index++;
         if (op_index == trace->num_ops)
             break;
@@ -1107,7 +1298,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+    stats->ops = trace->num_calls;
 
     return trace;
 }
@@ -1145,8 +1336,9 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
+    int i, j;
     int index;
+    int count;
     size_t size;
     char *newp;
     char *oldp;
@@ -1294,6 +1486,51 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             mm_free(p);
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            count = trace->ops[i].count;
+            if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+                (size_t)count)
+            {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+
+            /* Check, remember and randomize every block, as for ALLOC */
+            for (j = index; j < index + count; j++)
+            {
+                if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+                    return false;
+                trace->block_sizes[j] = size;
+                randomize_block(trace, j);
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            count = trace->ops[i].count;
+            for (j = index; j < index + count; j++)
+            {
+                if (!check_index(trace, i, j))
+                {
+                    allCheck = false;
+                }
+                remove_range(ranges, trace->blocks[j]);
+            }
+
+            /* The freed slots are dead, so they may be left sorted */
+            mm_free_batch((void **)&trace->blocks[index], count);
+            break;
+
+        case TRIM: /* mm_trim */
+            mm_trim(size);
+
+            /* The end of the heap was rewritten, so check it right away */
+            if (!mm_checkheap(0))
+            {
+                malloc_error(trace, i, "mm_checkheap failed after mm_trim");
+                return false;
+            }
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1307,20 +1544,22 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   most memory the heap and the mem_map() regions used together while
+ *   running the student's malloc package on the trace. Since the heap
+ *   can shrink, the final and time-averaged sizes are recorded in stats
+ *   as well.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
+    int i, j;
     int index;
+    int count;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    double sum_heapsize = 0;
     char *p;
     char *newp, *oldp;
 
@@ -1392,6 +1631,36 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size -= size;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            size = trace->ops[i].size;
+
+            if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+                (size_t)count)
+            {
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+            for (j = index; j < index + count; j++)
+                trace->block_sizes[j] = size;
+
+            total_size += size * count;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            for (j = index; j < index + count; j++)
+                total_size -= trace->block_sizes[j];
+
+            mm_free_batch((void **)&trace->blocks[index], count);
+            break;
+
+        case TRIM: /* mm_trim */
+            mm_trim(trace->ops[i].size);
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1400,13 +1669,43 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
+        sum_heapsize += mem_heapsize() + mem_mapsize();
     }
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->heap_peak = mem_peak_heapsize();
+    stats->heap_final = mem_heapsize() + mem_mapsize();
+    stats->heap_avg = trace->num_ops ? sum_heapsize / trace->num_ops : 0;
+    stats->sbrks = mem_sbrk_calls();
+
+    struct mm_quick_stats quick;
+    mm_quick_stats(&quick);
+    stats->quick_hits = quick.hits;
+    stats->quick_flushes = quick.flushes;
+    if (stats_mode && !mm_stats(&stats->counters))
+    {
+        fprintf(stderr, "-S needs mm.c built with -DMM_STATS\n");
+        exit(1);
+    }
+    if (event_file != NULL)
+    {
+        /* One file per trace, numbered when there are several */
+        char path[MAXLINE];
+        if (num_global_tracefiles == 1)
+            snprintf(path, sizeof(path), "%s", event_file);
+        else
+            snprintf(path, sizeof(path), "%s.%d", event_file, tracenum);
+        if (!mm_trace_dump(path))
+        {
+            fprintf(stderr, "Couldn't write %s (-R needs mm.c built with "
+                            "-DMM_TRACE)\n", path);
+            exit(1);
+        }
+    }
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 /*
@@ -1415,7 +1714,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, index, count;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -1463,11 +1762,209 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            size = trace->ops[i].size;
+            if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+                (size_t)count)
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+            break;
+
+        case TRIM: /* mm_trim */
+            mm_trim(trace->ops[i].size);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
 }
 
+/* Returns the monotonic clock in ns */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the histogram bucket of a latency of v ns */
+static int lat_bucket(uint64_t v)
+{
+    int shift;
+
+    if (v < 2 * LAT_SUB)
+        return (int)v;
+    shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    return shift * LAT_SUB + (int)(v >> shift);
+}
+
+/* Returns the largest latency in ns that falls in bucket b */
+static uint64_t lat_value(int b)
+{
+    int shift = (b < 2 * LAT_SUB) ? 0 : b / LAT_SUB - 1;
+    uint64_t low = (uint64_t)(b - shift * LAT_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/* Adds a latency of ns, less the cost of reading the clock, to h */
+static void lat_record(lat_hist_t *h, double ns)
+{
+    uint64_t v = (ns > timer_ns) ? (uint64_t)(ns - timer_ns + 0.5) : 0;
+
+    h->buckets[lat_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Adds every latency in from to to */
+static void lat_merge(lat_hist_t *to, const lat_hist_t *from)
+{
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        to->buckets[b] += from->buckets[b];
+    to->count += from->count;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/* Returns the latency in ns that a fraction q of the requests in h took at
+   most, to within a bucket */
+static double lat_quantile(const lat_hist_t *h, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * h->count);
+    uint64_t seen = 0;
+    int b;
+
+    if (rank == 0)
+        rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return (double)(lat_value(b) < h->max ? lat_value(b) : h->max);
+    }
+    return (double)h->max;
+}
+
+/*
+ * calibrate_timer - Returns the median time in ns between two back to back
+ *    clock readings, which eval_mm_latency takes off every request it times.
+ */
+static double calibrate_timer(void)
+{
+    static lat_hist_t h;
+    double start;
+    int i;
+
+    for (i = 0; i < 100000; i++)
+    {
+        start = now_ns();
+        lat_record(&h, now_ns() - start);
+    }
+    return lat_quantile(&h, 0.5);
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing every request on
+ *    its own, and bin the latencies into a histogram per type of request.
+ *    Throughput hides a rare slow request; this is where it shows up.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index;
+    char *p;
+    size_t n;
+    double start, ns;
+    lat_type_t type;
+    lat_hist_t *h = calloc(LAT_TYPES, sizeof(lat_hist_t));
+
+    if (h == NULL)
+        unix_error("calloc failed in eval_mm_latency");
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type)
+        {
+        case ALLOC:
+            type = LAT_MALLOC;
+            start = now_ns();
+            p = mm_malloc(trace->ops[i].size);
+            ns = now_ns() - start;
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            type = LAT_REALLOC;
+            setUBCheck(false);
+            start = now_ns();
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            ns = now_ns() - start;
+            setUBCheck(true);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE:
+            type = LAT_FREE;
+            p = (index < 0) ? NULL : trace->blocks[index];
+            start = now_ns();
+            mm_free(p);
+            ns = now_ns() - start;
+            break;
+
+        case ALLOC_BATCH:
+            type = LAT_MALLOC_BATCH;
+            start = now_ns();
+            n = mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                                (void **)&trace->blocks[index]);
+            ns = now_ns() - start;
+            if (n != (size_t)trace->ops[i].count)
+                app_error("mm_malloc_batch error in eval_mm_latency");
+            break;
+
+        case FREE_BATCH:
+            type = LAT_FREE_BATCH;
+            start = now_ns();
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+            ns = now_ns() - start;
+            break;
+
+        case TRIM:
+            type = LAT_TRIM;
+            start = now_ns();
+            mm_trim(trace->ops[i].size);
+            ns = now_ns() - start;
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+        lat_record(&h[type], ns);
+        lat_record(&h[LAT_ALL], ns);
+    }
+
+    free(stats->latency);
+    stats->latency = h;
+    stats->lat_p999 = lat_quantile(&h[LAT_ALL], 0.999);
+    stats->lat_max = (double)h[LAT_ALL].max;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1476,7 +1973,7 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1518,6 +2015,26 @@ static bool eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case ALLOC_BATCH: /* one malloc per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index + j] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+                free(trace->blocks[trace->ops[i].index + j]);
+            break;
+
+        case TRIM: /* libc has no portable equivalent */
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1533,7 +2050,7 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1575,6 +2092,26 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            for (j = index; j < index + trace->ops[i].count; j++)
+            {
+                if ((p = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[j] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            index = trace->ops[i].index;
+            for (j = index; j < index + trace->ops[i].count; j++)
+                free(trace->blocks[j]);
+            break;
+
+        case TRIM: /* libc has no portable equivalent */
+            break;
         }
     }
 }
@@ -1605,12 +2142,23 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     /* Print the individual results for each trace */
     if (tab_mode)
     {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\t%s%s%s"
+               "trace\n", latency_mode ? "p99.9ns\tmaxns\t" : "",
+               heap_mode ? "peakKB\tfinalKB\tavgKB\tsbrks\t" : "",
+               quick_mode ? "qhits\tqflush\t" : "");
     }
     else
     {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %7s%8s%8s  ", "valid", "util", "ops", "msecs",
+               "Kops/s");
+        if (latency_mode)
+            printf("%9s%9s  ", "p99.9ns", "maxns");
+        if (heap_mode)
+            printf("%8s%8s%8s%7s  ", "peakKB", "finalKB", "avgKB",
+                   "sbrks");
+        if (quick_mode)
+            printf("%8s%7s  ", "qhits", "qflush");
+        printf("%s\n", "trace");
     }
     for (i = 0; i < n; i++)
     {
@@ -1683,6 +2231,43 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Latency tail */
+            if (latency_mode)
+            {
+                if (tab_mode)
+                    printf("%.0f\t%.0f\t", stats[i].lat_p999,
+                           stats[i].lat_max);
+                else
+                    printf("%9.0f%9.0f  ", stats[i].lat_p999,
+                           stats[i].lat_max);
+            }
+
+            /* Heap size over the trace */
+            if (heap_mode)
+            {
+                if (tab_mode)
+                    printf("%.0f\t%.0f\t%.0f\t%.0f\t",
+                           stats[i].heap_peak / 1024,
+                           stats[i].heap_final / 1024,
+                           stats[i].heap_avg / 1024, stats[i].sbrks);
+                else
+                    printf("%8.0f%8.0f%8.0f%7.0f  ",
+                           stats[i].heap_peak / 1024,
+                           stats[i].heap_final / 1024,
+                           stats[i].heap_avg / 1024, stats[i].sbrks);
+            }
+
+            /* Quick list use over the trace */
+            if (quick_mode)
+            {
+                if (tab_mode)
+                    printf("%.0f\t%.0f\t", stats[i].quick_hits,
+                           stats[i].quick_flushes);
+                else
+                    printf("%8.0f%7.0f  ", stats[i].quick_hits,
+                           stats[i].quick_flushes);
+            }
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1761,6 +2346,425 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printcounters - prints the allocator counters of every valid trace: how
+ * many free blocks find_fit looked at, splits, coalesces by case, and heap
+ * growth, followed by the most blocks each non-empty seglist ever held.
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i;
+    size_t j;
+
+    if (tab_mode)
+    {
+        printf("fits\tprobes\tmaxprobe\tmisses\tsplits\tcnone\tcprev\t"
+               "cnext\tcboth\textends\textendKB\ttrims\tpeaks\ttrace\n");
+    }
+    else
+    {
+        printf("Allocator counters:\n");
+        printf("%9s%8s%7s%7s%8s%8s%8s%8s%8s%7s%8s%6s  %s\n", "fits",
+               "prb/fit", "maxprb", "misses", "splits", "c-none", "c-prev",
+               "c-next", "c-both", "extend", "extKB", "trims", "trace");
+    }
+    for (i = 0; i < n; i++)
+    {
+        struct mm_stats *c = &stats[i].counters;
+        if (!stats[i].valid)
+            continue;
+        double per_fit =
+            c->fit_searches ? (double)c->fit_probes / c->fit_searches : 0;
+        if (tab_mode)
+        {
+            printf("%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t"
+                   "%zu\t", c->fit_searches, c->fit_probes, c->fit_max_probes,
+                   c->fit_misses, c->splits, c->coalesce_none,
+                   c->coalesce_prev, c->coalesce_next, c->coalesce_both,
+                   c->extends, c->extend_bytes / 1024, c->trims);
+            for (j = 0; j < c->lists; j++)
+                if (c->list_peak[j] > 0)
+                    printf("%zu:%zu,", j, c->list_peak[j]);
+            printf("tree:%zu\t%s\n", c->tree_peak, stats[i].filename);
+        }
+        else
+        {
+            printf("%9zu%8.1f%7zu%7zu%8zu%8zu%8zu%8zu%8zu%7zu%8zu%6zu  %s\n",
+                   c->fit_searches, per_fit, c->fit_max_probes, c->fit_misses,
+                   c->splits, c->coalesce_none, c->coalesce_prev,
+                   c->coalesce_next, c->coalesce_both, c->extends,
+                   c->extend_bytes / 1024, c->trims, stats[i].filename);
+        }
+    }
+    if (tab_mode)
+        return;
+
+    /* The seglist peaks, wrapped at 80 columns */
+    printf("\nMost blocks per seglist (list:blocks):\n");
+    for (i = 0; i < n; i++)
+    {
+        struct mm_stats *c = &stats[i].counters;
+        int col;
+        if (!stats[i].valid)
+            continue;
+        printf("%s\n", stats[i].filename);
+        col = printf("   ");
+        for (j = 0; j <= c->lists; j++)
+        {
+            char item[48];
+            int len;
+            if (j == c->lists)
+                len = snprintf(item, sizeof(item), " tree:%zu", c->tree_peak);
+            else if (c->list_peak[j] > 0)
+                len = snprintf(item, sizeof(item), " %zu:%zu", j,
+                               c->list_peak[j]);
+            else
+                continue;
+            if (col + len > 79)
+            {
+                printf("\n");
+                col = printf("   ");
+            }
+            col += printf("%s", item);
+        }
+        printf("\n");
+    }
+}
+
+/* Prints a counter per op, or -- if it could not be read */
+static void printperfvalue(int width, int digits, double value, double ops)
+{
+    if (value < 0 || ops <= 0)
+        printf("%*s", width, "--");
+    else
+        printf("%*.*f", width, digits, value / ops);
+}
+
+/*
+ * printperf - prints the performance counters of one more replay of every
+ * valid trace, per op in the table (instructions per cycle for the
+ * instructions) and as totals with -T, then for all the traces together.
+ * Without hardware counters only the software ones are printed.
+ */
+static void printperf(int n, stats_t *stats)
+{
+    double total[PERFCTR_COUNT];
+    double ops = 0;
+    int i, c;
+
+    for (c = 0; c < PERFCTR_COUNT; c++)
+        total[c] = 0;
+    if (tab_mode)
+    {
+        printf("ops\t");
+        for (c = 0; c < PERFCTR_COUNT; c++)
+            printf("%s\t", perfctr_names[c]);
+        printf("trace\n");
+    }
+    else
+    {
+        printf("Performance counters per op%s:\n",
+               perf_hardware ? "" : " (no hardware counters)");
+        if (perf_hardware)
+            printf("%8s%8s%7s%10s%10s%10s%9s", "cycles", "instrs", "IPC",
+                   "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss");
+        printf("%8s%9s%8s  %s\n", "cpu-ns", "faults", "ctx-sw", "trace");
+    }
+    for (i = 0; i <= n; i++)
+    {
+        const double *perf = (i < n) ? stats[i].perf : total;
+        double trace_ops = (i < n) ? stats[i].ops : ops;
+        if (i < n && !stats[i].valid)
+            continue;
+        if (i < n)
+        {
+            ops += trace_ops;
+            for (c = 0; c < PERFCTR_COUNT; c++)
+                if (total[c] >= 0)
+                    total[c] = (perf[c] < 0) ? -1 : total[c] + perf[c];
+        }
+
+        if (tab_mode)
+        {
+            printf("%.0f\t", trace_ops);
+            for (c = 0; c < PERFCTR_COUNT; c++)
+                printf("%.0f\t", perf[c]);
+            printf("%s\n", (i < n) ? stats[i].filename : "all");
+            continue;
+        }
+        if (perf_hardware)
+        {
+            printperfvalue(8, 1, perf[PERFCTR_CYCLES], trace_ops);
+            if (perf[PERFCTR_INSTRUCTIONS] < 0 || perf[PERFCTR_CYCLES] <= 0)
+                printf("%8s%7s", "--", "--");
+            else
+                printf("%8.1f%7.2f", perf[PERFCTR_INSTRUCTIONS] / trace_ops,
+                       perf[PERFCTR_INSTRUCTIONS] / perf[PERFCTR_CYCLES]);
+            printperfvalue(10, 3, perf[PERFCTR_L1D_MISSES], trace_ops);
+            printperfvalue(10, 3, perf[PERFCTR_LLC_MISSES], trace_ops);
+            printperfvalue(10, 3, perf[PERFCTR_DTLB_MISSES], trace_ops);
+            printperfvalue(9, 3, perf[PERFCTR_BRANCH_MISSES], trace_ops);
+        }
+        printperfvalue(8, 1, perf[PERFCTR_TASK_CLOCK], trace_ops);
+        printperfvalue(9, 4, perf[PERFCTR_PAGE_FAULTS], trace_ops);
+        printperfvalue(8, 4, perf[PERFCTR_CONTEXT_SWITCHES], trace_ops);
+        printf("  %s\n", (i < n) ? stats[i].filename : "all traces");
+    }
+}
+
+/* Prints one row of the latency report */
+static void printlatencyrow(const lat_hist_t *h, lat_type_t type,
+                            const char *trace)
+{
+    if (tab_mode)
+        printf("%s\t%llu\t%.0f\t%.0f\t%.0f\t%.0f\t%llu\t%s\n",
+               lat_names[type], (unsigned long long)h->count,
+               lat_quantile(h, 0.5), lat_quantile(h, 0.9),
+               lat_quantile(h, 0.99), lat_quantile(h, 0.999),
+               (unsigned long long)h->max, trace);
+    else
+        printf("  %-13s%10llu%8.0f%8.0f%8.0f%8.0f%9llu\n", lat_names[type],
+               (unsigned long long)h->count, lat_quantile(h, 0.5),
+               lat_quantile(h, 0.9), lat_quantile(h, 0.99),
+               lat_quantile(h, 0.999), (unsigned long long)h->max);
+}
+
+/*
+ * printlatency - prints the latency percentiles of every type of request
+ * in every valid trace, and of all the traces together.
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static lat_hist_t total[LAT_TYPES];
+    int i, t;
+
+    if (tab_mode)
+    {
+        printf("op\tcount\tp50ns\tp90ns\tp99ns\tp99.9ns\tmaxns\ttrace\n");
+    }
+    else
+    {
+        printf("Latency per request in ns, less %.0f ns of timer overhead:\n",
+               timer_ns);
+        printf("  %-13s%10s%8s%8s%8s%8s%9s\n", "request", "count", "p50",
+               "p90", "p99", "p99.9", "max");
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].latency == NULL)
+            continue;
+        if (!tab_mode)
+            printf("%s\n", stats[i].filename);
+        for (t = 0; t < LAT_TYPES; t++)
+        {
+            if (stats[i].latency[t].count == 0)
+                continue;
+            printlatencyrow(&stats[i].latency[t], t, stats[i].filename);
+            lat_merge(&total[t], &stats[i].latency[t]);
+        }
+    }
+    if (!tab_mode)
+        printf("all traces\n");
+    for (t = 0; t < LAT_TYPES; t++)
+        if (total[t].count > 0)
+            printlatencyrow(&total[t], t, "all");
+}
+
+/* Writes s as a JSON string */
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Writes s as a CSV field, quoted if it has to be */
+static void csv_string(FILE *fp, const char *s)
+{
+    if (strpbrk(s, ",\"\n") == NULL)
+    {
+        fputs(s, fp);
+        return;
+    }
+    fputc('"', fp);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"')
+            fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Opens path to append to, or stdout for "-" */
+static FILE *open_history(const char *path)
+{
+    FILE *fp;
+
+    if (strcmp(path, "-") == 0)
+        return stdout;
+    if ((fp = fopen(path, "a")) == NULL)
+        unix_error("Couldn't open %s to append the results", path);
+    fseek(fp, 0, SEEK_END);
+    return fp;
+}
+
+static void close_history(FILE *fp)
+{
+    if (fp != stdout && fclose(fp) != 0)
+        unix_error("Couldn't write the results");
+}
+
+/*
+ * git_describe - puts the output of "git describe" for the sources in
+ * commit, or "unknown".  git is run without a shell, so the path of the
+ * sources reaches it as it is, whatever characters it holds.
+ */
+static void git_describe(char *commit, size_t len)
+{
+    int fd[2];
+    pid_t pid;
+    size_t got = 0;
+    ssize_t r;
+
+    if (pipe(fd) == 0)
+    {
+        if ((pid = fork()) == 0)
+        {
+            close(fd[0]);
+            dup2(fd[1], STDOUT_FILENO);
+            close(fd[1]);
+            if (freopen("/dev/null", "w", stderr) == NULL)
+                _exit(127);
+            execlp("git", "git", "-C", BUILD_SRCDIR, "describe", "--always",
+                   "--dirty", (char *)NULL);
+            _exit(127);
+        }
+        close(fd[1]);
+        if (pid > 0)
+        {
+            while (got < len - 1 &&
+                   (r = read(fd[0], commit + got, len - 1 - got)) > 0)
+                got += r;
+            waitpid(pid, NULL, 0);
+        }
+        close(fd[0]);
+    }
+    commit[got] = '\0';
+    commit[strcspn(commit, "\n")] = '\0';
+    if (commit[0] == '\0')
+        strcpy(commit, "unknown");
+}
+
+/*
+ * record_results - appends the results of the run, with what is needed to
+ * compare them with other runs, to the --json file as one line and to the
+ * --csv file as one row per trace: when and where it ran, the git commit
+ * of the sources, the driver (which names the build of mm.c), the flags
+ * mm.c was built with, the scoring constants of config.h, and
+ * the ops, time, throughput, utilization and heap size of every trace.
+ * mmhistory.pl reports the trend of every trace over the lines of a JSON
+ * file.
+ */
+static void record_results(int n, stats_t *stats, const char *driver,
+                           bool checkpoint, double util, double tput,
+                           double perfindex)
+{
+    char when[32], commit[MAXLINE], cpu[MAXLINE] = "unknown";
+    time_t now = time(NULL);
+    FILE *fp;
+    int i;
+#if REF_ONLY
+    const char *cflags = "reference";
+#else
+    const char *cflags = mm_build_cflags();
+#endif
+
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    git_describe(commit, sizeof(commit));
+    find_cpu_type(cpu);
+    if (strrchr(driver, '/') != NULL)
+        driver = strrchr(driver, '/') + 1;
+
+    if (json_file != NULL)
+    {
+        fp = open_history(json_file);
+        fprintf(fp, "{\"time\":\"%s\",\"commit\":", when);
+        json_string(fp, commit);
+        fprintf(fp, ",\"cpu\":");
+        json_string(fp, cpu);
+        fprintf(fp, ",\"driver\":");
+        json_string(fp, driver);
+        fprintf(fp, ",\"compiler\":");
+        json_string(fp, __VERSION__);
+        fprintf(fp, ",\"cflags\":");
+        json_string(fp, cflags);
+        fprintf(fp, ",\"config\":{\"ALIGNMENT\":%d,\"MAXFILL\":%d,"
+                    "\"MAX_DENSE_HEAP\":%d,\"MIN_SPACE\":%g,"
+                    "\"MAX_SPACE\":%g,\"MIN_SPEED_RATIO\":%g,"
+                    "\"MAX_SPEED_RATIO\":%g,\"UTIL_WEIGHT\":%g}",
+                ALIGNMENT, MAXFILL, MAX_DENSE_HEAP,
+                checkpoint ? MIN_SPACE_CHECKPOINT : MIN_SPACE,
+                checkpoint ? MAX_SPACE_CHECKPOINT : MAX_SPACE,
+                checkpoint ? MIN_SPEED_RATIO_CHECKPOINT : MIN_SPEED_RATIO,
+                checkpoint ? MAX_SPEED_RATIO_CHECKPOINT : MAX_SPEED_RATIO,
+                checkpoint ? UTIL_WEIGHT_CHECKPOINT : UTIL_WEIGHT);
+        fprintf(fp, ",\"checkpoint\":%s,\"errors\":%d,\"util\":%.4f,"
+                    "\"tput\":%.0f,\"perfindex\":%.1f,\"traces\":[",
+                checkpoint ? "true" : "false", errors, util, tput,
+                perfindex);
+        for (i = 0; i < n; i++)
+        {
+            fprintf(fp, "%s{\"trace\":", i ? "," : "");
+            json_string(fp, stats[i].filename);
+            fprintf(fp, ",\"valid\":%s,\"weight\":\"%s\",\"ops\":%.0f,"
+                        "\"secs\":%.6f,\"tput\":%.0f,\"util\":%.4f,"
+                        "\"heap_peak\":%.0f,\"heap_final\":%.0f,"
+                        "\"heap_avg\":%.0f}",
+                    stats[i].valid ? "true" : "false",
+                    weight_names[stats[i].weight], stats[i].ops,
+                    stats[i].secs, stats[i].tput, stats[i].util,
+                    stats[i].heap_peak, stats[i].heap_final,
+                    stats[i].heap_avg);
+        }
+        fprintf(fp, "]}\n");
+        close_history(fp);
+    }
+
+    if (csv_file != NULL)
+    {
+        fp = open_history(csv_file);
+        if (fp == stdout || ftell(fp) == 0)
+            fprintf(fp, "time,commit,cpu,driver,trace,valid,weight,ops,secs,"
+                        "tput,util,heap_peak,heap_final,heap_avg\n");
+        for (i = 0; i < n; i++)
+        {
+            fprintf(fp, "%s,", when);
+            csv_string(fp, commit);
+            fputc(',', fp);
+            csv_string(fp, cpu);
+            fputc(',', fp);
+            csv_string(fp, driver);
+            fputc(',', fp);
+            csv_string(fp, stats[i].filename);
+            fprintf(fp, ",%d,%s,%.0f,%.6f,%.0f,%.4f,%.0f,%.0f,%.0f\n",
+                    stats[i].valid, weight_names[stats[i].weight],
+                    stats[i].ops, stats[i].secs, stats[i].tput,
+                    stats[i].util, stats[i].heap_peak, stats[i].heap_final,
+                    stats[i].heap_avg);
+        }
+        close_history(fp);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1869,21 +2873,18 @@ static int cparse(char *s, char **index)
     return found;
 }
 
-/* Read throughput from file */
-static double lookup_ref_throughput(bool checkpoint)
+/* Find the CPU type, as the throughput file names it, in CPU_FILE */
+static bool find_cpu_type(char *cpu_type)
 {
     char buf[MAXLINE];
     char *tokens[PLIMIT];
-    char cpu_type[MAXLINE] = "";
-    double tput = 0.0;
-    char *bench_type = checkpoint ? BENCH_KEY_CHECKPOINT : BENCH_KEY;
 
     /* Scan file to find CPU type */
     FILE *ifile = fopen(CPU_FILE, "r");
     if (!ifile)
     {
         fprintf(stderr, "Warning: Could not find file '%s'\n", CPU_FILE);
-        return tput;
+        return false;
     }
     /* Read lines in file.  Parse each one to look for key */
     bool found = false;
@@ -1904,8 +2905,21 @@ static double lookup_ref_throughput(bool checkpoint)
     {
         fprintf(stderr, "Warning: Could not find CPU type in file '%s'\n",
                 CPU_FILE);
-        return tput;
     }
+    return found;
+}
+
+/* Read throughput from file */
+static double lookup_ref_throughput(bool checkpoint)
+{
+    char buf[MAXLINE];
+    char *tokens[PLIMIT];
+    char cpu_type[MAXLINE] = "";
+    double tput = 0.0;
+    char *bench_type = checkpoint ? BENCH_KEY_CHECKPOINT : BENCH_KEY;
+
+    if (!find_cpu_type(cpu_type))
+        return tput;
     /* Now try to find matching entry in throughput file */
     FILE *tfile = fopen(THROUGHPUT_FILE, "r");
     if (tfile == NULL)
@@ -2013,7 +3027,8 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVCdDLHQSP] [-f <file>] [-R <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2027,5 +3042,20 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-L         Report latency percentiles per op\n");
+    fprintf(stderr, "\t-H         Report peak, final and average heap size, "
+                    "and mem_sbrk calls\n");
+    fprintf(stderr, "\t-Q         Report quick list hits and consolidations\n");
+    fprintf(stderr, "\t-S         Report allocator counters per trace "
+                    "(mm.c built with -DMM_STATS)\n");
+    fprintf(stderr, "\t-R <file>  Dump the allocator events of each trace to "
+                    "<file>[.<n>]\n"
+                    "\t           (mm.c built with -DMM_TRACE)\n");
+    fprintf(stderr, "\t-P         Report performance counters per trace "
+                    "and per op\n");
+    fprintf(stderr, "\t--json <file>  Append the results to <file> as a "
+                    "JSON line (- for stdout)\n");
+    fprintf(stderr, "\t--csv <file>   Append the results to <file> as CSV "
+                    "rows (- for stdout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -6,7 +6,9 @@
  * be used as an interpositioning library, and thereby run actual programs.
  */
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -16,18 +18,30 @@
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static size_t peak_bytes;           /* Most heap plus mapped bytes */
+static size_t sbrk_calls;           /* Calls to mem_sbrk */
+static atomic_size_t mapped_bytes;  /* Bytes in live mappings */
+static unsigned char *zero_lo;      /* Growing past here gives zero pages */
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
+        zero_lo = mem_brk = heap = sbrk(0);
         assert(mem_brk != (void *)-1);
         init = true;
     }
 }
 
+static void update_peak(void) {
+    size_t bytes = (size_t)(mem_brk - heap) + atomic_load(&mapped_bytes);
+    if (bytes > peak_bytes) {
+        peak_bytes = bytes;
+    }
+}
+
 void *mem_sbrk(intptr_t incr) {
     ensure_init();
 
+    sbrk_calls++;
     unsigned char *res = sbrk(incr);
     if (res == (void *)-1) {
         return res;
@@ -35,9 +49,39 @@ void *mem_sbrk(intptr_t incr) {
 
     assert(res == mem_brk);
     mem_brk += incr;
+    if (incr < 0) {
+        // The kernel frees whole pages only, so the one at the break keeps
+        // its data
+        uintptr_t page = (uintptr_t)getpagesize();
+        zero_lo = (unsigned char *)(((uintptr_t)mem_brk + page - 1) &
+                                    ~(page - 1));
+    }
+    update_peak();
     return (void *) res;
 }
 
+void *mem_map(size_t len) {
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    atomic_fetch_add(&mapped_bytes, len);
+    return addr;
+}
+
+int mem_unmap(void *addr, size_t len) {
+    if (munmap(addr, len) != 0) {
+        return -1;
+    }
+    atomic_fetch_sub(&mapped_bytes, len);
+    return 0;
+}
+
+size_t mem_mapsize(void) {
+    return atomic_load(&mapped_bytes);
+}
+
 void *mem_heap_lo(void) {
     ensure_init();
     return (void *)heap;
@@ -48,11 +92,25 @@ void *mem_heap_hi(void) {
     return (void *)(mem_brk - 1);
 }
 
+void *mem_zero_lo(void) {
+    ensure_init();
+    return (void *)zero_lo;
+}
+
 size_t mem_heapsize(void) {
     ensure_init();
     return (size_t)(mem_brk - heap);
 }
 
+size_t mem_peak_heapsize(void) {
+    ensure_init();
+    return peak_bytes;
+}
+
+size_t mem_sbrk_calls(void) {
+    return sbrk_calls;
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
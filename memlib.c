@@ -24,8 +24,13 @@
  * Loading from the sparse emulation uses the above lookup and then aggregates
  *  the data into a return value.
  *
+ * Regions handed out by mem_map are carved from the top of the same address
+ *  range, growing down towards the break, and are emulated just like the
+ *  heap.  mem_unmap gives their pages back: to the kernel with
+ *  MADV_DONTNEED in dense mode, and to the page pool in sparse mode.
+ *
  * If an emulated access is made to an address outside of the current
- *  bounds (mem_heap_lo, mem_heap_hi), then the address is assumed to be to
+ *  bounds (mem_heap_lo, mem_heap_hi) and of every mapping, then the address is assumed to be to
  *  a non-heap location, such as stack, global variables, etc.  For some
  *  implementations, this access is meant to be to the heap and was "safe"
  *  in non-emulation, as it was to the same page as actual heap data.  But
@@ -63,11 +68,25 @@ typedef struct MBLK
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A region handed out by mem_map */
+typedef struct MMAP
+{
+    unsigned char *lo;  /* First byte of the region */
+    size_t len;         /* Length of the region in bytes */
+    struct MMAP *next;  /* Next lower region */
+} mem_map_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static mem_map_t *maps = NULL;      /* Live mappings, highest address first */
+static unsigned char *map_lo;       /* Lowest mapped address, or mem_max_addr */
+static size_t mapped_bytes = 0;     /* Bytes in live mappings */
+static size_t peak_bytes = 0;       /* Most heap plus mapped bytes since reset */
+static size_t sbrk_calls = 0;       /* Calls to mem_sbrk since reset */
+static unsigned char *dirty_top;    /* Heap below may hold old data */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -77,6 +96,7 @@ static bool stats_printed =
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *released_pages = NULL; /* Pages given back by trimming */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
@@ -113,6 +133,11 @@ const char *__msan_default_options()
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void release_pages(unsigned char *lo, unsigned char *hi);
+static void release_page(mem_block_t **link);
+static void clear_maps(void);
+static void zero_range(unsigned char *lo, unsigned char *hi);
+static void update_peak(void);
 static void print_stats();
 
 /*
@@ -173,6 +198,10 @@ void mem_init(bool do_sparse)
     }
     stats_printed = false;
     mem_brk = heap;
+    dirty_top = heap;
+    map_lo = mem_max_addr;
+    peak_bytes = 0;
+    sbrk_calls = 0;
 }
 
 /*
@@ -181,8 +210,10 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
+    clear_maps();
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    released_pages = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
@@ -201,7 +232,9 @@ void mem_reset_brk()
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        released_pages = NULL;
         num_free_pages = num_pages;
+        dirty_top = heap;
     }
     else
     {
@@ -217,28 +250,54 @@ void mem_reset_brk()
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
     }
+    clear_maps();
     mem_brk = heap;
+    peak_bytes = 0;
+    sbrk_calls = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap again, down to its start. The memory
+ * given back is unaddressable under ASan, and its pages are recycled in
+ * sparse mode.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
+    sbrk_calls++;
     if (incr < 0)
     {
-        ok = false;
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+        if ((size_t)-incr > (size_t)(mem_brk - heap))
+        {
+            fprintf(stderr,
+                    "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                    "bytes, below its start\n",
+                    (long)-incr);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        /*
+         * The process break is left alone: libc may have moved it past
+         * mem_brk since, and shrinking it would cut into its heap.
+         */
+#ifdef USE_ASAN
+        __asan_poison_memory_region(mem_brk + incr, -incr);
+#endif
+        mem_brk += incr;
+        if (sparse)
+        {
+            /* Only whole pages are released; the one at the break is kept */
+            release_pages(mem_brk, old_brk);
+            size_t offset = mem_brk - heap + SPARSE_PAGE_SIZE - 1;
+            dirty_top = heap + offset - offset % SPARSE_PAGE_SIZE;
+        }
+        return (void *)old_brk;
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if ((size_t)incr > (size_t)(map_lo - mem_brk))
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -262,6 +321,9 @@ void *mem_sbrk(intptr_t incr)
         __asan_unpoison_memory_region(mem_brk, incr);
 #endif
         mem_brk += incr;
+        if (!sparse && mem_brk > dirty_top)
+            dirty_top = mem_brk;
+        update_peak();
         return (void *)old_brk;
     }
     else
@@ -295,6 +357,148 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap plus mapped size since the
+ *                       last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return peak_bytes;
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of calls to mem_sbrk since the last
+ *                    reset, whether they grew or shrank the heap
+ */
+size_t mem_sbrk_calls()
+{
+    return sbrk_calls;
+}
+
+/*
+ * mem_zero_lo - returns the address from which growing the heap yields
+ *               zero-filled memory.  Dense mode never clears the heap, so
+ *               what lies below the highest break so far, in this run or
+ *               an earlier one, may still hold old data.  Sparse mode starts
+ *               every run with fresh pages, but keeps the page holding the
+ *               break when the heap shrinks.
+ */
+void *mem_zero_lo()
+{
+    return (void *)dirty_top;
+}
+
+/*
+ * mem_map - model of an anonymous mmap.  Returns a zero-filled, page-aligned
+ *           region of at least len bytes, or NULL if there is no room left
+ *           between the highest mapping and the break.
+ */
+void *mem_map(size_t len)
+{
+    size_t page = mem_pagesize();
+    if (len == 0 || len > SIZE_MAX - page)
+        return NULL;
+    len = (len + page - 1) & ~(page - 1);
+
+    /* Highest gap that fits, searching down from the top */
+    unsigned char *top = mem_max_addr;
+    mem_map_t **link = &maps;
+    while (*link && (size_t)(top - ((*link)->lo + (*link)->len)) < len)
+    {
+        top = (*link)->lo;
+        link = &(*link)->next;
+    }
+    if (!*link && (size_t)(top - mem_brk) < len)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mem_map_t *m = malloc(sizeof(mem_map_t));
+    if (m == NULL)
+        return NULL;
+    m->lo = top - len;
+    m->len = len;
+    m->next = *link;
+    *link = m;
+    if (m->lo < map_lo)
+        map_lo = m->lo;
+    mapped_bytes += len;
+    update_peak();
+    if (!sparse)
+    {
+        /* The range may have been heap before: drop it for zero pages */
+#ifdef USE_ASAN
+        __asan_unpoison_memory_region(m->lo, len);
+#endif
+        zero_range(m->lo, m->lo + len);
+    }
+    return (void *)m->lo;
+}
+
+/*
+ * mem_unmap - give back a region returned by mem_map.  Returns -1 if
+ *             [addr, addr + len) is not exactly one mapping.
+ */
+int mem_unmap(void *addr, size_t len)
+{
+    size_t page = mem_pagesize();
+    len = (len + page - 1) & ~(page - 1);
+
+    mem_map_t **link = &maps;
+    while (*link && (*link)->lo != addr)
+        link = &(*link)->next;
+    mem_map_t *m = *link;
+    if (m == NULL || m->len != len)
+    {
+        fprintf(stderr, "ERROR: mem_unmap failed.  %p is not a mapping of "
+                        "%zu bytes\n", addr, len);
+        errno = EINVAL;
+        return -1;
+    }
+    *link = m->next;
+    if (sparse)
+        release_pages(m->lo, m->lo + len);
+    else
+    {
+        zero_range(m->lo, m->lo + len);
+#ifdef USE_ASAN
+        __asan_poison_memory_region(m->lo, len);
+#endif
+    }
+    if (m->lo == map_lo)
+    {
+        /* The list is sorted, so its last entry is the new lowest */
+        mem_map_t *last = maps;
+        while (last && last->next)
+            last = last->next;
+        map_lo = last ? last->lo : mem_max_addr;
+    }
+    mapped_bytes -= len;
+    free(m);
+    return 0;
+}
+
+/*
+ * mem_mapsize() - returns the number of bytes in live mappings
+ */
+size_t mem_mapsize()
+{
+    return mapped_bytes;
+}
+
+/*
+ * mem_is_mapped - does [lo, hi] lie within a single live mapping?
+ */
+bool mem_is_mapped(const void *lo, const void *hi)
+{
+    for (mem_map_t *m = maps; m; m = m->next)
+        if ((unsigned char *)lo >= m->lo &&
+            (unsigned char *)hi < m->lo + m->len)
+            return true;
+    return false;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -305,6 +509,14 @@ size_t mem_pagesize()
 
 /*************** Memory emulation  *******************/
 
+/* Is the access within the heap or the mapped region above it? */
+static bool emulated(const void *addr, size_t len)
+{
+    const unsigned char *a = (const unsigned char *)addr;
+    return (a >= heap && a + len <= mem_brk) ||
+           (a >= map_lo && a + len <= mem_max_addr);
+}
+
 __int128 mem_read128(const void *addr)
 {
     __int128 r;
@@ -323,8 +535,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && emulated(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -367,8 +578,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && emulated(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -536,7 +746,12 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
     if (!block)
     {
         /* Need to allocate a new block */
-        if (num_free_pages == 0)
+        if (released_pages != NULL)
+        {
+            block = released_pages;
+            released_pages = block->next;
+        }
+        else if (num_free_pages == 0)
         {
             /*
              * This will often fail due to student code that either accesses
@@ -547,12 +762,14 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        else
+            block = next_free_page++;
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
         for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
             block->initSet[i] = 0;
+        memset(block->bytes, 0, SPARSE_PAGE_SIZE); /* Fresh pages read zero */
         page_table[b] = block;
     }
 
@@ -599,3 +816,97 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
 
     return (void *)&block->bytes[offset];
 }
+
+/*
+ * Take the pages wholly inside [lo, hi) out of the page table, so that
+ *  trimming the heap gives emulation memory back.  A page the new break
+ *  falls inside is kept, with its contents.
+ */
+static void release_pages(unsigned char *lo, unsigned char *hi)
+{
+    size_t first = page_id(lo + SPARSE_PAGE_SIZE - 1);
+    size_t end = page_id(hi - 1) + 1;
+    size_t id, b;
+
+    if (end - first <= num_buckets)
+    {
+        /* Look every page up */
+        for (id = first; id < end; id++)
+        {
+            mem_block_t **link = &page_table[id % num_buckets];
+            while (*link && (*link)->id != id)
+                link = &(*link)->next;
+            if (*link)
+                release_page(link);
+        }
+        return;
+    }
+    /* A huge range: cheaper to sweep the whole table */
+    for (b = 0; b < num_buckets; b++)
+    {
+        mem_block_t **link = &page_table[b];
+        while (*link)
+        {
+            if ((*link)->id >= first && (*link)->id < end)
+                release_page(link);
+            else
+                link = &(*link)->next;
+        }
+    }
+}
+
+/* Unlink a page from the page table and keep it for reuse */
+static void release_page(mem_block_t **link)
+{
+    mem_block_t *block = *link;
+    *link = block->next;
+    block->next = released_pages;
+    released_pages = block;
+    num_free_pages++;
+}
+
+/*
+ * Zero [lo, hi) of the dense heap, handing whole pages back to the kernel
+ * so that they are zero-filled again when next touched
+ */
+static void zero_range(unsigned char *lo, unsigned char *hi)
+{
+    uintptr_t page = mem_pagesize();
+    unsigned char *plo =
+        (unsigned char *)(((uintptr_t)lo + page - 1) & ~(page - 1));
+    unsigned char *phi = (unsigned char *)((uintptr_t)hi & ~(page - 1));
+    if (plo >= phi)
+    {
+        memset(lo, 0, hi - lo);
+        return;
+    }
+    memset(lo, 0, plo - lo);
+    madvise(plo, phi - plo, MADV_DONTNEED);
+    memset(phi, 0, hi - phi);
+}
+
+/*
+ * Forget every mapping.  In dense mode the ranges are zeroed as by
+ * mem_unmap, since they lie above dirty_top and the heap may grow over them.
+ */
+static void clear_maps(void)
+{
+    while (maps)
+    {
+        mem_map_t *m = maps;
+        maps = m->next;
+        if (!sparse)
+            zero_range(m->lo, m->lo + m->len);
+        free(m);
+    }
+    map_lo = mem_max_addr;
+    mapped_bytes = 0;
+}
+
+/* Record the largest footprint seen */
+static void update_peak(void)
+{
+    size_t bytes = (size_t)(mem_brk - heap) + mapped_bytes;
+    if (bytes > peak_bytes)
+        peak_bytes = bytes;
+}
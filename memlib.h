@@ -22,15 +22,16 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends or shrinks the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * gives the top -incr bytes of the heap back; they may not be accessed
+ * again until the heap is extended over them.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -61,6 +62,67 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the most memory the heap and the mappings together have
+ *        used since the heap was last reset.
+ * @return The peak footprint, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
+/**
+ * @brief Returns how many times mem_sbrk() has been called since the heap
+ *        was last reset.
+ * @return The number of calls, including failed and negative ones
+ */
+size_t mem_sbrk_calls(void);
+
+/**
+ * @brief Finds where zero-filled memory starts for a growing heap.
+ *
+ * Unlike sbrk(), mem_sbrk() does not clear memory that the heap has used
+ * before, whether it was given back with a negative increment or belonged
+ * to a run before the last mem_reset_brk(). Memory above the returned
+ * address has never been used, and is zero.
+ *
+ * @return The lowest address at which new heap memory is known to be zero
+ */
+void *mem_zero_lo(void);
+
+/**
+ * @brief Maps a region of memory outside the heap, like an anonymous mmap().
+ *
+ * Mappings are carved from the top of the address range the heap grows
+ * into, so they and the heap can each use what the other does not.
+ *
+ * @param[in] len The minimum length of the region, in bytes
+ * @return The page-aligned, zero-filled start of the region, or NULL if
+ *         there is no room for it
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Gives back a region returned by mem_map(), like munmap().
+ *
+ * @param[in] addr The start of the region
+ * @param[in] len The length that was passed to mem_map()
+ * @return 0 on success, -1 if the arguments do not name a mapping
+ */
+int mem_unmap(void *addr, size_t len);
+
+/**
+ * @brief Returns the number of bytes in live mappings.
+ * @return The total length of the regions mapped by mem_map()
+ */
+size_t mem_mapsize(void);
+
+/**
+ * @brief Checks whether an address range lies within a live mapping.
+ * @param[in] lo The first byte of the range
+ * @param[in] hi The last byte of the range
+ * @return True if the whole range is inside one mapping
+ */
+bool mem_is_mapped(const void *lo, const void *hi);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -0,0 +1,205 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# Generates the seglist size classes of mm.c from the request sizes of
+# traces (.rep files) or of profiles (any other file, with one line
+# "<bytes> <count>" per request size). The block sizes that make up a large
+# share of the requests get an exact-fit class of their own, and the rest
+# of the range below the large-block tree is cut into coarse classes, each
+# split where the requests in it divide in half, until the class budget is
+# spent. The result is a header that mm.c compiles in with -DMM_SIZE_CLASSES.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-o OUTFILE] [-n CLASSES] [-x HOT] [-s SHARE] [-t TAG] FILE...\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h          Print this message\n";
+    printf STDERR "  -o OUTFILE  Write the header to OUTFILE (default stdout)\n";
+    printf STDERR "  -n CLASSES  Number of classes, at most 63 (default 63)\n";
+    printf STDERR "  -x HOT      Most exact-fit classes for hot sizes (default 24)\n";
+    printf STDERR "  -s SHARE    Percentage of requests a size needs to be hot (default 0.5)\n";
+    printf STDERR "  -t TAG      Header bytes: 8 (default), or 4 with -DMM_COMPACT\n";
+    die "\n";
+}
+
+# Block layout of mm.c: a header of tsize bytes, block sizes rounded up to
+# dsize, and free blocks of tree_min_size bytes and more kept out of the
+# seglists. A request of dsize - tsize bytes or less gets a dsize block.
+$dsize = 16;
+$tree_min = 16384;
+$slots = $tree_min / $dsize - 1;   # Block sizes 16, 32, ... tree_min - 16
+
+getopts('ho:n:x:s:t:');
+
+if ($opt_h || @ARGV == 0) {
+    usage($0);
+}
+
+$classes = defined($opt_n) ? $opt_n : 63;
+$max_hot = defined($opt_x) ? $opt_x : 24;
+$share = defined($opt_s) ? $opt_s : 0.5;
+$tsize = defined($opt_t) ? $opt_t : 8;
+if ($tsize != 8 && $tsize != 4) {
+    usage("The header size must be 8, or 4 for -DMM_COMPACT");
+}
+if ($classes < 12 || $classes > 63) {
+    usage("The number of classes must be between 12 and 63");
+}
+
+# Histogram of block sizes, indexed by slot (size / dsize - 1)
+@hist = (0) x $slots;
+$total = 0;
+
+sub count_request
+{
+    my ($bytes, $n) = @_;
+    return if ($bytes <= 0 || $n <= 0);
+    my $asize = int(($bytes + $tsize + $dsize - 1) / $dsize) * $dsize;
+    return if ($asize >= $tree_min);
+    $hist[$asize / $dsize - 1] += $n;
+    $total += $n;
+}
+
+foreach $file (@ARGV) {
+    open(IN, "<", $file) || die "Couldn't open input file '$file'\n";
+    if ($file =~ /\.rep$/) {
+        # Skip the four header lines
+        for ($i = 0; $i < 4; $i++) {
+            <IN>;
+        }
+        while (<IN>) {
+            @f = split;
+            if ($f[0] eq "a" || $f[0] eq "r") {
+                count_request($f[2], 1);
+            } elsif ($f[0] eq "A") {
+                count_request($f[3], $f[2]);
+            }
+        }
+    } else {
+        while (<IN>) {
+            next if (/^\s*(#|$)/);
+            @f = split;
+            count_request($f[0], $f[1]);
+        }
+    }
+    close(IN);
+}
+if ($total == 0) {
+    die "No requests below $tree_min bytes in the input\n";
+}
+
+# A class is a range of slots. Cuts holds the first slot of every class
+# but the first: the 16-byte blocks always have a class of their own, and
+# the powers of two start classes so that no class is wider than 2x.
+%cuts = (1 => 1);
+for ($size = 64; $size < $tree_min; $size *= 2) {
+    $cuts{$size / $dsize - 1} = 1;
+}
+
+# Hot sizes get an exact-fit class
+@by_count = sort { $hist[$b] <=> $hist[$a] || $a <=> $b } (1 .. $slots - 1);
+@hot = ();
+foreach $slot (@by_count) {
+    last if (@hot >= $max_hot || $hist[$slot] * 100.0 < $share * $total);
+    last if (keys(%cuts) + 2 >= $classes);
+    push(@hot, $slot);
+    $cuts{$slot} = 1;
+    $cuts{$slot + 1} = 1 if ($slot + 1 < $slots);
+}
+
+# Split the class with the most requests times relative width at the slot
+# where its requests divide in half, until every class is used. Empty
+# classes still count a little, so the coarse classes stay geometric where
+# the input has no requests at all.
+while (keys(%cuts) + 1 < $classes) {
+    @starts = sort { $a <=> $b } (0, keys(%cuts));
+    $best = -1;
+    $best_cost = 0;
+    for ($i = 0; $i < @starts; $i++) {
+        $lo = $starts[$i];
+        $hi = ($i + 1 < @starts) ? $starts[$i + 1] - 1 : $slots - 1;
+        next if ($hi == $lo);
+        $mass = 0;
+        for ($s = $lo; $s <= $hi; $s++) {
+            $mass += $hist[$s];
+        }
+        $cost = ($mass + 0.01 * $total / $slots) * ($hi - $lo) / ($lo + 1);
+        if ($cost > $best_cost) {
+            ($best, $best_lo, $best_hi, $best_mass) = ($i, $lo, $hi, $mass);
+            $best_cost = $cost;
+        }
+    }
+    last if ($best < 0);
+    # First slot past the lower half of the requests, or the middle
+    $cut = int(($best_lo + $best_hi + 1) / 2);
+    if ($best_mass > 0) {
+        $sum = 0;
+        for ($s = $best_lo; $s < $best_hi; $s++) {
+            $sum += $hist[$s];
+            if (2 * $sum >= $best_mass) {
+                $cut = $s + 1;
+                last;
+            }
+        }
+    }
+    $cuts{$cut} = 1;
+}
+
+# Class of every slot
+@starts = sort { $a <=> $b } (0, keys(%cuts));
+@index = ();
+@limits = ();
+for ($i = 0; $i < @starts; $i++) {
+    $hi = ($i + 1 < @starts) ? $starts[$i + 1] - 1 : $slots - 1;
+    for ($s = $starts[$i]; $s <= $hi; $s++) {
+        push(@index, $i);
+    }
+    push(@limits, ($hi + 1) * $dsize);
+}
+
+if ($opt_o) {
+    open(OUT, ">", $opt_o) || die "Couldn't open output file '$opt_o'\n";
+} else {
+    open(OUT, ">&STDOUT");
+}
+$n = @starts;
+$hot_sizes = join(" ", map { ($_ + 1) * $dsize } sort { $a <=> $b } @hot);
+print OUT "/*\n";
+print OUT " * size_classes.h - Seglist size classes for mm.c, generated by\n";
+print OUT " * mkclasses.pl from $total requests. Do not edit.\n";
+print OUT " *\n";
+print OUT " * Exact-fit classes for the hot block sizes:\n";
+print OUT wrap(" *   ", $hot_sizes eq "" ? "none" : $hot_sizes);
+print OUT " *\n";
+print OUT " * Largest block size of each of the $n classes:\n";
+print OUT wrap(" *   ", join(" ", @limits));
+print OUT " */\n\n";
+print OUT "/** \@brief Seglist of a block of size (i + 1) * dsize, by i */\n";
+print OUT "static const uint8_t size_class_index[$slots] = {\n";
+for ($i = 0; $i < $slots; $i += 16) {
+    $last = ($i + 15 < $slots) ? $i + 15 : $slots - 1;
+    print OUT "    ", join(", ", @index[$i .. $last]), ",\n";
+}
+print OUT "};\n";
+close(OUT);
+
+# Returns text broken into comment lines of at most 80 columns
+sub wrap
+{
+    my ($prefix, $text) = @_;
+    my $out = "";
+    my $line = $prefix;
+    foreach $word (split(/ /, $text)) {
+        if (length($line) + length($word) > 79 && $line ne $prefix) {
+            $out .= "$line\n";
+            $line = $prefix;
+        }
+        $line .= ($line eq $prefix) ? $word : " $word";
+    }
+    return "$out$line\n";
+}
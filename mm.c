@@ -21,6 +21,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -29,9 +30,48 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#ifdef MM_SHM_STATS
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef MM_TRACE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#ifdef MM_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
+#ifdef MM_SHM_STATS
+#include "mmshm.h"
+#endif
+
+#ifdef MM_SIZE_CLASSES
+#ifdef MM_TLSF
+#error "MM_SIZE_CLASSES replaces the seglist classes, which MM_TLSF does not use"
+#endif
+#include "size_classes.h"
+#endif
+
 /* Do not change the following! */
 
 #ifdef DRIVER
@@ -85,8 +125,33 @@ static const size_t wsize = sizeof(word_t);
 /** @brief Double word size (bytes) */
 static const size_t dsize = 2 * wsize;
 
-/** @brief Minimum block size (bytes) */
-static const size_t min_block_size = 2 * dsize;
+/*
+ * With MM_COMPACT, headers and footers are 32 bits, and the links of a free
+ * block are 32-bit offsets from the start of the heap instead of pointers.
+ * That saves 4 bytes in every block and halves the smallest free block, at
+ * the price of a heap, and blocks, of less than 4 GiB.
+ */
+#ifdef MM_COMPACT
+typedef uint32_t tag_t;
+typedef uint32_t link_t;
+#else
+typedef word_t tag_t;
+typedef struct block *link_t;
+#endif
+
+/** @brief Header and footer size (bytes) */
+static const size_t tsize = sizeof(tag_t);
+
+/** @brief Minimum size of a free block: header, two links and footer */
+static const size_t min_block_size = 2 * sizeof(tag_t) + 2 * sizeof(link_t);
+
+#ifdef MM_COMPACT
+/**
+ * @brief Most bytes of heap, or of a mapping, that 32-bit tags and offsets
+ *        can describe, less room for one more extent.
+ */
+static const size_t compact_max = ((size_t)1 << 32) - (1 << 20);
+#endif
 
 /**
  * TODO: explain what chunksize is
@@ -95,24 +160,104 @@ static const size_t min_block_size = 2 * dsize;
  */
 static const size_t chunksize = (1 << 12);
 
+/**
+ * @brief A free block at least this large at the end of the heap is given
+ *        back to memlib as soon as it is freed, except for trim_pad bytes
+ *        kept so that the next small request need not grow the heap again.
+ */
+static const size_t trim_threshold = (1 << 20);
+static const size_t trim_pad = (1 << 18);
+
+/**
+ * @brief Largest step the heap grows by beyond what a request needs, and
+ *        the share of the heap (1 / grow_ratio) a step may add at most.
+ */
+static const size_t grow_max = (1 << 18);
+static const size_t grow_ratio = 64;
+
+/**
+ * @brief Blocks at least this large get a mapping of their own instead of
+ *        a place in the heap, and are unmapped as soon as they are freed.
+ */
+static const size_t map_threshold = (1 << 18);
+
+/**
+ * @brief Most bytes mm_malloc_batch carves out of a single free block; larger
+ *        batches take several fits.
+ */
+static const size_t batch_fit_size = (1 << 16);
+
+/**
+ * @brief Blocks a quick list may hold. Freeing one more into a full list
+ *        consolidates every quick list of the arena.
+ */
+static const size_t quick_depth = 32;
+
+/**
+ * @brief Freeing a block that coalesces to at least this size consolidates
+ *        the quick lists too, since the blocks on them may be all that keeps
+ *        it from growing, or from being trimmed.
+ */
+static const size_t quick_flush_size = (1 << 16);
+
 /**
  * TODO: explain what alloc_mask is
  * Read the allocated bit from header by the least significant bit.
  */
-static const word_t alloc_mask = 0x1;
-static const word_t pre_alloc_mask = 0x2;
-static const word_t pre_dsize_mask = 0x4;
+static const tag_t alloc_mask = 0x1;
+static const tag_t pre_alloc_mask = 0x2;
+static const tag_t pre_dsize_mask = 0x4;
+static const tag_t mapped_mask = 0x8;
 /**
  * TODO: explain what size_mask is
  * Since the size is multiple of dsize due to alignment, the 4 least significant
  * bits must be 0 for the representation of size.
  */
-static const word_t size_mask = ~(word_t)0xF;
+static const tag_t size_mask = ~(tag_t)0xF;
+
+#if !defined(MM_SIZE_CLASSES) || defined(MM_ADDRESS_ORDER)
+/** @brief Largest block size with a seglist of its own (a power of two) */
+static const size_t exact_class_limit = 128;
+#endif
+#ifndef MM_SIZE_CLASSES
+static const int exact_class_log2 = 7;
+#endif
+
+#ifdef MM_ADDRESS_ORDER
+/**
+ * @brief Smallest free block kept in address order on its seglist, three
+ *        powers of two above the exact-fit classes (1 KiB).
+ *
+ * Lists of smaller blocks are the long, busy ones, where the sorted
+ * insertion walk and the loss of the LIFO lists' recently freed, cache-warm
+ * blocks cost the most throughput; on the supplied traces ordering them
+ * bought no utilization that survives a change of the other classes.
+ */
+static const size_t ordered_min_size = exact_class_limit << 3;
+#endif
+
+#ifndef MM_TLSF
+/**
+ * @brief Smallest free block kept in the large-block tree instead of a
+ *        seglist. It must be a power of two, so no seglist straddles it.
+ */
+static const size_t tree_min_size = (1 << 14);
+#endif
+
+#ifdef MM_TLSF
+/** @brief Second-level lists in each first-level row (log2 and count) */
+static const int tlsf_sl_bits = 3;
+static const int tlsf_sl_lists = 8;
+#elif !defined(MM_SIZE_CLASSES)
+/** @brief Seglists per power of two above exact_class_limit (log2 and count) */
+static const int seglist_subclass_bits = 2;
+static const int seglist_subclasses = 4;
+#endif
 
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
     /** @brief Header contains size + allocation flag */
-    word_t header;
+    tag_t header;
 
     /**
      * @brief A pointer to the block payload.
@@ -133,7 +278,13 @@ typedef struct block {
      * in order to store additional types of data in the payload memory.
      */
     union {
-        struct block *pointer;
+        link_t pointer;
+        /** @brief Links of a free block in the large-block tree */
+        struct {
+            link_t left;
+            link_t right;
+            link_t parent;
+        } node;
         char payload[0];
     };
 
@@ -150,15 +301,432 @@ typedef struct block {
      */
 } block_t;
 
+#ifdef MM_TLSF
+/**
+ * @brief Number of first-level rows of the TLSF index. Row 0 holds blocks
+ *        below exact_class_limit, row r > 0 the range [2^(r+6), 2^(r+7)),
+ *        and each row is split into tlsf_sl_lists second-level lists.
+ */
+#define TLSF_ROWS 32
+
+/** @brief Number of free lists: every (row, column) pair but the empty (0, 0) */
+#define NUM_SEGLISTS (TLSF_ROWS * 8 - 1)
+#else
+/** @brief Number of segregated free lists in an arena, one per bit of a word */
+#define NUM_SEGLISTS 64
+#endif
+
+/*
+ * Small requests are served from slab runs in the single-arena build. The
+ * thread caches of MM_THREADS are keyed by block header, which slab objects
+ * do not have, so the threaded build keeps every object in a block.
+ */
+#if !defined(MM_THREADS) && !defined(MM_NO_SLAB)
+#define MM_SLAB
+#endif
+
+/** @brief Number of quick lists, one per block size up to 512 bytes */
+#define QUICK_BINS 32
+
+/**
+ * @brief Event counters of the MM_STATS build, by index into
+ *        arena_stats_t.count.
+ * Without MM_STATS nothing is counted and the calls that name them compile
+ * away.
+ */
+enum stat_counter {
+    STAT_FIT_SEARCHES,  // find_fit calls
+    STAT_FIT_PROBES,    // Free blocks find_fit looked at
+    STAT_FIT_MISSES,    // find_fit calls that returned NULL
+    STAT_SPLITS,        // Free remainders split off an allocated block
+    STAT_COALESCE_NONE, // Freed blocks with no free neighbour
+    STAT_COALESCE_PREV, // Freed blocks merged with the previous block
+    STAT_COALESCE_NEXT, // Freed blocks merged with the next block
+    STAT_COALESCE_BOTH, // Freed blocks merged with both
+    STAT_EXTENDS,       // extend_heap calls that grew the heap
+    STAT_EXTEND_BYTES,  // Bytes they grew it by
+    STAT_TRIMS,         // Times the end of the heap was given back
+    STAT_COUNTERS
+};
+
+#if NUM_SEGLISTS > MM_STATS_LISTS
+#error "struct mm_stats has no room for every seglist"
+#endif
+
+#ifdef MM_STATS
+/**
+ * @brief The counters of one arena in the MM_STATS build. They are kept
+ *        outside the heap, so that counting leaves the arena header, and
+ *        the utilization measured, as they are in the plain build.
+ */
+typedef struct arena_stats {
+    size_t count[STAT_COUNTERS];     // Event counts, by stat_counter
+    size_t max_probes;               // Most blocks one find_fit looked at
+    size_t blocks[NUM_SEGLISTS + 1]; // Blocks per seglist, then tree
+    size_t peak[NUM_SEGLISTS + 1];   // Most blocks ever held
+} arena_stats_t;
+#endif
+
+#ifdef MM_SLAB
+/** @brief Bytes in one slab run, and the granule the slab table maps */
+#define SLAB_RUN_SIZE 2048
+
+/** @brief Number of slab size classes, spaced dsize apart */
+#define SLAB_CLASSES 8
+
+/** @brief Words of free-slot bitmap, enough for the smallest class */
+#define SLAB_MAP_WORDS 2
+
+/**
+ * @brief Header of a slab run: the payload of one allocated block, cut into
+ *        equal slots of a single size class.
+ *
+ * Slots have no header or footer. A pointer is known to be a slot when the
+ * arena's slab table maps it to a run.
+ */
+typedef struct slab {
+    struct slab *next; // Next run of this class that has a free slot
+    struct slab *prev; // Previous run of this class that has a free slot
+    word_t free_map[SLAB_MAP_WORDS]; // One bit set for each free slot
+    uint32_t slot_size;  // Bytes per slot
+    uint32_t free_count; // Number of bits set in free_map
+} slab_t;
+
+/**
+ * @brief Slab table entry. Runs are not aligned, so each run is entered
+ *        once for every SLAB_RUN_SIZE granule of the address space it
+ *        overlaps, which is at most two.
+ */
+typedef struct slab_entry {
+    word_t granule; // Address / SLAB_RUN_SIZE
+    slab_t *slab;   // A run overlapping the granule, or NULL if unused
+} slab_entry_t;
+#endif
+
+/**
+ * @brief Allocator state for one independent heap.
+ *
+ * The arena header is stored at the very start of the memory it manages,
+ * directly before the prologue footer, so the only globals are pointers.
+ * Whether the block before the epilogue is allocated or dsize is kept in the
+ * pre_alloc and pre_dsize bits of the epilogue header itself.
+ *
+ * Every byte from zero_from up to the epilogue is known to be zero, except
+ * for the tags of the last block: its header, its first three payload words
+ * (seglist or tree links) and its footer. calloc only clears the part of a
+ * block below zero_from. The mark moves up past every block handed out and
+ * past the tags left behind when the last block is merged into another.
+ *
+ * With MM_THREADS, threads that free a block owned by another arena push it
+ * onto remote_frees instead of taking the arena lock. The queue is a
+ * lock-free stack linked through the first payload word; any thread may
+ * push, and whoever next mallocs under the lock takes the whole stack at
+ * once, so there is a single consumer and no ABA problem.
+ *
+ * With MM_TLSF the occupancy map has two levels: bit r of fl_map is set
+ * when row r of the index has any non-empty list, and bit c of sl_map[r]
+ * when the list in column c of that row is non-empty. Without it, free
+ * blocks of tree_min_size bytes or more are not on a seglist but in a splay
+ * tree rooted at tree_root, ordered by size and then address.
+ */
+typedef struct arena {
+    block_t *segregatehead[NUM_SEGLISTS]; // Root pointers for seglists.
+#ifdef MM_TLSF
+    word_t fl_map;              // Bit r is set when sl_map[r] is not zero.
+    uint8_t sl_map[TLSF_ROWS]; // Bit c is set when list (r, c) is not empty.
+#else
+    word_t seglist_map; // Bit i is set when segregatehead[i] is not empty.
+    block_t *tree_root; // Free blocks of at least tree_min_size bytes.
+#endif
+    block_t *heap_start; // First block of the arena's first extent.
+    block_t *epilogue;   // Epilogue header of the arena's newest extent.
+    char *zero_from;     // Start of the zero-filled tail of the heap.
+    size_t grow_step;    // Least the heap grows by when it has to.
+    block_t *quick[QUICK_BINS];     // Freed blocks not yet coalesced, by size
+    size_t quick_count[QUICK_BINS]; // Blocks on each quick list
+    size_t quick_blocks;            // Blocks on all quick lists
+    size_t quick_hits;    // Mallocs served from a quick list
+    size_t quick_flushes; // Consolidation passes
+    size_t quick_flushed; // Blocks the consolidation passes coalesced
+#if defined(MM_STATS) && defined(MM_THREADS)
+    arena_stats_t *stats; // This arena's counters, outside the heap
+#endif
+#ifdef MM_SHM_STATS
+    struct mm_shm_slot *shm_slot; // This arena's counters on the stats page
+#endif
+#ifdef MM_THREADS
+    pthread_mutex_t lock; // Protects everything reachable from the arena.
+    _Atomic(block_t *) remote_frees; // Blocks freed by non-owning threads
+#endif
+#ifdef MM_SLAB
+    slab_t *slab_partial[SLAB_CLASSES]; // Runs with a free slot, per class
+    slab_entry_t *slab_table; // Open-addressed granule -> run map, or NULL
+    size_t slab_capacity; // Entries in slab_table (power of two)
+    size_t slab_entries;  // Entries in use
+#endif
+} arena_t;
+
 /* Global variables */
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
-static block_t *segregatehead[14]; // It is the start root pointer for seglists.
-static bool last_block_dsize = false;   // We update the bool value for the last
-                                        // block whether its size is dsize.
-static bool last_block_prealloc = true; // We update the bool value for the last
-                                        // block whether it is allocated.
+#ifdef MM_THREADS
+/** @brief Maximum number of arenas threads are spread over */
+#define MAX_ARENAS 16
+
+/** @brief Maximum number of separately sbrk'd extents over all arenas */
+#define MAX_EXTENTS (1 << 16)
+
+/** @brief Number of thread cache bins, one per block size up to 1 KiB */
+#define TCACHE_BINS 64
+
+/** @brief Arenas created per online CPU, up to MAX_ARENAS */
+static const size_t arenas_per_cpu = 2;
+
+/**
+ * @brief Minimum size of a new extent. Used when another arena has moved the
+ * break since this arena last grew, so it cannot extend in place.
+ */
+static const size_t extent_size = (1 << 18);
+
+/** @brief Number of blocks a thread may cache for each block size */
+static const size_t tcache_depth = 8;
+
+/** @brief A contiguous piece of the heap from which one arena carves blocks */
+typedef struct extent {
+    char *lo;       // First byte of the extent
+    arena_t *owner; // Arena whose lock protects its blocks
+} extent_t;
+
+/**
+ * @brief Per-thread LIFO caches of blocks that are free from the program's
+ * point of view but still marked allocated in their arena. Blocks are linked
+ * through their first payload word, and are binned by exact block size.
+ */
+typedef struct tcache {
+    block_t *bins[TCACHE_BINS];
+    size_t count[TCACHE_BINS];
+    arena_t *home;   // Arena this thread allocates from
+    bool registered; // Whether the thread exit destructor is armed
+#ifdef MM_SHM_STATS
+    size_t shm_mallocs; // Counts not yet added to the stats page
+    size_t shm_frees;
+    size_t shm_live;
+    size_t shm_pending; // Operations counted since the last flush
+#endif
+} tcache_t;
+
+static arena_t *arenas[MAX_ARENAS]; // Created lazily, indexed round-robin
+static size_t num_arenas;           // How many arenas threads spread over
+static atomic_size_t next_arena;    // Round-robin counter for new threads
+static extent_t extents[MAX_EXTENTS];
+static atomic_size_t num_extents;
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool initialized;
+static pthread_key_t tcache_key;
+static bool tcache_key_created = false;
+
+/** @brief The calling thread's block cache */
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+
+/** @brief Arena the calling thread is currently operating on (locked) */
+static __thread arena_t *arena __attribute__((tls_model("initial-exec")));
+#else
+/** @brief The single arena; NULL until mm_init has run */
+static arena_t *arena = NULL;
+#endif
+
+#ifdef MM_COMPACT
+/** @brief Start of the heap, which links are offsets from */
+static char *heap_base;
+#endif
+
+#ifdef MM_STATS
+#ifdef MM_THREADS
+/** @brief Counters of every arena, handed out as arenas are created */
+static arena_stats_t stats_slot[MAX_ARENAS];
+
+/** @brief Slots handed out to arenas since mm_init */
+static size_t stats_slots_used;
+#else
+/** @brief Counters of the single arena */
+static arena_stats_t stats_single;
+#endif
+#endif
+
+#ifdef MM_SHM_STATS
+#if NUM_SEGLISTS + 1 > MM_SHM_CLASSES
+#error "The stats page has no room for every free list"
+#endif
+#if defined(MM_THREADS) && MAX_ARENAS > MM_SHM_SLOTS
+#error "The stats page has no slot for every arena"
+#endif
+
+/** @brief Stands in for the stats page until, or if, it can be created */
+static struct mm_shm_page shm_private;
+
+/** @brief The stats page the counters are published on */
+static struct mm_shm_page *shm = &shm_private;
+
+/** @brief Slots handed out to arenas since mm_init */
+static size_t shm_slots_used;
+#endif
+
+#ifdef MM_TRACE
+/**
+ * @brief Events each thread's ring holds, a power of two. Once it is full,
+ *        every new event overwrites the oldest.
+ */
+#define TRACE_EVENTS (1 << 15)
+
+/** @brief Bits of an event stamp below its type that hold clock ticks */
+static const uint64_t trace_ticks_mask = ((uint64_t)1 << 56) - 1;
+
+#ifdef MM_THREADS
+/** @brief Whether a ring is in use, by trace_ring_t.state */
+enum trace_ring_state {
+    TRACE_RING_LIVE,   // A running thread records into it
+    TRACE_RING_EXITED, // Its thread has exited, and it is yet to be dumped
+    TRACE_RING_FREE    // Empty; the next new thread takes it over
+};
+#endif
+
+/** @brief The latest events of one thread */
+typedef struct trace_ring {
+    struct trace_ring *next; // Ring made before this one
+    uint64_t tid;            // Thread that records into it
+    uint64_t head;           // Events recorded since mm_init
+#ifdef MM_THREADS
+    _Atomic int state; // By trace_ring_state
+#endif
+    struct mm_trace_event event[TRACE_EVENTS];
+} trace_ring_t;
+
+/** @brief Clock ticks and CLOCK_MONOTONIC nanoseconds at mm_init */
+static uint64_t trace_ticks0, trace_ns0;
+
+#ifdef MM_THREADS
+/**
+ * @brief Every ring, newest first. The ring of an exited thread stays on
+ *        the list, and is reused once mm_trace_dump has written it out.
+ */
+static _Atomic(trace_ring_t *) trace_rings;
+
+/** @brief The calling thread's ring, NULL until it records an event */
+static __thread trace_ring_t *trace_ring
+    __attribute__((tls_model("initial-exec")));
+
+/** @brief Holds each thread's ring, to give it up when the thread exits */
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+#else
+/** @brief The one ring, NULL until the first event */
+static trace_ring_t *trace_rings;
+static trace_ring_t *trace_ring;
+#endif
+#endif
+
+#ifdef MM_PROFILE
+#ifdef DRIVER
+#error "MM_PROFILE records the call sites of a real program; build mm.so"
+#endif
+
+/** @brief Frames kept of each sampled call stack */
+#define PROF_DEPTH 16
+
+/** @brief Frames of the profiler and the allocator itself left out */
+#define PROF_SKIP 2
+
+/** @brief Entries in the table of live samples, a power of two */
+#define PROF_SAMPLES (1 << 16)
+
+/** @brief Entries in the table of call sites, a power of two */
+#define PROF_SITES (1 << 12)
+
+/** @brief Buckets of the filter that free checks, a power of two */
+#define PROF_FILTER (1 << 14)
+
+/** @brief Mean bytes allocated between samples, unless MM_PROFILE_RATE */
+static const size_t prof_default_rate = (1 << 19);
+
+/** @brief A call stack, with the estimated allocations made from it */
+typedef struct prof_site {
+    uintptr_t frames[PROF_DEPTH]; // Return addresses, innermost first
+    size_t depth;                 // Frames in use; 0 for an unused entry
+    double live_bytes;            // Estimated bytes allocated and not freed
+    double live_objs;             // Estimated allocations not freed
+    double peak_bytes;            // live_bytes when the heap was at its peak
+    double peak_objs;             // live_objs at the same time
+    double total_bytes;           // Estimated bytes ever allocated
+    double total_objs;            // Estimated allocations ever made
+} prof_site_t;
+
+/** @brief A sampled allocation that has not been freed */
+typedef struct prof_sample {
+    void *bp;          // Payload, or NULL for an unused entry
+    prof_site_t *site; // Where it was allocated
+    double bytes;      // Bytes the sample stands for
+    double objs;       // Allocations the sample stands for
+} prof_sample_t;
+
+/** @brief Live samples, open-addressed by payload; mapped at mm_init */
+static prof_sample_t *prof_samples;
+
+/** @brief Call sites, open-addressed by stack hash; mapped at mm_init */
+static prof_site_t *prof_sites;
+
+/** @brief Live samples in prof_samples, and sites in prof_sites */
+static size_t prof_sample_count, prof_site_count;
+
+/** @brief Samples lost because a table was full */
+static size_t prof_dropped;
+
+/** @brief Mean bytes between samples; 0 when profiling is off */
+static double prof_rate;
+
+/**
+ * @brief Estimated live bytes now, at their peak, and when the peak figures
+ *        of the sites were last taken.
+ */
+static double prof_live, prof_peak, prof_snapshot;
+
+/**
+ * @brief Samples per bucket of payload hashes. free looks the payload up
+ *        in prof_samples only when its bucket is not empty.
+ */
+static _Atomic uint16_t prof_filter[PROF_FILTER];
+
+/**
+ * @brief File the profile is dumped to at exit. Dumps on a signal add a
+ *        number to the name.
+ */
+static char prof_path[256];
+
+/** @brief Set when a signal could not dump the profile at once */
+static volatile sig_atomic_t prof_dump_pending;
+
+/** @brief Dumps taken on a signal so far */
+static uint64_t prof_dumps;
+
+#ifdef MM_THREADS
+/** @brief Protects the tables and the estimates above */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Bytes the calling thread may still allocate before a sample */
+static __thread int64_t prof_countdown
+    __attribute__((tls_model("initial-exec")));
+
+/** @brief The calling thread's random state, 0 until its first sample */
+static __thread uint64_t prof_random
+    __attribute__((tls_model("initial-exec")));
+
+/** @brief Set while the calling thread is inside the profiler */
+static __thread bool prof_busy __attribute__((tls_model("initial-exec")));
+#else
+static int64_t prof_countdown;
+static uint64_t prof_random;
+static bool prof_busy;
+#endif
+#endif
 /*
  *****************************************************************************
  * The functions below are short wrapper functions to perform                *
@@ -189,6 +757,15 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
+// Returns the higher of two addresses.
+static char *max_addr(char *x, char *y) {
+    return (x > y) ? x : y;
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -211,8 +788,8 @@ static size_t round_up(size_t size, size_t n) {
  * @param[in] alloc True if the block is allocated
  * @return The packed value
  */
-static word_t pack(size_t size, bool alloc) {
-    word_t word = size;
+static tag_t pack(size_t size, bool alloc) {
+    tag_t word = (tag_t)size;
     if (alloc) {
         word |= alloc_mask;
     }
@@ -228,7 +805,7 @@ static word_t pack(size_t size, bool alloc) {
  * @param[in] word
  * @return The size of the block represented by the word
  */
-static size_t extract_size(word_t word) {
+static size_t extract_size(tag_t word) {
     return (word & size_mask);
 }
 
@@ -273,10 +850,10 @@ static void *header_to_payload(block_t *block) {
  * @return A pointer to the block's footer
  * @pre The block must be a valid block, not a boundary tag.
  */
-static word_t *header_to_footer(block_t *block) {
+static tag_t *header_to_footer(block_t *block) {
     dbg_requires(get_size(block) >= min_block_size &&
                  "Called header_to_footer on the epilogue block");
-    return (word_t *)(block->payload + get_size(block) - dsize);
+    return (tag_t *)((char *)block + get_size(block) - tsize);
 }
 
 /**
@@ -286,19 +863,38 @@ static word_t *header_to_footer(block_t *block) {
  * @return A pointer to the start of the block
  * @pre The footer must be the footer of a valid block, not a boundary tag.
  */
-static block_t *footer_to_header(word_t *footer) {
+static block_t *footer_to_header(tag_t *footer) {
     size_t size = extract_size(*footer);
     dbg_assert(size >= min_block_size &&
                "Called footer_to_header on the prologue block");
-    return (block_t *)((char *)footer + wsize - size);
+    return (block_t *)((char *)footer + tsize - size);
+}
+
+// Returns the block a free-list or tree link refers to, or NULL.
+static block_t *to_block(link_t link) {
+#ifdef MM_COMPACT
+    return (link == 0) ? NULL : (block_t *)(heap_base + link);
+#else
+    return link;
+#endif
+}
+
+// Returns the link that refers to a block, or to NULL.
+static link_t to_link(block_t *block) {
+#ifdef MM_COMPACT
+    return (block == NULL) ? 0 : (link_t)((char *)block - heap_base);
+#else
+    return block;
+#endif
 }
 
 // Since we make the min_block_size to 16, then we nned to construct a pointer
 // to the previous free block in seglists.
 static block_t *header_to_previous_pointer(block_t *block) {
     size_t size = get_size(block);
-    dbg_assert(size > dsize && "Called footer_to_header on the prologue block");
-    return (block_t *)(*(&block->pointer + 1));
+    dbg_assert(size >= min_block_size &&
+               "Called footer_to_header on the prologue block");
+    return to_block(*(&block->pointer + 1));
 }
 
 /**
@@ -312,7 +908,7 @@ static block_t *header_to_previous_pointer(block_t *block) {
  */
 static size_t get_payload_size(block_t *block) {
     size_t asize = get_size(block);
-    return asize - wsize;
+    return asize - tsize;
 }
 
 /**
@@ -323,7 +919,7 @@ static size_t get_payload_size(block_t *block) {
  * @param[in] word
  * @return The allocation status correpsonding to the word
  */
-static bool extract_alloc(word_t word) {
+static bool extract_alloc(tag_t word) {
     return (bool)(word & alloc_mask);
 }
 
@@ -340,7 +936,7 @@ static bool get_alloc(block_t *block) {
 }
 
 // Returns the allocation status for the previous block of a given header value.
-static bool extract_pre_alloc(word_t word) {
+static bool extract_pre_alloc(tag_t word) {
     return (bool)(word & pre_alloc_mask);
 }
 
@@ -354,7 +950,7 @@ static bool get_pre_alloc(block_t *block) {
 }
 
 // Returns the dsize status for the previous block of a given header value.
-static bool extract_dsize_mask(word_t word) {
+static bool extract_dsize_mask(tag_t word) {
     return (bool)(word & pre_dsize_mask);
 }
 
@@ -367,6 +963,11 @@ static bool get_dsize_mask(block_t *block) {
     return extract_dsize_mask(block->header);
 }
 
+// Returns whether a block lives in a mapping of its own, outside the heap.
+static bool is_mapped(block_t *block) {
+    return (bool)(block->header & mapped_mask);
+}
+
 /**
  * @brief Writes an epilogue header at the given address.
  *
@@ -376,12 +977,12 @@ static bool get_dsize_mask(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)mem_heap_hi() - (tsize - 1));
     block->header = pack(0, true);
 }
 
 // Check whether the footer is Heap prologue (block footer).
-static bool is_epilogue_footer(word_t *footer) {
+static bool is_epilogue_footer(tag_t *footer) {
     if (extract_size(*footer) == 0 && extract_alloc(*footer) == true) {
         return true;
     }
@@ -390,7 +991,7 @@ static bool is_epilogue_footer(word_t *footer) {
 
 // Check whether the header is epilogue header.
 static bool is_epilogue_header(block_t *block) {
-    word_t header = block->header;
+    tag_t header = block->header;
     if (extract_size(header) == 0 && extract_alloc(header) == true) {
         return true;
     }
@@ -416,13 +1017,14 @@ static void write_block(block_t *block, size_t size, bool alloc) {
     dbg_requires(size > 0);
     block->header = pack(size, alloc);
     if (size >= min_block_size) {
-        word_t *footerp = header_to_footer(block);
+        tag_t *footerp = header_to_footer(block);
         *footerp = pack(size, alloc);
     }
 }
 
 // A new function to update the size and allocation status on header and/or
-// footer, while remaining the value of pre_alloc and pre_dsize.
+// footer, while remaining the value of pre_alloc and pre_dsize. Only free
+// blocks get a footer; in an allocated block that word is payload.
 static void write_size_alloc(block_t *block, size_t size, bool alloc) {
     dbg_requires(block != NULL);
     dbg_requires(size > 0);
@@ -436,40 +1038,52 @@ static void write_size_alloc(block_t *block, size_t size, bool alloc) {
     if (alloc) {
         block->header |= alloc_mask;
     } else {
-        word_t temp = ~(alloc_mask);
+        tag_t temp = ~(alloc_mask);
         block->header = block->header & temp;
     }
-    if (size >= min_block_size) {
-        word_t *footerp = header_to_footer(block);
+    if (size >= min_block_size && !alloc) {
+        tag_t *footerp = header_to_footer(block);
         *footerp = block->header;
     }
 }
 
 // A new function to update the pre_allocation status on header and/or footer,
-// while remaining the value of others.
+// while remaining the value of others. On the epilogue only the header bit is
+// written, which records the status of the last block in the heap.
 static void write_pre_alloc(block_t *block, bool pre_alloc) {
     size_t size = get_size(block);
+    dbg_requires(block != NULL);
     if (is_epilogue_header(block)) {
+        if (pre_alloc) {
+            block->header |= pre_alloc_mask;
+        } else {
+            block->header &= ~pre_alloc_mask;
+        }
         return;
     }
-    dbg_requires(block != NULL);
     dbg_requires(size > 0);
     if (pre_alloc) {
         block->header |= pre_alloc_mask;
     } else {
-        word_t temp = ~(pre_alloc_mask);
+        tag_t temp = ~(pre_alloc_mask);
         block->header = block->header & temp;
     }
     if (size >= min_block_size && !get_alloc(block)) {
-        word_t *footerp = header_to_footer(block);
+        tag_t *footerp = header_to_footer(block);
         *footerp = block->header;
     }
 }
 
 // A new function to update the pre_dsize status on header and/or footer, while
-// remaining the value of others.
+// remaining the value of others. Like write_pre_alloc, the epilogue keeps the
+// bit for the last block in the heap.
 static void write_pre_dsize(block_t *block, bool pre_dsize) {
     if (is_epilogue_header(block)) {
+        if (pre_dsize) {
+            block->header |= pre_dsize_mask;
+        } else {
+            block->header &= ~pre_dsize_mask;
+        }
         return;
     }
     size_t size = get_size(block);
@@ -478,11 +1092,11 @@ static void write_pre_dsize(block_t *block, bool pre_dsize) {
     if (pre_dsize) {
         block->header |= pre_dsize_mask;
     } else {
-        word_t temp = ~(pre_dsize_mask);
+        tag_t temp = ~(pre_dsize_mask);
         block->header = block->header & temp;
     }
     if (size >= min_block_size && !get_alloc(block)) {
-        word_t *footerp = header_to_footer(block);
+        tag_t *footerp = header_to_footer(block);
         *footerp = block->header;
     }
 }
@@ -509,9 +1123,10 @@ static block_t *find_next(block_t *block) {
  * @param[in] block A block in the heap
  * @return The location of the previous block's footer
  */
-static word_t *find_prev_footer(block_t *block) {
+static tag_t *find_prev_footer(block_t *block) {
     // Compute previous footer position as one word before the header
-    return &(block->header) - 1;
+    // By address, as gcc takes the header for the start of an object
+    return (tag_t *)((uintptr_t)block - sizeof(tag_t));
 }
 
 /**
@@ -536,7 +1151,7 @@ static block_t *find_prev(block_t *block) {
         block_t *temp = (block_t *)((char *)block - dsize);
         return temp;
     } else {
-        word_t *footerp = find_prev_footer(block);
+        tag_t *footerp = find_prev_footer(block);
 
         // Return NULL if called on first block in the heap
         if (extract_size(*footerp) == 0) {
@@ -567,163 +1182,586 @@ static block_t *find_prev(block_t *block) {
  * @return
  */
 
-// Find the corresponding index for seglist root for the size.
+#ifdef MM_TLSF
+// Find the corresponding index for seglist root for the size. The TLSF
+// index is a row, from the position of the leading one bit, and a column,
+// from the tlsf_sl_bits below it; row 0 covers the sizes below
+// exact_class_limit in steps of dsize. List (row, column) is number
+// row * tlsf_sl_lists + column - 1, since (0, 0) would hold size 0.
+// Everything too large for the last list goes into it as well.
 int findindex(size_t size) {
-    if (size <= dsize) {
-        return 0; // The block size is dsize.
-    } else if (size <= 32) {
-        return 1; // The block size is 32(min_block_size)
-    } else if (size <= 64) {
-        return 2; // The block size is 64(2 * min_block_size)
-    } else if (size <= 96) {
-        return 3; // The block size is 96(3 * min_block_size)
-    } else if (size <= 128) {
-        return 4; // The block size is 128(4 * min_block_size)
-    } else if (size <= 256) {
-        return 5; // The block size is [129,256]
-    } else if (size <= 512) {
-        return 6; // The block size is [257,512]
-    } else if (size <= 1024) {
-        return 7; // The block size is [513,1024]
-    } else if (size <= 2048) {
-        return 8; // The block size is [1025,2048]
-    } else if (size <= 3072) {
-        return 9; // The block size is [1025,2048]
-    } else if (size <= 4096) {
-        return 10; // The block size is [2049,4096]
-    } else if (size <= 5120) {
-        return 11; // The block size is [2049,4096]
-    } else if (size <= 6144) {
-        return 12; // The block size is [2049,4096]
-    } else {
-        return 13; // The block size is larger than 4096
+    int row = 0;
+    int column = (int)(size / dsize);
+    if (size >= exact_class_limit) {
+        int log2_size = 63 - __builtin_clzll(size);
+        row = log2_size - exact_class_log2 + 1;
+        column = (int)(size >> (log2_size - tlsf_sl_bits)) &
+                 (tlsf_sl_lists - 1);
     }
+    int index = row * tlsf_sl_lists + column - 1;
+    return (index < NUM_SEGLISTS) ? index : NUM_SEGLISTS - 1;
 }
 
-// Disconnect the block from the seglist.
-static void disconnect(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires(get_size(block) != 0 &&
-                 "Called find_next on the last block in the heap");
-    size_t block_size = get_size(block);
-    int index = findindex(block_size);
-    block_t *next = NULL;
-    block_t *previous = NULL;
-    if (index == 0 && block_size <= dsize) {
-        if ((void *)(segregatehead[index]) == (void *)block) {
-            next = block->pointer;
-            segregatehead[index] = next;
-            block->pointer = NULL;
-
-        } else if (segregatehead[index] == NULL) {
-            block->pointer = NULL;
-        } else {
-            block_t *temp = segregatehead[index];
-            block_t *tempnext = NULL;
-            while (temp != NULL) {
-                if (temp->pointer == block) {
-                    tempnext = block->pointer;
-                    temp->pointer = tempnext;
-                    block->pointer = NULL;
-                    break;
-                } else {
-                    temp = temp->pointer;
-                }
-            }
-        }
-    } else {
-        if ((void *)(segregatehead[index]) ==
-            (void *)block) { // The block is the root.
-            next = block->pointer;
-            if (next) {
-                segregatehead[index] = next;
-                (*(&next->pointer + 1)) = NULL;
-                block->pointer = NULL;
-                (*(&block->pointer + 1)) = NULL;
-            } else {
-                segregatehead[index] = NULL;
-                block->pointer = NULL;
-                (*(&block->pointer + 1)) = NULL;
-            }
-        } else if (segregatehead[index] ==
-                   NULL) { // Unusual cases found when debugging.
-            block->pointer = NULL;
-            (*(&block->pointer + 1)) = NULL;
-        } else if (block->pointer == NULL && (*(&block->pointer + 1)) == NULL &&
-                   (void *)block !=
-                       (void
-                            *)(segregatehead[index])) { // Sometimes it is
-                                                        // already disconnected.
-            return;
-        } else if (block->pointer ==
-                   NULL) { // It has the previous block but not the next block.
-            previous = header_to_previous_pointer(block);
-            previous->pointer = NULL;
-            (*(&block->pointer + 1)) = NULL;
-        } else if ((*(&block->pointer + 1)) ==
-                   NULL) { // It has the next block but not the previous block.
-            next = block->pointer;
-            (*(&next->pointer + 1)) = NULL;
-            segregatehead[index] = next;
-            (*(&block->pointer + 1)) = NULL;
-            block->pointer = NULL;
-        } else { // It has the next block and the previous block.
-            next = block->pointer;
-            previous = header_to_previous_pointer(block);
-            (*(&next->pointer + 1)) = previous;
-            previous->pointer = next;
-            block->pointer = NULL;
-            (*(&block->pointer + 1)) = NULL;
-        }
-    }
+// Record that list index has become non-empty (first and second level).
+static void list_mark(int index) {
+    int row = (index + 1) >> tlsf_sl_bits;
+    int column = (index + 1) & (tlsf_sl_lists - 1);
+    arena->sl_map[row] |= (uint8_t)(1 << column);
+    arena->fl_map |= (word_t)1 << row;
 }
 
-// Link the block to the seglist. We adopt the LIFO policy.
-static void link_to_the_list(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires(get_alloc(block) == false);
-    size_t size = get_size(block);
-    int index = findindex(size);
-    block_t *root = segregatehead[index];
-    if (index == 0 && size <= dsize) {
-        if (root == NULL) {
-            segregatehead[index] = block;
-            block->pointer = NULL;
-        } else {
-            block_t *temp = segregatehead[index];
-            segregatehead[index] = block;
-            block->pointer = temp;
-        }
-    } else {
-        if (root == NULL) {
-            segregatehead[index] = block;
-            block->pointer = NULL;
-            (*(&block->pointer + 1)) = NULL;
-        } else {
-            block_t *temp = segregatehead[index];
-            if (size <= get_size(temp)) {
-                segregatehead[index] = block;
-                block->pointer = temp;
-                (*(&block->pointer + 1)) = NULL;
-                (*(&temp->pointer + 1)) = block;
-            } else {
-                segregatehead[index] = block;
-                block->pointer = temp;
-                (*(&block->pointer + 1)) = NULL;
-                (*(&temp->pointer + 1)) = block;
-            }
-        }
+// Record that list index has become empty; clear its row when it was the
+// last non-empty list in it.
+static void list_unmark(int index) {
+    int row = (index + 1) >> tlsf_sl_bits;
+    int column = (index + 1) & (tlsf_sl_lists - 1);
+    arena->sl_map[row] &= (uint8_t)~(1 << column);
+    if (arena->sl_map[row] == 0) {
+        arena->fl_map &= ~((word_t)1 << row);
     }
 }
 
-// Help function: Link the block and the previous one together.
-static block_t *coalesce_previous(block_t *block) {
-    size_t block_size = get_size(block);
-    block_t *next = find_next(block);
-    write_pre_dsize(next, false);
-    if (is_epilogue_header(next)) {
-        last_block_dsize = false;
+// Returns whether the occupancy map claims list index is non-empty.
+static bool list_marked(int index) {
+    int row = (index + 1) >> tlsf_sl_bits;
+    int column = (index + 1) & (tlsf_sl_lists - 1);
+    return ((arena->sl_map[row] >> column) & 1) &&
+           ((arena->fl_map >> row) & 1);
+}
+
+// Free blocks of dsize are not indexed with MM_TLSF: they have room for a
+// single link, and taking one out of a singly linked list is a walk. They
+// are reclaimed when a neighbour is freed and coalesces with them.
+static bool is_listed(size_t size) {
+    return size >= min_block_size;
+}
+#else
+// Find the corresponding index for seglist root for the size. Block sizes up
+// to exact_class_limit have a class each. Above that, every power of two is
+// split into seglist_subclasses equal classes, found from the position of the
+// leading one bit, so the lookup has no data-dependent branches. Everything
+// too large for the last class goes into it as well. With MM_SIZE_CLASSES
+// the classes are read from the table mkclasses.pl generated instead.
+int findindex(size_t size) {
+#ifdef MM_SIZE_CLASSES
+    size_t slot = size / dsize - 1;
+    if (slot < sizeof(size_class_index)) {
+        return size_class_index[slot];
+    }
+    return NUM_SEGLISTS - 1;
+#else
+    if (size <= exact_class_limit) {
+        return (int)(size / dsize) - 1;
+    }
+    int log2_size = 63 - __builtin_clzll(size);
+    int sub = (int)(size >> (log2_size - seglist_subclass_bits)) &
+              (seglist_subclasses - 1);
+    int index = (int)(exact_class_limit / dsize) +
+                (log2_size - exact_class_log2) * seglist_subclasses + sub;
+    return (index < NUM_SEGLISTS) ? index : NUM_SEGLISTS - 1;
+#endif
+}
+
+// Record that list index has become non-empty.
+static void list_mark(int index) {
+    arena->seglist_map |= (word_t)1 << index;
+}
+
+// Record that list index has become empty.
+static void list_unmark(int index) {
+    arena->seglist_map &= ~((word_t)1 << index);
+}
+
+// Returns whether the occupancy map claims list index is non-empty.
+static bool list_marked(int index) {
+    return (arena->seglist_map >> index) & 1;
+}
+
+// Every free block is on a seglist.
+static bool is_listed(size_t size) {
+    return true;
+}
+#endif
+
+#ifdef MM_TRACE
+// Read CLOCK_MONOTONIC, in nanoseconds.
+static uint64_t trace_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Read the clock events are stamped with: the time stamp counter where
+// there is one, since it takes a few nanoseconds, and CLOCK_MONOTONIC
+// elsewhere. The dump header relates the two.
+static uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return trace_ns();
+#endif
+}
+
+#ifdef MM_THREADS
+// Thread exit destructor of trace_key: leave the exiting thread's ring to
+// the next dump, or free it at once if it holds no events. Events the
+// thread records after this go into another ring.
+static void trace_ring_exit(void *arg) {
+    trace_ring_t *ring = arg;
+    trace_ring = NULL;
+    atomic_store_explicit(&ring->state,
+                          ring->head == 0 ? TRACE_RING_FREE
+                                          : TRACE_RING_EXITED,
+                          memory_order_release);
+}
+
+static void trace_key_create(void) {
+    pthread_key_create(&trace_key, trace_ring_exit);
+}
+
+// Take over a free ring, or return NULL if there is none.
+static trace_ring_t *trace_ring_reuse(void) {
+    trace_ring_t *ring =
+        atomic_load_explicit(&trace_rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        int state = TRACE_RING_FREE;
+        if (atomic_compare_exchange_strong_explicit(
+                &ring->state, &state, TRACE_RING_LIVE, memory_order_acquire,
+                memory_order_relaxed)) {
+            return ring;
+        }
+    }
+    return NULL;
+}
+#endif
+
+// Give the calling thread a ring: with MM_THREADS one an exited thread
+// left behind if it has been dumped, and otherwise a new one mapped and
+// added to the list. Returns NULL, losing the event, if there is no
+// memory. Kept out of line so that recording an event stays small.
+__attribute__((noinline)) static trace_ring_t *trace_ring_create(void) {
+#ifdef MM_THREADS
+    pthread_once(&trace_key_once, trace_key_create);
+    trace_ring_t *ring = trace_ring_reuse();
+    if (ring != NULL) {
+        ring->tid = (uint64_t)syscall(SYS_gettid);
+        ring->head = 0;
+    } else {
+        ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return NULL;
+        }
+        ring->tid = (uint64_t)syscall(SYS_gettid);
+        atomic_init(&ring->state, TRACE_RING_LIVE);
+        ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+            &trace_rings, &ring->next, ring, memory_order_release,
+            memory_order_relaxed)) {
+        }
+    }
+    pthread_setspecific(trace_key, ring);
+#else
+    trace_ring_t *ring = mmap(NULL, sizeof(trace_ring_t),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    ring->tid = (uint64_t)syscall(SYS_gettid);
+    ring->next = trace_rings;
+    trace_rings = ring;
+#endif
+    trace_ring = ring;
+    return ring;
+}
+#endif
+
+// Record an event in the calling thread's ring; see enum mm_trace_type for
+// what addr, size and arg hold. Does nothing without MM_TRACE.
+static void trace_event(enum mm_trace_type type, const void *addr,
+                        size_t size, size_t arg) {
+#ifdef MM_TRACE
+    trace_ring_t *ring = trace_ring;
+    if (ring == NULL && (ring = trace_ring_create()) == NULL) {
+        return;
+    }
+    struct mm_trace_event *event =
+        &ring->event[ring->head++ & (TRACE_EVENTS - 1)];
+    event->stamp = (uint64_t)type << 56 | (trace_clock() & trace_ticks_mask);
+    event->addr = (uint64_t)(uintptr_t)addr;
+    event->size = (uint32_t)min(size, UINT32_MAX);
+    event->arg = (uint32_t)min(arg, UINT32_MAX);
+#endif
+}
+
+#ifdef MM_STATS
+// The counters of the current arena.
+static arena_stats_t *arena_stats(void) {
+#ifdef MM_THREADS
+    return arena->stats;
+#else
+    return &stats_single;
+#endif
+}
+#endif
+
+// Count n events of the given kind. Does nothing without MM_STATS.
+static void stat_add(enum stat_counter counter, size_t n) {
+#ifdef MM_STATS
+    arena_stats()->count[counter] += n;
+#endif
+}
+
+#ifdef MM_SHM_STATS
+// Add n, modulo 2^64, to a counter on the stats page that no other thread
+// writes at the same time: the caller holds the arena lock, or there is a
+// single thread.
+static void shm_add(_Atomic size_t *counter, size_t n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+// Add n, modulo 2^64, to a counter on the stats page that other threads
+// may write at the same time.
+static void shm_add_shared(_Atomic size_t *counter, size_t n) {
+#ifdef MM_THREADS
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+#else
+    shm_add(counter, n);
+#endif
+}
+#endif
+
+// Record that a block of size bytes went onto (delta 1) or came off (delta
+// -1) seglist index, or the large-block tree when index is NUM_SEGLISTS.
+// Does nothing without MM_STATS or MM_SHM_STATS.
+static void stat_list(int index, size_t size, int delta) {
+#ifdef MM_STATS
+    arena_stats_t *stats = arena_stats();
+    stats->blocks[index] += (size_t)(ptrdiff_t)delta;
+    stats->peak[index] = max(stats->peak[index], stats->blocks[index]);
+#endif
+#ifdef MM_SHM_STATS
+    shm_add(&arena->shm_slot->free_bytes[index],
+            size * (size_t)(ptrdiff_t)delta);
+#endif
+}
+
+#ifndef MM_TLSF
+/*
+ * The large-block tree is the splay tree of stree.c, with the nodes stored
+ * in the free blocks themselves. Keys are (size, address) pairs, so they are
+ * unique, and the smallest block of at least a given size is an exact best
+ * fit found in amortized O(log n).
+ */
+
+// Returns whether block a sorts before block b: by size, then by address.
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+// Returns whether a free block of tree size is linked into the tree.
+static bool tree_contains(block_t *block) {
+    return block == arena->tree_root || to_block(block->node.parent) != NULL;
+}
+
+// Put v where u is in the tree.
+static void tree_replace(block_t *u, block_t *v) {
+    block_t *parent = to_block(u->node.parent);
+    if (parent == NULL) {
+        arena->tree_root = v;
+    } else if (u == to_block(parent->node.left)) {
+        parent->node.left = to_link(v);
+    } else {
+        parent->node.right = to_link(v);
+    }
+    if (v != NULL) {
+        v->node.parent = to_link(parent);
+    }
+}
+
+static void tree_rotate_left(block_t *x) {
+    block_t *y = to_block(x->node.right);
+    x->node.right = y->node.left;
+    if (to_block(y->node.left) != NULL) {
+        to_block(y->node.left)->node.parent = to_link(x);
+    }
+    tree_replace(x, y);
+    y->node.left = to_link(x);
+    x->node.parent = to_link(y);
+}
+
+static void tree_rotate_right(block_t *x) {
+    block_t *y = to_block(x->node.left);
+    x->node.left = y->node.right;
+    if (to_block(y->node.right) != NULL) {
+        to_block(y->node.right)->node.parent = to_link(x);
+    }
+    tree_replace(x, y);
+    y->node.right = to_link(x);
+    x->node.parent = to_link(y);
+}
+
+// Move x to the root of the tree.
+static void tree_splay(block_t *x) {
+    while (to_block(x->node.parent) != NULL) {
+        block_t *parent = to_block(x->node.parent);
+        block_t *grand = to_block(parent->node.parent);
+        if (grand == NULL) {
+            if (to_block(parent->node.left) == x) {
+                tree_rotate_right(parent);
+            } else {
+                tree_rotate_left(parent);
+            }
+        } else if (to_block(parent->node.left) == x &&
+                   to_block(grand->node.left) == parent) {
+            tree_rotate_right(grand);
+            tree_rotate_right(parent);
+        } else if (to_block(parent->node.right) == x &&
+                   to_block(grand->node.right) == parent) {
+            tree_rotate_left(grand);
+            tree_rotate_left(parent);
+        } else if (to_block(parent->node.left) == x) {
+            tree_rotate_right(parent);
+            tree_rotate_left(grand);
+        } else {
+            tree_rotate_left(parent);
+            tree_rotate_right(grand);
+        }
+    }
+}
+
+// Add a free block to the tree.
+static void tree_insert(block_t *block) {
+    block_t *parent = NULL;
+    block_t *z = arena->tree_root;
+    while (z != NULL) {
+        parent = z;
+        z = to_block(tree_less(block, z) ? z->node.left : z->node.right);
+    }
+    block->node.left = to_link(NULL);
+    block->node.right = to_link(NULL);
+    block->node.parent = to_link(parent);
+    if (parent == NULL) {
+        arena->tree_root = block;
+    } else if (tree_less(block, parent)) {
+        parent->node.left = to_link(block);
+    } else {
+        parent->node.right = to_link(block);
+    }
+    tree_splay(block);
+    stat_list(NUM_SEGLISTS, get_size(block), 1);
+}
+
+// Take a block out of the tree. Blocks that are not in it are left alone,
+// like blocks already off their seglist.
+static void tree_remove(block_t *block) {
+    if (!tree_contains(block)) {
+        return;
+    }
+    stat_list(NUM_SEGLISTS, get_size(block), -1);
+    tree_splay(block);
+    if (to_block(block->node.left) == NULL) {
+        tree_replace(block, to_block(block->node.right));
+    } else if (to_block(block->node.right) == NULL) {
+        tree_replace(block, to_block(block->node.left));
+    } else {
+        block_t *y = to_block(block->node.right);
+        while (to_block(y->node.left) != NULL) {
+            y = to_block(y->node.left);
+        }
+        if (to_block(y->node.parent) != block) {
+            tree_replace(y, to_block(y->node.right));
+            y->node.right = block->node.right;
+            to_block(y->node.right)->node.parent = to_link(y);
+        }
+        tree_replace(block, y);
+        y->node.left = block->node.left;
+        to_block(y->node.left)->node.parent = to_link(y);
+    }
+    block->node.left = to_link(NULL);
+    block->node.right = to_link(NULL);
+    block->node.parent = to_link(NULL);
+}
+
+// Returns the smallest free block of at least asize bytes, lowest address
+// first among equals, or NULL. The block found is splayed to the root.
+static block_t *tree_best_fit(size_t asize) {
+    block_t *best = NULL;
+    block_t *z = arena->tree_root;
+    while (z != NULL) {
+        stat_add(STAT_FIT_PROBES, 1);
+        if (get_size(z) >= asize) {
+            best = z;
+            z = to_block(z->node.left);
+        } else {
+            z = to_block(z->node.right);
+        }
+    }
+    if (best != NULL) {
+        tree_splay(best);
+    }
+    return best;
+}
+#endif
+
+// Disconnect the block from the seglist.
+static void disconnect(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(get_size(block) != 0 &&
+                 "Called find_next on the last block in the heap");
+    size_t block_size = get_size(block);
+    if (!is_listed(block_size)) {
+        return;
+    }
+#ifndef MM_TLSF
+    if (block_size >= tree_min_size) {
+        tree_remove(block);
+        return;
     }
+#endif
+    int index = findindex(block_size);
+    block_t *next = NULL;
+    block_t *previous = NULL;
+    if (block_size < min_block_size) {
+        if ((void *)(arena->segregatehead[index]) == (void *)block) {
+            next = to_block(block->pointer);
+            arena->segregatehead[index] = next;
+            block->pointer = to_link(NULL);
+            stat_list(index, block_size, -1);
+        } else if (arena->segregatehead[index] == NULL) {
+            block->pointer = to_link(NULL);
+        } else {
+            block_t *temp = arena->segregatehead[index];
+            block_t *tempnext = NULL;
+            while (temp != NULL) {
+                if (to_block(temp->pointer) == block) {
+                    tempnext = to_block(block->pointer);
+                    temp->pointer = to_link(tempnext);
+                    block->pointer = to_link(NULL);
+                    stat_list(index, block_size, -1);
+                    break;
+                } else {
+                    temp = to_block(temp->pointer);
+                }
+            }
+        }
+    } else {
+        if ((void *)(arena->segregatehead[index]) ==
+            (void *)block) { // The block is the root.
+            stat_list(index, block_size, -1);
+            next = to_block(block->pointer);
+            if (next) {
+                arena->segregatehead[index] = next;
+                (*(&next->pointer + 1)) = to_link(NULL);
+                block->pointer = to_link(NULL);
+                (*(&block->pointer + 1)) = to_link(NULL);
+            } else {
+                arena->segregatehead[index] = NULL;
+                block->pointer = to_link(NULL);
+                (*(&block->pointer + 1)) = to_link(NULL);
+            }
+        } else if (arena->segregatehead[index] ==
+                   NULL) { // Unusual cases found when debugging.
+            block->pointer = to_link(NULL);
+            (*(&block->pointer + 1)) = to_link(NULL);
+        } else if (to_block(block->pointer) == NULL &&
+                   to_block(*(&block->pointer + 1)) == NULL &&
+                   (void *)block != (void *)(arena->segregatehead[index])) {
+            // Sometimes it is already disconnected.
+            return;
+        } else if (to_block(block->pointer) ==
+                   NULL) { // It has the previous block but not the next block.
+            stat_list(index, block_size, -1);
+            previous = header_to_previous_pointer(block);
+            previous->pointer = to_link(NULL);
+            (*(&block->pointer + 1)) = to_link(NULL);
+        } else if (to_block(*(&block->pointer + 1)) ==
+                   NULL) { // It has the next block but not the previous block.
+            stat_list(index, block_size, -1);
+            next = to_block(block->pointer);
+            (*(&next->pointer + 1)) = to_link(NULL);
+            arena->segregatehead[index] = next;
+            (*(&block->pointer + 1)) = to_link(NULL);
+            block->pointer = to_link(NULL);
+        } else { // It has the next block and the previous block.
+            stat_list(index, block_size, -1);
+            next = to_block(block->pointer);
+            previous = header_to_previous_pointer(block);
+            (*(&next->pointer + 1)) = to_link(previous);
+            previous->pointer = to_link(next);
+            block->pointer = to_link(NULL);
+            (*(&block->pointer + 1)) = to_link(NULL);
+        }
+    }
+    if (arena->segregatehead[index] == NULL) {
+        list_unmark(index);
+    }
+}
+
+// Link the block to the seglist. We adopt the LIFO policy, or with
+// MM_ADDRESS_ORDER keep the seglists from the one ordered_min_size falls in
+// up sorted by address, so that find_fit takes the lowest block that fits.
+// The test is by list rather than by size, so that a class straddling the
+// threshold, as a generated one may, is never half sorted.
+static void link_to_the_list(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(get_alloc(block) == false);
+    size_t size = get_size(block);
+    if (!is_listed(size)) {
+        return;
+    }
+#ifndef MM_TLSF
+    if (size >= tree_min_size) {
+        tree_insert(block);
+        return;
+    }
+#endif
+    int index = findindex(size);
+    block_t *root = arena->segregatehead[index];
+    list_mark(index);
+    stat_list(index, size, 1);
+    if (size < min_block_size) {
+        if (root == NULL) {
+            arena->segregatehead[index] = block;
+            block->pointer = to_link(NULL);
+        } else {
+            block_t *temp = arena->segregatehead[index];
+            arena->segregatehead[index] = block;
+            block->pointer = to_link(temp);
+        }
+    } else {
+        block_t *previous = NULL;
+        block_t *next = root;
+#ifdef MM_ADDRESS_ORDER
+        bool ordered = index >= findindex(ordered_min_size);
+        while (ordered && next != NULL && next < block) {
+            previous = next;
+            next = to_block(next->pointer);
+        }
+#endif
+        block->pointer = to_link(next);
+        (*(&block->pointer + 1)) = to_link(previous);
+        if (next != NULL) {
+            (*(&next->pointer + 1)) = to_link(block);
+        }
+        if (previous == NULL) {
+            arena->segregatehead[index] = block;
+        } else {
+            previous->pointer = to_link(block);
+        }
+    }
+}
+
+// Help function: Link the block and the previous one together.
+static block_t *coalesce_previous(block_t *block) {
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
+    write_pre_dsize(next, false);
     if (get_dsize_mask(block)) {
         block_t *previousblock = (block_t *)((char *)block - dsize);
         size_t pre_size = get_size(previousblock);
@@ -734,7 +1772,7 @@ static block_t *coalesce_previous(block_t *block) {
         link_to_the_list(previousblock);
         return previousblock;
     } else {
-        word_t *previousfooter = find_prev_footer(block);
+        tag_t *previousfooter = find_prev_footer(block);
         size_t pre_block_size = extract_size(*previousfooter);
         block_t *previous = find_prev(block);
         *previousfooter = 0;
@@ -753,9 +1791,6 @@ static block_t *coalesce_next(block_t *block) {
     block_t *next = find_next(block);
     size_t next_block_size = get_size(next);
     block_t *nextnext = find_next(next);
-    if (is_epilogue_header(nextnext)) {
-        last_block_dsize = false;
-    }
     write_pre_dsize(nextnext, false);
     if (get_dsize_mask(next) || block_size < min_block_size) {
         disconnect(block);
@@ -767,7 +1802,7 @@ static block_t *coalesce_next(block_t *block) {
     } else {
         disconnect(block);
         disconnect(next);
-        word_t *blockfooter = header_to_footer(block);
+        tag_t *blockfooter = header_to_footer(block);
         *blockfooter = 0;
         next->header = 0;
         write_size_alloc(block, block_size + next_block_size, false);
@@ -783,9 +1818,6 @@ static block_t *coalesce_both(block_t *block) {
     size_t next_block_size = get_size(next);
     block_t *nextnext = find_next(next);
     write_pre_dsize(nextnext, false);
-    if (is_epilogue_header(nextnext)) {
-        last_block_dsize = false;
-    }
     if (get_dsize_mask(block)) {
         block_t *previousblock = (block_t *)((char *)block - dsize);
         size_t pre_size = get_size(previousblock);
@@ -793,7 +1825,7 @@ static block_t *coalesce_both(block_t *block) {
         disconnect(block);
         disconnect(next);
         if (block_size >= min_block_size) {
-            word_t *blockfooter = header_to_footer(block);
+            tag_t *blockfooter = header_to_footer(block);
             *blockfooter = 0;
         }
         block->header = 0;
@@ -803,7 +1835,7 @@ static block_t *coalesce_both(block_t *block) {
         link_to_the_list(previousblock);
         return previousblock;
     } else {
-        word_t *previousfooter = find_prev_footer(block);
+        tag_t *previousfooter = find_prev_footer(block);
         size_t pre_block_size = extract_size(*previousfooter);
         block_t *previous = find_prev(block);
         *previousfooter = 0;
@@ -811,7 +1843,7 @@ static block_t *coalesce_both(block_t *block) {
         disconnect(block);
         disconnect(next);
         if (block_size >= min_block_size) {
-            word_t *blockfooter = header_to_footer(block);
+            tag_t *blockfooter = header_to_footer(block);
             *blockfooter = 0;
         }
         block->header = 0;
@@ -826,132 +1858,545 @@ static block_t *coalesce_both(block_t *block) {
 static block_t *coalesce_block(block_t *block) {
     block_t *next = find_next(block);
     block_t *temp = NULL;
+    size_t size = get_size(block);
     if (get_pre_alloc(block) && (is_epilogue_header(next) || get_alloc(next))) {
-        block->pointer = NULL;
+        stat_add(STAT_COALESCE_NONE, 1);
+        block->pointer = to_link(NULL);
         link_to_the_list(block);
+        trace_event(MM_TRACE_COALESCE_NONE, block, size, size);
         return block;
     } else if (get_pre_alloc(block)) {
+        stat_add(STAT_COALESCE_NEXT, 1);
         temp = coalesce_next(block);
+        trace_event(MM_TRACE_COALESCE_NEXT, temp, get_size(temp), size);
         return temp;
     } else if (is_epilogue_header(next) || get_alloc(next)) {
+        stat_add(STAT_COALESCE_PREV, 1);
         temp = coalesce_previous(block);
+        trace_event(MM_TRACE_COALESCE_PREV, temp, get_size(temp), size);
         return temp;
     } else {
+        stat_add(STAT_COALESCE_BOTH, 1);
         temp = coalesce_both(block);
+        trace_event(MM_TRACE_COALESCE_BOTH, temp, get_size(temp), size);
         return temp;
     }
     return NULL;
 }
 
+#ifdef MM_THREADS
 /**
- * @brief
+ * @brief Records that the memory from `lo` up to the next extent belongs to
+ *        `owner`.
  *
- * <What does this function do?>
- * This function extends the heap if no space for new allocation.
- * <What are the function's arguments?>
- * The argument is the malloc size required.
- * <What is the function's return value?>
- * The function will return a new block address pointing to the new free block.
- * <Are there any preconditions or postconditions?>
- * The extend_heap should not be called many times, or mem_sbrk will fail.
- * The find_fit will return NULL before it is called.
+ * Extents are appended under sbrk_lock, and stay sorted by address: a trim
+ * never moves the break below the start of the trimmed arena's own extent,
+ * so a new extent always starts above every existing one. Readers search
+ * them without any lock.
  *
- * @param[in] size
- * @return
+ * @param[in] lo The first byte of the new extent
+ * @param[in] owner The arena that carves blocks out of it
+ * @return False if the registry is full
  */
-static block_t *extend_heap(size_t size) {
-    void *bp;
-
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
-        return NULL;
-    }
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_block(block, size, false);
-    if (block->pointer != NULL) {
-        block->pointer = NULL;
+static bool register_extent(void *lo, arena_t *owner) {
+    size_t n = atomic_load_explicit(&num_extents, memory_order_relaxed);
+    if (n == MAX_EXTENTS) {
+        return false;
     }
-    if (size >= min_block_size) {
-        (*(&block->pointer + 1)) = NULL;
-    } // Sometimes the pointer address is not set to NULL. Should be done
-      // manually to ensure the safety.
+    extents[n].lo = (char *)lo;
+    extents[n].owner = owner;
+    atomic_store_explicit(&num_extents, n + 1, memory_order_release);
+    return true;
+}
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_pre_alloc(block, last_block_prealloc);
-    write_pre_dsize(block, last_block_dsize);
-    write_epilogue(block_next);
+/**
+ * @brief Finds the arena that owns a block by binary search over extents.
+ * @param[in] block A block allocated by any arena
+ * @return The owning arena
+ */
+static arena_t *extent_owner(block_t *block) {
+    size_t lo = 0;
+    size_t hi = atomic_load_explicit(&num_extents, memory_order_acquire);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (extents[mid].lo <= (char *)block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return extents[lo].owner;
+}
+#endif
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
+/**
+ * @brief Checks that the heap can grow by `size` bytes, which is only ever
+ *        in doubt when 32-bit offsets must reach the whole heap.
+ */
+static bool heap_has_room(size_t size) {
+#ifdef MM_COMPACT
+    size_t used = (size_t)((char *)mem_heap_hi() + 1 - heap_base);
+    return size <= compact_max && used <= compact_max - size;
+#else
+    return true;
+#endif
+}
 
-    return block;
+#ifdef MM_SHM_STATS
+// Write the name of this process's stats page into path, which must hold
+// at least 64 bytes. snprintf is avoided, since it may call malloc.
+static void shm_path(char *path) {
+    char digits[24];
+    size_t n = 0;
+    for (unsigned long pid = (unsigned long)getpid(); n == 0 || pid != 0;
+         pid /= 10) {
+        digits[n++] = (char)('0' + pid % 10);
+    }
+    size_t len = strlen(MM_SHM_PREFIX);
+    memcpy(path, MM_SHM_PREFIX, len);
+    while (n > 0) {
+        path[len++] = digits[--n];
+    }
+    path[len] = '\0';
 }
 
 /**
- * @brief
+ * @brief Creates and maps a new stats page for this process.
  *
- * <What does this function do?>
- * Sometimes the malloc size is less than the original size. We should split it
- * and relink the new size freeblock to the seglists for further use. <What are
- * the function's arguments?> The arguments are the block address where it will
- * be allocated. asize is the requried allocation size. <What is the function's
- * return value?> It will return void. But we will allocate the block and
- * construct the new remaining free block if possible, then we will relink it to
- * the seglists. <Are there any preconditions or postconditions?> The block
- * should be allocated. We check whether the remaining size can be constructed
- * as a new block. If the remaining size is dsize, then we should construct it
- * into different ways.
+ * A page left behind by an earlier process with the same pid is removed
+ * first. The file is then only ever created, never opened, and never
+ * through a symbolic link, so another user cannot make the allocator
+ * write into a file of their choosing; if one holds the name, there is no
+ * page. Only the owner can read the counters.
  *
- * @param[in] block
- * @param[in] asize
+ * @return The page, or NULL if it could not be created
  */
-static void split_block(block_t *block, size_t asize) {
-    dbg_requires(get_alloc(block));
-    /*TODO: Can you write a precondition about the value of asize? */
-    // The asize must be the multiple of 16 Bytes.
-
-    size_t block_size = get_size(block);
-    block_t *next = find_next(block);
-    word_t *footerblock;
-    if ((block_size - asize) < dsize) {
-        if (is_epilogue_header(next)) {
-            last_block_prealloc = true;
-            if (asize == dsize && block_size < min_block_size) {
-                last_block_dsize = true;
-            } else {
-                last_block_dsize = false;
-            }
-        } else {
-            write_pre_alloc(next, true);
+static struct mm_shm_page *shm_create(void) {
+    char path[64];
+    shm_path(path);
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct mm_shm_page)) == 0) {
+        page = mmap(NULL, sizeof(struct mm_shm_page), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (page == MAP_FAILED) {
+        unlink(path);
+        return NULL;
+    }
+    return page;
+}
+
+/**
+ * @brief Gives a forked child a stats page of its own, which starts from
+ *        the counters of the heap it inherited. Without it, the child
+ *        would go on counting on its parent's page.
+ */
+static void shm_fork_child(void) {
+    struct mm_shm_page *parent = shm;
+    if (parent == &shm_private) {
+        return;
+    }
+    struct mm_shm_page *page = shm_create();
+    if (page == NULL) {
+        page = &shm_private;
+    }
+    memcpy(page, parent, sizeof(*page));
+    page->pid = getpid();
+#ifdef MM_THREADS
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        arena_t *a = arenas[i];
+        if (a != NULL) {
+            a->shm_slot = &page->slot[a->shm_slot - parent->slot];
+        }
+    }
+#else
+    if (arena != NULL) {
+        arena->shm_slot = &page->slot[arena->shm_slot - parent->slot];
+    }
+#endif
+    shm = page;
+    munmap(parent, sizeof(*parent));
+}
+
+/**
+ * @brief Creates the stats page of this process, if it does not exist yet,
+ *        and describes the free list classes on it.
+ *
+ * Without a writable /dev/shm the counters are kept in private memory, so
+ * that the hot paths never have to check whether there is a page.
+ */
+static void shm_publish(void) {
+    static bool fork_handled = false;
+    if (!fork_handled) {
+        pthread_atfork(NULL, NULL, shm_fork_child);
+        fork_handled = true;
+    }
+    if (shm == &shm_private) {
+        struct mm_shm_page *page = shm_create();
+        if (page != NULL) {
+            shm = page;
+        }
+    }
+    shm_slots_used = 0;
+    shm->pid = getpid();
+
+    // The smallest block of each class. Class boundaries are multiples of
+    // at least 1/16 of the power of two below them, and of dsize below
+    // 64 KiB, so stepping by that visits the first size of every class.
+    for (int i = 0; i < MM_SHM_CLASSES; i++) {
+        shm->class_min[i] = 0;
+    }
+#ifdef MM_TLSF
+    size_t limit = (size_t)1 << 48;
+    shm->classes = NUM_SEGLISTS;
+#else
+    size_t limit = tree_min_size;
+    shm->classes = NUM_SEGLISTS + 1;
+    shm->class_min[NUM_SEGLISTS] = tree_min_size;
+#endif
+    size_t step = dsize;
+    for (size_t size = dsize; size < limit; size += step) {
+        if (size >= (1 << 16)) {
+            step = ((size_t)1 << (63 - __builtin_clzll(size))) / 16;
+        }
+        int index = findindex(size);
+        if (is_listed(size) && shm->class_min[index] == 0) {
+            shm->class_min[index] = size;
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+    shm->magic = MM_SHM_MAGIC;
+}
+
+// Take the stats page away with the process.
+__attribute__((destructor)) static void shm_remove(void) {
+    if (shm != &shm_private) {
+        char path[64];
+        shm_path(path);
+        unlink(path);
+    }
+}
+
+// Give a new arena a slot of its own on the stats page.
+static void shm_claim_slot(arena_t *new_arena) {
+    struct mm_shm_slot *slot = &shm->slot[shm_slots_used++ % MM_SHM_SLOTS];
+    atomic_store_explicit(&slot->mallocs, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->frees, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->live_bytes, 0, memory_order_relaxed);
+    for (int i = 0; i < MM_SHM_CLASSES; i++) {
+        atomic_store_explicit(&slot->free_bytes[i], 0, memory_order_relaxed);
+    }
+    new_arena->shm_slot = slot;
+}
+#endif
+
+#if defined(MM_SHM_STATS) && defined(MM_THREADS)
+/** @brief Operations a thread counts privately before publishing them */
+#define SHM_FLUSH_OPS 256
+
+// Add the counts a thread has kept to the slot of its home arena, or of
+// the first arena if it has none.
+static void shm_flush_thread(tcache_t *tc) {
+    arena_t *home = (tc->home != NULL) ? tc->home : arenas[0];
+    if (home == NULL) {
+        return;
+    }
+    struct mm_shm_slot *slot = home->shm_slot;
+    shm_add_shared(&slot->mallocs, tc->shm_mallocs);
+    shm_add_shared(&slot->frees, tc->shm_frees);
+    shm_add_shared(&slot->live_bytes, tc->shm_live);
+    tc->shm_mallocs = 0;
+    tc->shm_frees = 0;
+    tc->shm_live = 0;
+    tc->shm_pending = 0;
+}
+#endif
+
+// Count a malloc of a payload of usable bytes, or a free of one, on the
+// stats page. With MM_THREADS the counts are kept in the thread cache and
+// published every SHM_FLUSH_OPS operations, so that the hot paths do no
+// atomic read-modify-write. Does nothing without MM_SHM_STATS.
+static void shm_count(size_t usable, bool is_free) {
+#if defined(MM_SHM_STATS) && defined(MM_THREADS)
+    if (is_free) {
+        tcache.shm_frees++;
+        tcache.shm_live -= usable;
+    } else {
+        tcache.shm_mallocs++;
+        tcache.shm_live += usable;
+    }
+    if (++tcache.shm_pending == SHM_FLUSH_OPS) {
+        shm_flush_thread(&tcache);
+    }
+#elif defined(MM_SHM_STATS)
+    struct mm_shm_slot *slot = arena->shm_slot;
+    if (is_free) {
+        shm_add(&slot->frees, 1);
+        shm_add(&slot->live_bytes, -usable);
+    } else {
+        shm_add(&slot->mallocs, 1);
+        shm_add(&slot->live_bytes, usable);
+    }
+#endif
+}
+
+// Count a payload that was resized in place from before to after usable
+// bytes on the stats page. Does nothing without MM_SHM_STATS.
+static void shm_resize(size_t before, size_t after) {
+#if defined(MM_SHM_STATS) && defined(MM_THREADS)
+    tcache.shm_live += after - before;
+#elif defined(MM_SHM_STATS)
+    shm_add(&arena->shm_slot->live_bytes, after - before);
+#endif
+}
+
+// Publish the heap and mapping sizes on the stats page. Does nothing
+// without MM_SHM_STATS.
+static void shm_heap(void) {
+#ifdef MM_SHM_STATS
+    atomic_store_explicit(&shm->heap_bytes, mem_heapsize(),
+                          memory_order_relaxed);
+    atomic_store_explicit(&shm->mapped_bytes, mem_mapsize(),
+                          memory_order_relaxed);
+#endif
+}
+
+#ifdef MM_TRACE
+// Empty every ring, freeing those of exited threads, and restart the
+// clock the dump measures time from.
+static void trace_reset(void) {
+    trace_ticks0 = trace_clock();
+    trace_ns0 = trace_ns();
+#ifdef MM_THREADS
+    trace_ring_t *ring =
+        atomic_load_explicit(&trace_rings, memory_order_acquire);
+#else
+    trace_ring_t *ring = trace_rings;
+#endif
+    for (; ring != NULL; ring = ring->next) {
+        ring->head = 0;
+#ifdef MM_THREADS
+        int state = TRACE_RING_EXITED;
+        atomic_compare_exchange_strong_explicit(
+            &ring->state, &state, TRACE_RING_FREE, memory_order_release,
+            memory_order_relaxed);
+#endif
+    }
+}
+#endif
+
+#if defined(MM_TRACE) || defined(MM_PROFILE)
+// Write all of buf to fd, going on after short writes and interruptions.
+static bool write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno != EINTR) {
+            return false;
         }
-        if (asize >= min_block_size) {
-            footerblock = header_to_footer(block);
-            *footerblock = 0;
+        if (n > 0) {
+            p += n;
+            len -= (size_t)n;
+        }
+    }
+    return true;
+}
+#endif
+
+/**
+ * @brief Obtains `size` more bytes of heap for the current arena.
+ *
+ * In the single-arena build this is just mem_sbrk. With MM_THREADS several
+ * arenas share the break, so the arena only grows in place when its epilogue
+ * is still the last word of the heap. Otherwise a new extent is started with
+ * its own prologue footer, and a placeholder epilogue whose pre_alloc bit is
+ * set stands in for the header of the new block.
+ *
+ * @param[in,out] size Bytes wanted for the new free block (multiple of
+ *                     dsize); a fresh extent may make the block larger
+ * @return Payload address of the new block, or NULL if out of memory
+ */
+static void *grow_arena(size_t *size) {
+    void *bp;
+#ifdef MM_THREADS
+    pthread_mutex_lock(&sbrk_lock);
+    if ((char *)arena->epilogue + tsize == (char *)mem_heap_hi() + 1) {
+        bp = heap_has_room(*size) ? mem_sbrk(*size) : (void *)-1;
+    } else {
+        *size = max(*size, extent_size);
+        char *start = heap_has_room(*size + dsize) ? mem_sbrk(*size + dsize)
+                                                   : (void *)-1;
+        if (start == (void *)-1 || !register_extent(start, arena)) {
+            pthread_mutex_unlock(&sbrk_lock);
+            return NULL;
         }
-    } else if ((block_size - asize) < min_block_size) {
+        tag_t *tags = (tag_t *)(start + dsize) - 2;
+        tags[0] = pack(0, true); // Prologue footer of the new extent
+        tags[1] = pack(0, true) | pre_alloc_mask;
+        bp = start + dsize;
+    }
+    pthread_mutex_unlock(&sbrk_lock);
+#else
+    bp = heap_has_room(*size) ? mem_sbrk(*size) : (void *)-1;
+#endif
+    if (bp == (void *)-1) {
+        return NULL;
+    }
+    shm_heap();
+    return bp;
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * This function extends the heap if no space for new allocation.
+ * <What are the function's arguments?>
+ * The argument is the malloc size required.
+ * <What is the function's return value?>
+ * The function will return a new block address pointing to the new free block.
+ * <Are there any preconditions or postconditions?>
+ * The extend_heap should not be called many times, or mem_sbrk will fail.
+ * The find_fit will return NULL before it is called.
+ *
+ * @param[in] size
+ * @return
+ */
+static block_t *extend_heap(size_t size) {
+    void *bp;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+    if ((bp = grow_arena(&size)) == NULL) {
+        return NULL;
+    }
+    stat_add(STAT_EXTENDS, 1);
+    stat_add(STAT_EXTEND_BYTES, size);
+    trace_event(MM_TRACE_EXTEND, bp, size, 0);
+    // The new memory is zero-filled, unless memlib reuses an old heap. Tags
+    // of the old last block may be merged into the new block, but they all
+    // lie below bp.
+    arena->zero_from = max_addr((char *)bp, (char *)mem_zero_lo());
+
+    // The new block starts at the old epilogue, which records the status of
+    // the block before it.
+    block_t *block = payload_to_header(bp);
+    bool pre_alloc = get_pre_alloc(block);
+    bool pre_dsize = get_dsize_mask(block);
+
+    // Initialize free block header/footer
+    write_block(block, size, false);
+    block->pointer = to_link(NULL);
+    if (size >= min_block_size) {
+        (*(&block->pointer + 1)) = to_link(NULL);
+    } // Sometimes the pointer address is not set to NULL. Should be done
+      // manually to ensure the safety.
+#ifndef MM_TLSF
+    if (size >= tree_min_size) {
+        block->node.parent = to_link(NULL); // Not in the tree yet
+    }
+#endif
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_pre_alloc(block, pre_alloc);
+    write_pre_dsize(block, pre_dsize);
+    write_epilogue(block_next);
+    write_pre_dsize(block_next, size == dsize);
+    arena->epilogue = block_next;
+
+    // Coalesce in case the previous block was free
+    block = coalesce_block(block);
+
+    return block;
+}
+
+/**
+ * @brief Grows the current arena so that its last block is a free block of
+ *        at least asize bytes.
+ *
+ * A free block already at the end of the heap is merged with the new
+ * memory, so only the shortfall is asked for. The heap grows by at least
+ * grow_step, which doubles, up to grow_max, every time the last extension
+ * has been used up before the next one, so a heap that keeps growing makes
+ * few mem_sbrk calls. The step is also kept under 1 / grow_ratio of the
+ * heap (but never under chunksize), and starts over from chunksize once the
+ * heap is trimmed, so that what is left unused of the last extension costs
+ * little utilization.
+ *
+ * @param[in] asize The adjusted size of the block wanted
+ * @return The last block of the arena, or NULL if out of memory
+ */
+static block_t *grow_heap(size_t asize) {
+    size_t tail = 0;
+    if (!get_pre_alloc(arena->epilogue)) {
+        tail = get_size(find_prev(arena->epilogue));
+    }
+    size_t need = (tail < asize) ? asize - tail : 0;
+    need = max(need, min_block_size);
+
+    size_t step = arena->grow_step;
+    if (tail == 0 && step < grow_max) {
+        arena->grow_step = step * 2;
+    }
+    step = max(min(step, mem_heapsize() / grow_ratio), chunksize);
+    block_t *block = extend_heap(max(need, step));
+    if (block != NULL && get_size(block) < asize) {
+        // The arena had to start a new extent, away from its last block
+        block = extend_heap(asize);
+    }
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * Sometimes the malloc size is less than the original size. We should split it
+ * and relink the new size freeblock to the seglists for further use. <What are
+ * the function's arguments?> The arguments are the block address where it will
+ * be allocated. asize is the requried allocation size. <What is the function's
+ * return value?> It will return void. But we will allocate the block and
+ * construct the new remaining free block if possible, then we will relink it to
+ * the seglists. <Are there any preconditions or postconditions?> The block
+ * should be allocated. We check whether the remaining size can be constructed
+ * as a new block. If the remaining size is dsize, then we should construct it
+ * into different ways.
+ *
+ * @param[in] block
+ * @param[in] asize
+ */
+static void split_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+    /*TODO: Can you write a precondition about the value of asize? */
+    // The asize must be the multiple of 16 Bytes.
+
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
+    if ((block_size - asize) < dsize) {
+        // The block may have been shrunk to fit, as carve_blocks does
+        write_pre_alloc(next, true);
+        write_pre_dsize(next, asize == dsize);
+    } else if ((block_size - asize) == dsize) {
         block_t *block_next;
         write_size_alloc(block, asize, true);
         block_next = find_next(block);
         write_block(block_next, block_size - asize, false);
         if (asize <= dsize) {
             write_pre_dsize(block_next, true);
-            block->pointer = NULL;
         }
         write_pre_alloc(block_next, true);
         write_pre_alloc(next, false);
         write_pre_dsize(next, true);
-        if (is_epilogue_header(next)) {
-            last_block_prealloc = false;
-            last_block_dsize = true;
-        }
-        if (asize >= min_block_size) {
-            footerblock = header_to_footer(block);
-            *footerblock = 0;
-        }
         link_to_the_list(block_next);
+        stat_add(STAT_SPLITS, 1);
+        trace_event(MM_TRACE_SPLIT, block, asize, block_size - asize);
     } else {
         block_t *block_next;
         write_size_alloc(block, asize, true);
@@ -961,15 +2406,9 @@ static void split_block(block_t *block, size_t asize) {
             write_pre_dsize(block_next, true);
         }
         write_pre_alloc(block_next, true);
-        if (is_epilogue_header(next)) {
-            last_block_prealloc = false;
-            last_block_dsize = false;
-        }
-        if (asize >= min_block_size) {
-            footerblock = header_to_footer(block);
-            *footerblock = 0;
-        }
         link_to_the_list(block_next);
+        stat_add(STAT_SPLITS, 1);
+        trace_event(MM_TRACE_SPLIT, block, asize, block_size - asize);
     }
     dbg_ensures(get_alloc(block));
 }
@@ -990,358 +2429,2736 @@ static void split_block(block_t *block, size_t asize) {
  * @param[in] asize
  * @return
  */
-// FIrst fit policy.
-static block_t *find_fit(size_t asize) {
+#ifdef MM_TLSF
+// Good fit in constant time. The request is rounded up to the next list
+// boundary, so that every block on the list found is large enough, and the
+// two bitmap levels give the first non-empty list at or above it without
+// looking at a single block. Only the last list, which holds every size
+// beyond the index, is searched first fit.
+static block_t *search_fit(size_t asize) {
+    size_t search = asize;
+    if (search >= exact_class_limit) {
+        int log2_size = 63 - __builtin_clzll(search);
+        search += ((size_t)1 << (log2_size - tlsf_sl_bits)) - 1;
+    }
+    int index = findindex(search);
+    if (index == NUM_SEGLISTS - 1) {
+        for (block_t *block = arena->segregatehead[index]; block != NULL;
+             block = to_block(block->pointer)) {
+            stat_add(STAT_FIT_PROBES, 1);
+            if (get_size(block) >= asize) {
+                return block;
+            }
+        }
+        return NULL;
+    }
+    int row = (index + 1) >> tlsf_sl_bits;
+    int column = (index + 1) & (tlsf_sl_lists - 1);
+    unsigned int lists = arena->sl_map[row] & (~0u << column);
+    if (lists == 0) {
+        word_t rows = arena->fl_map & (~(word_t)0 << (row + 1));
+        if (rows == 0) {
+            return NULL;
+        }
+        row = __builtin_ctzll(rows);
+        lists = arena->sl_map[row];
+    }
+    index = row * tlsf_sl_lists + __builtin_ctz(lists) - 1;
+    stat_add(STAT_FIT_PROBES, 1);
+    return arena->segregatehead[index];
+}
+#else
+// FIrst fit policy. The occupancy map in seglist_map takes the search
+// straight to the next non-empty list instead of probing every root. Large
+// requests, and small ones no seglist can serve, get the best fit from the
+// large-block tree.
+static block_t *search_fit(size_t asize) {
     block_t *block = NULL;
-    block_t *temp = NULL;
     block_t *blocknext = NULL;
+    if (asize >= tree_min_size) {
+        return tree_best_fit(asize);
+    }
     int index = findindex(asize);
-    bool finish = true; // It stops when we find a good list.
-    while (finish) {
-        temp = segregatehead[index];
-        if (temp == NULL) {
-            index++;
-            if (index == 14) {
-                return NULL;
-                break;
-            } // If no find, we search for a list with larger size. Stops when
-              // all lists are not valid.
-        } else {
-            block = temp;
-            blocknext = block->pointer;
-            while (block != NULL) {
-                if (get_size(block) >= asize && !(get_alloc(block))) {
-                    finish = false;
-                    size_t difference = get_size(block) - asize;
-                    if (difference > 0) {
-                        int i = 0;
-                        block_t *findtemp = block->pointer;
-                        block_t *result = block;
-                        while (i < 10 && findtemp != NULL) {
-                            i++;
-                            size_t tempdiffer = difference;
-                            if (get_size(findtemp) >= asize) {
-                                tempdiffer = get_size(findtemp) - asize;
-                                if (tempdiffer == 0) {
-                                    return findtemp;
-                                    break;
-                                } else if (tempdiffer < difference) {
-                                    result = findtemp;
-                                    difference = tempdiffer;
-                                }
+    word_t candidates = arena->seglist_map & (~(word_t)0 << index);
+    while (candidates != 0) {
+        index = __builtin_ctzll(candidates);
+        candidates &= candidates - 1;
+        block = arena->segregatehead[index];
+        blocknext = to_block(block->pointer);
+        while (block != NULL) {
+            stat_add(STAT_FIT_PROBES, 1);
+            if (get_size(block) >= asize && !(get_alloc(block))) {
+                size_t difference = get_size(block) - asize;
+                if (difference > 0) {
+                    int i = 0;
+                    block_t *findtemp = to_block(block->pointer);
+                    block_t *result = block;
+                    while (i < 10 && findtemp != NULL) {
+                        i++;
+                        stat_add(STAT_FIT_PROBES, 1);
+                        size_t tempdiffer = difference;
+                        if (get_size(findtemp) >= asize) {
+                            tempdiffer = get_size(findtemp) - asize;
+                            if (tempdiffer == 0) {
+                                return findtemp;
+                            } else if (tempdiffer < difference) {
+                                result = findtemp;
+                                difference = tempdiffer;
                             }
-                            findtemp = findtemp->pointer;
-                        } // Better fit. For the first fit block, find the
-                          // better suitable blocks in the next 10 blocks.
-                        return result;
-                    } else {
-                        return block;
-                    }
+                        }
+                        findtemp = to_block(findtemp->pointer);
+                    } // Better fit. For the first fit block, find the
+                      // better suitable blocks in the next 10 blocks.
+                    return result;
                 } else {
-                    block = blocknext;
-                    if (block != NULL) {
-                        blocknext = block->pointer;
-                    }
-                } // Find the first fit on the seglist.
-            }
-            index++;
-            if (index == 14) {
-                return NULL;
-                break;
-            }
+                    return block;
+                }
+            } else {
+                block = blocknext;
+                if (block != NULL) {
+                    blocknext = to_block(block->pointer);
+                }
+            } // Find the first fit on the seglist.
         }
     }
 
+    return tree_best_fit(asize);
+}
+#endif
+
+// Find a free block of at least asize bytes, or NULL. With MM_STATS, also
+// count the search, the blocks it looked at, and whether it failed; with
+// MM_TRACE, record the result.
+static block_t *find_fit(size_t asize) {
+#ifdef MM_STATS
+    arena_stats_t *stats = arena_stats();
+    size_t probes = stats->count[STAT_FIT_PROBES];
+    block_t *block = search_fit(asize);
+    probes = stats->count[STAT_FIT_PROBES] - probes;
+    stats->max_probes = max(stats->max_probes, probes);
+    stat_add(STAT_FIT_SEARCHES, 1);
+    stat_add(STAT_FIT_MISSES, block == NULL ? 1 : 0);
+#else
+    block_t *block = search_fit(asize);
+#endif
+    trace_event(MM_TRACE_FIT, block, asize, 0);
+    return block;
+}
+
+#ifdef MM_SLAB
+// Returns the address of the first slot of a slab run.
+static char *slab_slots(slab_t *slab) {
+    return (char *)slab + round_up(sizeof(slab_t), dsize);
+}
+
+// Returns how many slots a run of the given slot size holds.
+static size_t slab_slot_count(size_t slot_size) {
+    return (SLAB_RUN_SIZE - round_up(sizeof(slab_t), dsize)) / slot_size;
+}
+
+// Returns the slab table index at which the search for a granule starts.
+static size_t slab_hash(word_t granule) {
+    return (size_t)(granule * 0x9E3779B97F4A7C15) & (arena->slab_capacity - 1);
+}
+
+/**
+ * @brief Finds the slab run that contains a payload pointer.
+ *
+ * Only the slab table is read: the pointer's granule is looked up, and the
+ * (at most two) runs overlapping that granule are checked for containing it.
+ * Nothing is read near the pointer itself, which may be an ordinary block.
+ *
+ * @param[in] bp A pointer returned by malloc
+ * @return The run holding `bp`, or NULL if `bp` is an ordinary block
+ */
+static slab_t *slab_lookup(void *bp) {
+    if (arena->slab_table == NULL) {
+        return NULL;
+    }
+    word_t granule = (word_t)(uintptr_t)bp / SLAB_RUN_SIZE;
+    size_t mask = arena->slab_capacity - 1;
+    for (size_t i = slab_hash(granule); arena->slab_table[i].slab != NULL;
+         i = (i + 1) & mask) {
+        slab_t *slab = arena->slab_table[i].slab;
+        if (arena->slab_table[i].granule == granule &&
+            (char *)bp > (char *)slab &&
+            (char *)bp < (char *)slab + SLAB_RUN_SIZE) {
+            return slab;
+        }
+    }
     return NULL;
 }
 
-// Helper function: Test the validity of each block.
-bool check_block_valid(block_t *block) {
-    if (is_epilogue_header(block) || block == NULL) {
-        return true;
-    } else if (get_size(block) == dsize) {
-        size_t blocksize = get_size(block);
-        size_t payloadsize = get_payload_size(block);
-        if (payloadsize != wsize || blocksize % dsize != 0 ||
-            blocksize != dsize) {
-            return false;
-        }
-    } else {
-        word_t header = block->header;
-        word_t *footer = header_to_footer(block);
-        if ((extract_size(header) != extract_size(*footer)) ||
-            (extract_alloc(header) != extract_alloc(*footer))) {
-            return false;
+// Maps one granule to a run. The table must have a free entry.
+static void slab_table_insert(word_t granule, slab_t *slab) {
+    size_t mask = arena->slab_capacity - 1;
+    size_t i = slab_hash(granule);
+    while (arena->slab_table[i].slab != NULL) {
+        i = (i + 1) & mask;
+    }
+    arena->slab_table[i].granule = granule;
+    arena->slab_table[i].slab = slab;
+    arena->slab_entries++;
+}
+
+// Unmaps one granule from a run. Later entries of the same probe chain are
+// shifted back into the hole, so lookups never need tombstones.
+static void slab_table_remove(word_t granule, slab_t *slab) {
+    size_t mask = arena->slab_capacity - 1;
+    size_t hole = slab_hash(granule);
+    while (arena->slab_table[hole].slab != slab ||
+           arena->slab_table[hole].granule != granule) {
+        hole = (hole + 1) & mask;
+    }
+    for (size_t i = (hole + 1) & mask; arena->slab_table[i].slab != NULL;
+         i = (i + 1) & mask) {
+        size_t home = slab_hash(arena->slab_table[i].granule);
+        // Move the entry unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            arena->slab_table[hole] = arena->slab_table[i];
+            hole = i;
+        }
+    }
+    arena->slab_table[hole].slab = NULL;
+    arena->slab_entries--;
+}
+
+// Returns the first and last granule a run overlaps.
+static word_t slab_first_granule(slab_t *slab) {
+    return (word_t)(uintptr_t)slab / SLAB_RUN_SIZE;
+}
+
+static word_t slab_last_granule(slab_t *slab) {
+    return ((word_t)(uintptr_t)slab + SLAB_RUN_SIZE - 1) / SLAB_RUN_SIZE;
+}
+
+// Helper function: Test the slab runs. Every table entry must name a run
+// overlapping its granule that sits in an allocated block and has a free
+// count matching its bitmap. Runs on the partial lists must be mapped, have
+// a free slot and consistent back links.
+static bool check_slabs(void) {
+    size_t used = 0;
+    for (size_t i = 0; i < arena->slab_capacity; i++) {
+        slab_t *slab = arena->slab_table[i].slab;
+        word_t granule = arena->slab_table[i].granule;
+        if (slab == NULL) {
+            continue;
+        }
+        used++;
+        if (granule < slab_first_granule(slab) ||
+            granule > slab_last_granule(slab) ||
+            !get_alloc(payload_to_header(slab))) {
+            return false;
+        }
+        size_t bits = 0;
+        for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+            bits += (size_t)__builtin_popcountll(slab->free_map[w]);
+        }
+        if (slab->free_count != bits ||
+            bits > slab_slot_count(slab->slot_size)) {
+            return false;
+        }
+    }
+    if (used != arena->slab_entries) {
+        return false;
+    }
+    for (size_t c = 0; c < SLAB_CLASSES; c++) {
+        slab_t *previous = NULL;
+        for (slab_t *slab = arena->slab_partial[c]; slab != NULL;
+             slab = slab->next) {
+            if (slab_lookup(slab_slots(slab)) != slab ||
+                slab->prev != previous || slab->slot_size != (c + 1) * dsize ||
+                slab->free_count == 0) {
+                return false;
+            }
+            previous = slab;
+        }
+    }
+    return true;
+}
+#endif
+
+// Helper function: Test the validity of each block. Every block must agree
+// with its predecessor on the pre_alloc and pre_dsize bits, and free blocks
+// must carry a footer that matches their header.
+static bool check_block_valid(block_t *block, block_t *previous) {
+    size_t blocksize = get_size(block);
+    if ((void *)block > mem_heap_hi() || blocksize % dsize != 0 ||
+        blocksize < dsize) {
+        return false;
+    }
+    if ((uintptr_t)header_to_payload(block) % dsize != 0) {
+        return false;
+    }
+    bool pre_alloc = previous == NULL || get_alloc(previous);
+    bool pre_dsize = previous != NULL && get_size(previous) == dsize;
+    if (get_pre_alloc(block) != pre_alloc ||
+        get_dsize_mask(block) != pre_dsize) {
+        return false;
+    }
+    if (!get_alloc(block) && blocksize >= min_block_size) {
+        tag_t *footer = header_to_footer(block);
+        if (extract_size(*footer) != blocksize || extract_alloc(*footer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function: Walk one extent from its first block to its epilogue and
+// count the free blocks. Two free blocks must never be adjacent.
+static bool check_extent(block_t *block, size_t *free_count) {
+    block_t *previous = NULL;
+    if (!is_epilogue_footer(find_prev_footer(block))) {
+        return false; // The extent must start right after a prologue.
+    }
+    while (!is_epilogue_header(block)) {
+        if (!check_block_valid(block, previous)) {
+            return false;
+        }
+        if (!get_alloc(block)) {
+            if (previous != NULL && !get_alloc(previous)) {
+                return false;
+            }
+            if (is_listed(get_size(block))) {
+                (*free_count)++;
+            }
+        }
+        previous = block;
+        block = find_next(block);
+    }
+    // The epilogue remembers the status of the last block.
+    bool pre_alloc = previous == NULL || get_alloc(previous);
+    bool pre_dsize = previous != NULL && get_size(previous) == dsize;
+    return get_pre_alloc(block) == pre_alloc &&
+           get_dsize_mask(block) == pre_dsize;
+}
+
+// Helper function: Test the validity of each seglist line. Blocks must be
+// free, belong to this size class and have consistent back pointers, and
+// with MM_ADDRESS_ORDER be sorted by address if they are ordered at all.
+// With MM_STATS the line must hold as many blocks as were counted onto it.
+static bool check_line(block_t *root, int index, size_t *free_count) {
+    block_t *previous = NULL;
+    size_t count = 0;
+    size_t limit = mem_heapsize() / dsize; // Bound the walk in case of cycles
+    for (block_t *block = root; block != NULL;
+         block = to_block(block->pointer)) {
+        if ((void *)block < mem_heap_lo() || (void *)block > mem_heap_hi()) {
+            return false;
+        }
+        if (get_alloc(block) || findindex(get_size(block)) != index) {
+            return false;
+        }
+        if (get_size(block) >= min_block_size &&
+            header_to_previous_pointer(block) != previous) {
+            return false;
+        }
+#ifdef MM_ADDRESS_ORDER
+        if (index >= findindex(ordered_min_size) && previous != NULL &&
+            previous > block) {
+            return false;
+        }
+#endif
+        if (++count > limit) {
+            return false;
+        }
+        previous = block;
+    }
+#ifdef MM_STATS
+    if (count != arena_stats()->blocks[index]) {
+        return false;
+    }
+#endif
+    *free_count += count;
+    return true;
+}
+
+#ifndef MM_TLSF
+// Helper function: Walk the large-block tree in order. Every node must be a
+// free block of tree size, sort after its predecessor and be the parent of
+// its children.
+static bool check_tree(size_t *free_count) {
+    block_t *block = arena->tree_root;
+    block_t *previous = NULL;
+    size_t count = 0;
+    size_t limit = mem_heapsize() / tree_min_size; // Bound the walk
+    if (block == NULL) {
+#ifdef MM_STATS
+        return arena_stats()->blocks[NUM_SEGLISTS] == 0;
+#else
+        return true;
+#endif
+    }
+    if (to_block(block->node.parent) != NULL) {
+        return false;
+    }
+    while (to_block(block->node.left) != NULL) {
+        block = to_block(block->node.left);
+    }
+    while (block != NULL) {
+        if ((void *)block < mem_heap_lo() || (void *)block > mem_heap_hi()) {
+            return false;
+        }
+        if (get_alloc(block) || get_size(block) < tree_min_size) {
+            return false;
+        }
+        block_t *left = to_block(block->node.left);
+        block_t *right = to_block(block->node.right);
+        if ((left && to_block(left->node.parent) != block) ||
+            (right && to_block(right->node.parent) != block)) {
+            return false;
+        }
+        if (previous != NULL && !tree_less(previous, block)) {
+            return false;
+        }
+        if (++count > limit) {
+            return false;
+        }
+        previous = block;
+        // Step to the in-order successor.
+        if (to_block(block->node.right) != NULL) {
+            block = to_block(block->node.right);
+            while (to_block(block->node.left) != NULL) {
+                block = to_block(block->node.left);
+            }
+        } else {
+            block_t *parent = to_block(block->node.parent);
+            while (parent != NULL && block == to_block(parent->node.right)) {
+                block = parent;
+                parent = to_block(block->node.parent);
+            }
+            block = parent;
+        }
+    }
+#ifdef MM_STATS
+    if (count != arena_stats()->blocks[NUM_SEGLISTS]) {
+        return false;
+    }
+#endif
+    *free_count += count;
+    return true;
+}
+#endif
+
+// Check that every quick list holds as many allocated blocks of its size as
+// counted.
+static bool check_quick(void) {
+    size_t total = 0;
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        size_t count = 0;
+        for (block_t *block = arena->quick[i]; block != NULL;
+             block = to_block(block->pointer)) {
+            if ((void *)block < mem_heap_lo() ||
+                (void *)block > mem_heap_hi() || !get_alloc(block) ||
+                get_size(block) != (i + 1) * dsize ||
+                ++count > arena->quick_count[i]) {
+                return false;
+            }
+        }
+        if (count != arena->quick_count[i] || count > quick_depth) {
+            return false;
+        }
+        total += count;
+    }
+    return total == arena->quick_blocks;
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * This function acts as the debug funtion to check the correctness of the heap.
+ * <What are the function's arguments?>
+ * It put in the heap line number.
+ * <What is the function's return value?>
+ * It will return bool value for whether the heap is correct.
+ * <Are there any preconditions or postconditions?>
+ * Take notice of the epilogue header and prologue footer. Check the correctness
+ * for each block and each seglist. With MM_THREADS only the arena the caller
+ * holds locked is checked, by walking every extent it owns.
+ *
+ * @param[in] line
+ * @return
+ */
+bool mm_checkheap(int line) {
+    size_t heap_free = 0; // Free blocks found walking the heap
+    size_t list_free = 0; // Free blocks found walking the seglists
+    if (arena == NULL) {
+        return true; // Nothing to check before mm_init
+    }
+#ifdef MM_THREADS
+    size_t n = atomic_load_explicit(&num_extents, memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+        if (extents[i].owner != arena) {
+            continue;
+        }
+        block_t *first = (extents[i].lo == (char *)arena)
+                             ? arena->heap_start
+                             : (block_t *)(extents[i].lo + dsize - tsize);
+        if (!check_extent(first, &heap_free)) {
+            return false;
+        }
+    }
+#else
+    if (!check_extent(arena->heap_start, &heap_free)) {
+        return false;
+    }
+#endif
+    for (int i = 0; i < NUM_SEGLISTS; i++) {
+        if (!check_line(arena->segregatehead[i], i, &list_free)) {
+            return false;
+        }
+        if (list_marked(i) != (arena->segregatehead[i] != NULL)) {
+            return false; // The occupancy map must match the roots.
+        }
+    }
+#ifdef MM_TLSF
+    for (int row = 0; row < TLSF_ROWS; row++) {
+        if (((arena->fl_map >> row) & 1) != (arena->sl_map[row] != 0)) {
+            return false; // A row is marked exactly when it has a list.
+        }
+    }
+#else
+    if (!check_tree(&list_free)) {
+        return false;
+    }
+#endif
+#ifdef MM_SLAB
+    if (!check_slabs()) {
+        return false;
+    }
+#endif
+    if (!check_quick()) {
+        return false;
+    }
+    return heap_free == list_free;
+}
+
+/**
+ * @brief Creates an empty arena at the current break.
+ *
+ * The arena header is followed by the prologue footer and the epilogue
+ * header, whose pre_alloc bit stands for the prologue. With MM_THREADS the
+ * caller must hold sbrk_lock.
+ *
+ * @return The new arena, or NULL if mem_sbrk fails
+ */
+static arena_t *arena_create(void) {
+    size_t header_size = round_up(sizeof(arena_t), dsize);
+    char *start = mem_sbrk(header_size + dsize);
+    if (start == (void *)-1) {
+        return NULL;
+    }
+    arena_t *new_arena = (arena_t *)start;
+    for (int i = 0; i < NUM_SEGLISTS; i++) {
+        new_arena->segregatehead[i] = NULL;
+    }
+#ifdef MM_TLSF
+    new_arena->fl_map = 0;
+    for (int i = 0; i < TLSF_ROWS; i++) {
+        new_arena->sl_map[i] = 0;
+    }
+#else
+    new_arena->seglist_map = 0;
+    new_arena->tree_root = NULL;
+#endif
+    // The tags end where the first payload will start, on a dsize boundary
+    tag_t *prologue = (tag_t *)(start + header_size + dsize) - 2;
+    prologue[0] = pack(0, true); // Heap prologue (block footer)
+    prologue[1] = pack(0, true) | pre_alloc_mask; // Heap epilogue (header)
+    new_arena->heap_start = (block_t *)&prologue[1];
+    new_arena->epilogue = new_arena->heap_start;
+    new_arena->zero_from = (char *)&prologue[2];
+    new_arena->grow_step = chunksize;
+    for (int i = 0; i < QUICK_BINS; i++) {
+        new_arena->quick[i] = NULL;
+        new_arena->quick_count[i] = 0;
+    }
+    new_arena->quick_blocks = 0;
+    new_arena->quick_hits = 0;
+    new_arena->quick_flushes = 0;
+    new_arena->quick_flushed = 0;
+#ifdef MM_STATS
+#ifdef MM_THREADS
+    arena_stats_t *stats = &stats_slot[stats_slots_used++ % MAX_ARENAS];
+    new_arena->stats = stats;
+#else
+    arena_stats_t *stats = &stats_single;
+#endif
+    memset(stats, 0, sizeof(*stats));
+#endif
+#ifdef MM_SLAB
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        new_arena->slab_partial[i] = NULL;
+    }
+    new_arena->slab_table = NULL;
+    new_arena->slab_capacity = 0;
+    new_arena->slab_entries = 0;
+#endif
+#ifdef MM_THREADS
+    pthread_mutex_init(&new_arena->lock, NULL);
+    atomic_init(&new_arena->remote_frees, NULL);
+    if (!register_extent(start, new_arena)) {
+        return NULL;
+    }
+#endif
+#ifdef MM_SHM_STATS
+    shm_claim_slot(new_arena);
+#endif
+    shm_heap();
+    return new_arena;
+}
+
+#ifdef MM_THREADS
+static void free_to_owner(block_t *block);
+static void remote_drain(void);
+
+/**
+ * @brief Returns the blocks cached by a thread to their arenas.
+ *
+ * Installed as the destructor of tcache_key, so it runs when a thread that
+ * has cached anything exits.
+ *
+ * @param[in] cache The exiting thread's tcache
+ */
+static void tcache_flush(void *cache) {
+    tcache_t *tc = (tcache_t *)cache;
+    for (size_t i = 0; i < TCACHE_BINS; i++) {
+        while (tc->bins[i] != NULL) {
+            block_t *block = tc->bins[i];
+            tc->bins[i] = to_block(block->pointer);
+            free_to_owner(block);
+        }
+        tc->count[i] = 0;
+    }
+#ifdef MM_SHM_STATS
+    shm_flush_thread(tc);
+#endif
+    tc->registered = false;
+}
+
+/**
+ * @brief Takes a cached block of exactly `asize` bytes, without locking.
+ * @param[in] asize Adjusted block size
+ * @return A block that is still marked allocated, or NULL
+ */
+static block_t *tcache_get(size_t asize) {
+    if (asize > TCACHE_BINS * dsize) {
+        return NULL;
+    }
+    size_t bin = asize / dsize - 1;
+    block_t *block = tcache.bins[bin];
+    if (block != NULL) {
+        tcache.bins[bin] = to_block(block->pointer);
+        tcache.count[bin]--;
+    }
+    return block;
+}
+
+/**
+ * @brief Caches a block being freed instead of returning it to its arena.
+ * @param[in] block An allocated block
+ * @return False if the block is too large or its bin is full
+ */
+static bool tcache_put(block_t *block) {
+    size_t size = get_size(block);
+    if (size > TCACHE_BINS * dsize) {
+        return false;
+    }
+    size_t bin = size / dsize - 1;
+    if (tcache.count[bin] >= tcache_depth) {
+        return false;
+    }
+    if (!tcache.registered) {
+        tcache.registered = true;
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    block->pointer = to_link(tcache.bins[bin]);
+    tcache.bins[bin] = block;
+    tcache.count[bin]++;
+    return true;
+}
+
+/**
+ * @brief Returns the arena the calling thread allocates from.
+ *
+ * Threads are assigned round-robin on their first allocation, and the arena
+ * is created on first use.
+ *
+ * @return The thread's home arena
+ */
+static arena_t *thread_arena(void) {
+    if (tcache.home == NULL) {
+        size_t i = atomic_fetch_add_explicit(&next_arena, 1,
+                                             memory_order_relaxed) %
+                   num_arenas;
+        pthread_mutex_lock(&sbrk_lock);
+        if (arenas[i] == NULL) {
+            arenas[i] = arena_create();
+        }
+        tcache.home = (arenas[i] != NULL) ? arenas[i] : arenas[0];
+        pthread_mutex_unlock(&sbrk_lock);
+    }
+    return tcache.home;
+}
+
+/**
+ * @brief Takes every allocator lock before fork, so that the child does
+ *        not inherit one held by a thread that does not exist there.
+ *
+ * Arena locks come before sbrk_lock, the order malloc takes them in. An
+ * arena created while sbrk_lock is let go is picked up by a rescan.
+ */
+static void fork_prepare(void) {
+    uint32_t locked = 0; // Bit i is set once arenas[i] is locked
+    pthread_mutex_lock(&init_lock);
+    pthread_mutex_lock(&sbrk_lock);
+    size_t i = 0;
+    while (i < MAX_ARENAS) {
+        arena_t *a = arenas[i];
+        if (a == NULL || (locked & (1u << i)) != 0) {
+            i++;
+            continue;
+        }
+        pthread_mutex_unlock(&sbrk_lock);
+        pthread_mutex_lock(&a->lock);
+        locked |= 1u << i;
+        pthread_mutex_lock(&sbrk_lock);
+        i = 0;
+    }
+#ifdef MM_PROFILE
+    pthread_mutex_lock(&prof_lock);
+#endif
+}
+
+/** @brief Releases the locks fork_prepare took, in the parent. */
+static void fork_parent(void) {
+#ifdef MM_PROFILE
+    pthread_mutex_unlock(&prof_lock);
+#endif
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_unlock(&arenas[i]->lock);
+        }
+    }
+    pthread_mutex_unlock(&sbrk_lock);
+    pthread_mutex_unlock(&init_lock);
+}
+
+/**
+ * @brief Reinitializes the locks fork_prepare took, in the child, where
+ *        the calling thread is the only one left.
+ */
+static void fork_child(void) {
+#ifdef MM_PROFILE
+    pthread_mutex_init(&prof_lock, NULL);
+#endif
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_init(&arenas[i]->lock, NULL);
+        }
+    }
+    pthread_mutex_init(&sbrk_lock, NULL);
+    pthread_mutex_init(&init_lock, NULL);
+}
+#endif
+
+#ifdef MM_PROFILE
+// Returns a hash of a payload address; the high bits are the best mixed.
+static uint64_t prof_hash(const void *bp) {
+    return ((uint64_t)(uintptr_t)bp >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+// Returns the first entry of prof_samples to probe for bp.
+static size_t prof_home(const void *bp) {
+    return (size_t)(prof_hash(bp) >> 32) & (PROF_SAMPLES - 1);
+}
+
+// Returns the bucket of prof_filter that bp falls in. Payloads are at
+// least dsize apart, and samples few, so the address bits above that
+// spread them well enough, and cost free no multiply.
+static size_t prof_bucket(const void *bp) {
+    return ((uintptr_t)bp >> 4) & (PROF_FILTER - 1);
+}
+
+// Add delta to the filter bucket of bp. The caller holds prof_lock.
+static void prof_filter_add(const void *bp, int delta) {
+    _Atomic uint16_t *count = &prof_filter[prof_bucket(bp)];
+    atomic_store_explicit(
+        count,
+        (uint16_t)(atomic_load_explicit(count, memory_order_relaxed) + delta),
+        memory_order_relaxed);
+}
+
+// Draws the bytes to allocate before the next sample. The gaps are
+// exponentially distributed, so that every byte allocated is equally likely
+// to be sampled, whatever the sizes of the allocations.
+static int64_t prof_next_gap(void) {
+    uint64_t x = prof_random; // xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    prof_random = x;
+    double u = (double)((x * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+    return (int64_t)(-log1p(-u) * prof_rate) + 1;
+}
+
+// Returns the site of a call stack, adding it if it is new, or NULL if the
+// table is full. The caller holds prof_lock.
+static prof_site_t *prof_site(void *const *frames, size_t depth) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+    }
+    size_t i = (size_t)(hash >> 32) & (PROF_SITES - 1);
+    for (;; i = (i + 1) & (PROF_SITES - 1)) {
+        prof_site_t *site = &prof_sites[i];
+        if (site->depth == 0) {
+            if (prof_site_count >= PROF_SITES / 4 * 3) {
+                return NULL;
+            }
+            prof_site_count++;
+            for (size_t f = 0; f < depth; f++) {
+                site->frames[f] = (uintptr_t)frames[f];
+            }
+            site->depth = depth;
+            return site;
+        }
+        if (site->depth == depth) {
+            size_t f = 0;
+            while (f < depth && site->frames[f] == (uintptr_t)frames[f]) {
+                f++;
+            }
+            if (f == depth) {
+                return site;
+            }
+        }
+    }
+}
+
+// Records a sample of the size-byte allocation at bp, made from the call
+// stack in frames.
+static void prof_add(void *bp, size_t size, void *const *frames,
+                     size_t depth) {
+    // The allocation was sampled with probability p, so it stands for 1/p
+    // allocations of its size
+    double p = -expm1(-(double)size / prof_rate);
+    double objs = 1 / p;
+    double bytes = (double)size * objs;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    prof_site_t *site = prof_site(frames, depth);
+    if (site == NULL || prof_sample_count >= PROF_SAMPLES / 4 * 3) {
+        prof_dropped++;
+    } else {
+        size_t i = prof_home(bp);
+        while (prof_samples[i].bp != NULL) {
+            i = (i + 1) & (PROF_SAMPLES - 1);
+        }
+        prof_samples[i].bp = bp;
+        prof_samples[i].site = site;
+        prof_samples[i].bytes = bytes;
+        prof_samples[i].objs = objs;
+        prof_sample_count++;
+        prof_filter_add(bp, 1);
+
+        site->live_bytes += bytes;
+        site->live_objs += objs;
+        site->total_bytes += bytes;
+        site->total_objs += objs;
+        prof_live += bytes;
+        if (prof_live > prof_peak) {
+            prof_peak = prof_live;
+            // Taking the peak figures visits every site, so they are taken
+            // again only once the peak has grown by 1/32
+            if (prof_peak >= prof_snapshot + prof_snapshot / 32) {
+                for (size_t s = 0; s < PROF_SITES; s++) {
+                    prof_sites[s].peak_bytes = prof_sites[s].live_bytes;
+                    prof_sites[s].peak_objs = prof_sites[s].live_objs;
+                }
+                prof_snapshot = prof_peak;
+            }
+        }
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+}
+
+// Drops the sample of bp, if there is one. Called by free when the filter
+// says that bp may have been sampled.
+__attribute__((noinline)) static void prof_forget(void *bp) {
+    prof_busy = true;
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    size_t mask = PROF_SAMPLES - 1;
+    size_t i = prof_home(bp);
+    while (prof_samples[i].bp != NULL && prof_samples[i].bp != bp) {
+        i = (i + 1) & mask;
+    }
+    if (prof_samples[i].bp == bp) {
+        prof_sample_t *sample = &prof_samples[i];
+        sample->site->live_bytes -= sample->bytes;
+        sample->site->live_objs -= sample->objs;
+        prof_live -= sample->bytes;
+        prof_sample_count--;
+        prof_filter_add(bp, -1);
+
+        // Move later entries of the probe sequence into the hole, unless
+        // that would put them before their home entry
+        for (size_t j = (i + 1) & mask; prof_samples[j].bp != NULL;
+             j = (j + 1) & mask) {
+            size_t home = prof_home(prof_samples[j].bp);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                prof_samples[i] = prof_samples[j];
+                i = j;
+            }
+        }
+        prof_samples[i].bp = NULL;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+    prof_busy = false;
+}
+
+/** @brief Buffered output of a profile dump, which cannot use stdio */
+typedef struct prof_out {
+    int fd;
+    bool ok;    // Whether every write so far succeeded
+    size_t len; // Bytes waiting in buf
+    char buf[4096];
+} prof_out_t;
+
+// Writes len bytes of s to out.
+static void prof_put(prof_out_t *out, const char *s, size_t len) {
+    if (out->len + len > sizeof(out->buf)) {
+        out->ok = out->ok && write_all(out->fd, out->buf, out->len);
+        out->len = 0;
+    }
+    if (len > sizeof(out->buf)) {
+        out->ok = out->ok && write_all(out->fd, s, len);
+        return;
+    }
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+// Writes the string s to out.
+static void prof_puts(prof_out_t *out, const char *s) {
+    prof_put(out, s, strlen(s));
+}
+
+// Stores v in decimal at s, without a terminating NUL, and returns the
+// number of digits.
+static size_t prof_format(char *s, uint64_t v) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    for (size_t i = 0; i < n; i++) {
+        s[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+// Writes the estimate x, rounded to a whole number, right-aligned in width
+// columns.
+static void prof_putu(prof_out_t *out, double x, size_t width) {
+    char digits[20];
+    size_t n = prof_format(digits, x > 0 ? (uint64_t)(x + 0.5) : 0);
+    for (; width > n; width--) {
+        prof_put(out, " ", 1);
+    }
+    prof_put(out, digits, n);
+}
+
+// Writes v in hexadecimal, with a 0x prefix.
+static void prof_putx(prof_out_t *out, uint64_t v) {
+    char digits[18];
+    size_t n = sizeof(digits);
+    do {
+        digits[--n] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v != 0);
+    digits[--n] = 'x';
+    digits[--n] = '0';
+    prof_put(out, digits + n, sizeof(digits) - n);
+}
+
+// Returns whether site a ranks before site b in a dump: by live bytes,
+// then by bytes at the peak.
+static bool prof_before(const prof_site_t *a, const prof_site_t *b) {
+    if (a->live_bytes != b->live_bytes) {
+        return a->live_bytes > b->live_bytes;
+    }
+    return a->peak_bytes > b->peak_bytes;
+}
+
+/**
+ * @brief Writes the profile to path: the estimated live and peak bytes,
+ *        then every call site ranked by its live bytes, then the memory map
+ *        of the process, which turns the return addresses into code.
+ *
+ * Neither stdio nor malloc is used, so the profile is not disturbed by
+ * being dumped.
+ *
+ * @param[in] path The file to write
+ * @return Whether the file was written
+ */
+static bool prof_dump(const char *path) {
+    static prof_site_t *order[PROF_SITES];
+    prof_out_t out;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0) {
+        return false;
+    }
+    out.ok = true;
+    out.len = 0;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    prof_puts(&out, "mm heap profile of pid ");
+    prof_putu(&out, (double)getpid(), 0);
+    prof_puts(&out, ", one sample per ");
+    prof_putu(&out, prof_rate, 0);
+    prof_puts(&out, " bytes allocated on average\nlive ");
+    prof_putu(&out, prof_live, 0);
+    prof_puts(&out, " bytes, peak ");
+    prof_putu(&out, prof_peak, 0);
+    prof_puts(&out, " bytes, estimated from ");
+    prof_putu(&out, (double)prof_sample_count, 0);
+    prof_puts(&out, " live samples (");
+    prof_putu(&out, (double)prof_dropped, 0);
+    prof_puts(&out, " dropped)\n\n"
+                    "    live bytes  live allocs    peak bytes  peak allocs"
+                    "   total bytes total allocs  call stack\n");
+
+    // Shell sort the sites; there are few enough, and qsort may malloc
+    size_t n = 0;
+    for (size_t i = 0; i < PROF_SITES; i++) {
+        if (prof_sites[i].depth > 0) {
+            order[n++] = &prof_sites[i];
+        }
+    }
+    for (size_t gap = n / 2; gap > 0; gap /= 2) {
+        for (size_t i = gap; i < n; i++) {
+            prof_site_t *site = order[i];
+            size_t j = i;
+            for (; j >= gap && prof_before(site, order[j - gap]); j -= gap) {
+                order[j] = order[j - gap];
+            }
+            order[j] = site;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        prof_site_t *site = order[i];
+        prof_putu(&out, site->live_bytes, 14);
+        prof_putu(&out, site->live_objs, 13);
+        prof_putu(&out, site->peak_bytes, 14);
+        prof_putu(&out, site->peak_objs, 13);
+        prof_putu(&out, site->total_bytes, 14);
+        prof_putu(&out, site->total_objs, 13);
+        prof_puts(&out, "  @");
+        for (size_t f = 0; f < site->depth; f++) {
+            prof_puts(&out, " ");
+            prof_putx(&out, site->frames[f]);
+        }
+        prof_puts(&out, "\n");
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+
+    prof_puts(&out, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char chunk[1024];
+        ssize_t got;
+        while ((got = read(maps, chunk, sizeof(chunk))) > 0) {
+            prof_put(&out, chunk, (size_t)got);
+        }
+        close(maps);
+    }
+    out.ok = out.ok && write_all(out.fd, out.buf, out.len);
+    return close(out.fd) == 0 && out.ok;
+}
+
+// Dumps the profile to prof_path with the next dump number appended.
+static void prof_dump_numbered(void) {
+    char path[sizeof(prof_path) + 24];
+    size_t len = strlen(prof_path);
+    memcpy(path, prof_path, len);
+    path[len++] = '.';
+#ifdef MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+    len += prof_format(path + len, ++prof_dumps);
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+    path[len] = '\0';
+    prof_dump(path);
+}
+
+// Dumps the profile on a signal. If the interrupted thread was inside the
+// profiler, its tables may be half updated, or their lock held, so the dump
+// is left to the thread's next allocation, which is made a sample.
+static void prof_signal(int sig) {
+    if (prof_busy) {
+        prof_dump_pending = 1;
+        prof_countdown = 0;
+        return;
+    }
+    prof_busy = true;
+    prof_dump_numbered();
+    prof_busy = false;
+}
+
+/**
+ * @brief Takes a sample of the allocation at bp, of size bytes, and dumps
+ *        the profile if a signal asked for it. Called when the calling
+ *        thread's countdown runs out, outside every arena lock.
+ *
+ * backtrace may malloc the first time it is called; those allocations are
+ * not sampled.
+ */
+__attribute__((noinline)) static void prof_sample(void *bp, size_t size) {
+    if (prof_busy) {
+        return;
+    }
+    if (prof_rate == 0) {
+        prof_countdown = INT64_MAX;
+        return;
+    }
+    prof_busy = true;
+    if (prof_dump_pending) {
+        prof_dump_pending = 0;
+        prof_dump_numbered();
+    }
+    if (prof_random == 0) {
+        // The thread's first allocation; start its countdown
+        prof_random = prof_hash(&prof_random) | 1;
+        prof_countdown += prof_next_gap();
+    }
+    if (prof_countdown <= 0) {
+        void *frames[PROF_DEPTH + PROF_SKIP];
+        int depth = backtrace(frames, PROF_DEPTH + PROF_SKIP);
+        if (depth > PROF_SKIP) {
+            prof_add(bp, size, frames + PROF_SKIP, (size_t)depth - PROF_SKIP);
+        }
+        prof_countdown = prof_next_gap();
+    }
+    prof_busy = false;
+}
+
+/**
+ * @brief Reads the profiler settings from the environment, maps the tables
+ *        and installs the signal handler.
+ *
+ * MM_PROFILE_RATE is the mean number of bytes between samples (0 turns the
+ * profiler off), MM_PROFILE_FILE the file dumped to at exit (mm.<pid>.heap
+ * by default), and MM_PROFILE_SIGNAL the signal that asks for a numbered
+ * dump (SIGUSR2 by default, 0 for none).
+ */
+static void prof_init(void) {
+    if (prof_samples != NULL) {
+        return;
+    }
+    const char *rate = getenv("MM_PROFILE_RATE");
+    prof_rate = (rate != NULL) ? (double)strtoull(rate, NULL, 10)
+                               : (double)prof_default_rate;
+    if (prof_rate == 0) {
+        return;
+    }
+    prof_samples = mmap(NULL, PROF_SAMPLES * sizeof(prof_sample_t),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    prof_sites = mmap(NULL, PROF_SITES * sizeof(prof_site_t),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (prof_samples == MAP_FAILED || prof_sites == MAP_FAILED) {
+        prof_samples = NULL;
+        prof_rate = 0;
+        return;
+    }
+
+    const char *file = getenv("MM_PROFILE_FILE");
+    if (file != NULL && strlen(file) < sizeof(prof_path)) {
+        strcpy(prof_path, file);
+    } else {
+        size_t len = strlen("mm.");
+        memcpy(prof_path, "mm.", len);
+        len += prof_format(prof_path + len, (uint64_t)getpid());
+        strcpy(prof_path + len, ".heap");
+    }
+
+    const char *sig = getenv("MM_PROFILE_SIGNAL");
+    int signo = (sig != NULL) ? atoi(sig) : SIGUSR2;
+    if (signo > 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = prof_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(signo, &action, NULL);
+    }
+}
+#endif
+
+// Count an allocation of size bytes towards the calling thread's next
+// sample, and return whether it is to be sampled. Always false without
+// MM_PROFILE.
+static bool prof_due(size_t size) {
+#ifdef MM_PROFILE
+    prof_countdown -= (int64_t)size;
+    return prof_countdown <= 0;
+#else
+    return false;
+#endif
+}
+
+// Sample the allocation of size bytes at bp, if there is one, after
+// prof_due said so, and return bp.
+static void *prof_malloc(void *bp, size_t size) {
+#ifdef MM_PROFILE
+    if (bp != NULL) {
+        prof_sample(bp, size);
+    }
+#endif
+    return bp;
+}
+
+// Forget bp if it was sampled. Does nothing without MM_PROFILE.
+static void prof_free(void *bp) {
+#ifdef MM_PROFILE
+    if (atomic_load_explicit(&prof_filter[prof_bucket(bp)],
+                             memory_order_relaxed) != 0) {
+        prof_forget(bp);
+    }
+#endif
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * This function initializes the heap.
+ * <What are the function's arguments?>
+ * Void input.
+ * <What is the function's return value?>
+ * It will return an initialized free heap with chunksize.
+ * <Are there any preconditions or postconditions?>
+ * With MM_THREADS it discards every arena and the caller's thread cache, so
+ * it must not run concurrently with any other allocator call.
+ *
+ * @return
+ */
+bool mm_init(void) {
+#ifdef MM_COMPACT
+    heap_base = mem_heap_lo();
+#endif
+#ifdef MM_SHM_STATS
+    shm_publish();
+#endif
+#ifdef MM_TRACE
+    trace_reset();
+#endif
+#ifdef MM_PROFILE
+    prof_init();
+#endif
+#ifdef MM_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_arenas = (cpus > 0) ? (size_t)cpus * arenas_per_cpu : 1;
+    if (num_arenas > MAX_ARENAS) {
+        num_arenas = MAX_ARENAS;
+    }
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        arenas[i] = NULL;
+    }
+#ifdef MM_STATS
+    stats_slots_used = 0;
+#endif
+    for (size_t i = 0; i < TCACHE_BINS; i++) {
+        tcache.bins[i] = NULL;
+        tcache.count[i] = 0;
+    }
+    tcache.home = NULL;
+    atomic_store(&next_arena, 0);
+    atomic_store(&num_extents, 0);
+    if (!tcache_key_created) {
+        pthread_key_create(&tcache_key, tcache_flush);
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+        tcache_key_created = true;
+    }
+    pthread_mutex_lock(&sbrk_lock);
+    arena = arenas[0] = arena_create();
+    pthread_mutex_unlock(&sbrk_lock);
+#else
+    // Create the initial empty heap
+    arena = arena_create();
+#endif
+    if (arena == NULL) {
+        return false;
+    }
+    // Extend the empty heap with a free block of bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+#ifdef MM_THREADS
+    atomic_store_explicit(&initialized, true, memory_order_release);
+#endif
+    return true;
+}
+
+/**
+ * @brief Takes a free block off its seglist, marks it allocated and splits
+ *        off what is not needed of it.
+ *
+ * @param[in] block A free block of at least asize bytes
+ * @param[in] asize The adjusted block size
+ * @param[out] dirty If not NULL, how many leading payload bytes may be
+ *                   nonzero; the rest of the payload is made zero
+ */
+static void place_block(block_t *block, size_t asize, size_t *dirty) {
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+
+    write_size_alloc(block, block_size, true);
+    disconnect(block);
+    // Try to split the block if too large
+    split_block(block, asize);
+
+    char *payload = header_to_payload(block);
+    char *end = (char *)find_next(block);
+    if (dirty != NULL) {
+        // Past zero_from only the links and the footer of a block that was
+        // not split can be nonzero
+        char *clean =
+            max_addr(arena->zero_from, payload + 3 * sizeof(link_t));
+        if (clean < end) {
+            *dirty = (size_t)(clean - payload);
+            if (get_size(block) == block_size) {
+                *(tag_t *)(end - tsize) = 0; // Old footer
+            }
+        } else {
+            *dirty = (size_t)(end - payload);
+        }
+    }
+    arena->zero_from = max_addr(arena->zero_from, end);
+}
+
+static bool quick_flush(void);
+
+/**
+ * @brief Takes a block of exactly asize bytes off its quick list (there are
+ *        none with MM_TLSF; see release_block).
+ * @param[in] asize Adjusted block size
+ * @return A block that is still marked allocated, or NULL
+ */
+static block_t *quick_get(size_t asize) {
+#ifdef MM_TLSF
+    return NULL;
+#else
+    if (asize > QUICK_BINS * dsize) {
+        return NULL;
+    }
+    size_t bin = asize / dsize - 1;
+    block_t *block = arena->quick[bin];
+    if (block != NULL) {
+        arena->quick[bin] = to_block(block->pointer);
+        arena->quick_count[bin]--;
+        arena->quick_blocks--;
+        arena->quick_hits++;
+    }
+    return block;
+#endif
+}
+
+// Find a free block of at least asize bytes in the current arena. When there
+// is none, the quick lists are consolidated first, and the arena is only
+// grown if that does not make a fit either.
+static block_t *find_fit_or_grow(size_t asize) {
+    block_t *block = find_fit(asize);
+    if (block == NULL && quick_flush()) {
+        block = find_fit(asize);
+    }
+    if (block == NULL) {
+        block = grow_heap(asize);
+    }
+    return block;
+}
+
+// Find a free block of asize bytes in the current arena, growing it if needed,
+// and mark it allocated.
+static block_t *malloc_block(size_t asize, size_t *dirty) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    block_t *block;
+
+#ifdef MM_THREADS
+    // Give back what other threads freed, so it can be coalesced and reused
+    remote_drain();
+#endif
+
+    // A block of the exact size freed recently needs no split at all
+    block = quick_get(asize);
+    if (block != NULL) {
+        if (dirty != NULL) {
+            *dirty = get_payload_size(block);
+        }
+        return block;
+    }
+
+    // Search the free list for a fit, or request more memory
+    block = find_fit_or_grow(asize);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    place_block(block, asize, dirty);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return block;
+}
+
+// Bytes to split off the front of a free block so that the rest has an
+// aligned payload: zero, or enough for a free block with links and footer.
+// Slack of a dsize block would go on the one seglist that is not doubly
+// linked, and cost a walk of it whenever it is taken off again; it would
+// also need pre_dsize set on the block after it, which in the compact build,
+// where min_block_size is dsize, is the aligned block itself.
+static size_t aligned_lead(block_t *block, size_t align) {
+    uintptr_t payload = (uintptr_t)header_to_payload(block);
+    size_t lead = round_up(payload, align) - payload;
+    if (lead > 0 && (lead <= dsize || lead < min_block_size)) {
+        lead += align;
+    }
+    return lead;
+}
+
+/**
+ * @brief Finds a block of asize bytes in the current arena whose payload is
+ *        aligned to align, growing the arena if needed, and marks it
+ *        allocated.
+ *
+ * The fit has room for the worst-case slack in front of the aligned payload.
+ * That slack is split off as a free block of its own and goes back on the
+ * seglists. The tail is given back by split_block, as in place_block.
+ *
+ * @param[in] asize The adjusted block size
+ * @param[in] align The payload alignment, a power of two, more than dsize
+ * @return The allocated block, or NULL
+ */
+static block_t *malloc_aligned_block(size_t asize, size_t align) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+
+    // The plain fit may happen to be aligned, or big enough anyway
+    size_t search = asize + align + min_block_size;
+    block_t *block = find_fit(asize);
+    if (block == NULL || get_size(block) < asize + aligned_lead(block, align)) {
+        block = find_fit(search);
+    }
+    if (block == NULL) {
+        block = find_fit_or_grow(search);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t size = get_size(block);
+    size_t lead = aligned_lead(block, align);
+    disconnect(block);
+    if (lead > 0) {
+        // A free block is never next to another one, so the slack needs no
+        // coalescing
+        write_size_alloc(block, lead, false);
+        block->pointer = to_link(NULL);
+        (*(&block->pointer + 1)) = to_link(NULL);
+#ifndef MM_TLSF
+        if (lead >= tree_min_size) {
+            block->node.parent = to_link(NULL); // Not in the tree yet
+        }
+#endif
+        link_to_the_list(block);
+        block = (block_t *)((char *)block + lead);
+        block->header = pack(size - lead, true);
+    } else {
+        write_size_alloc(block, size, true);
+    }
+    split_block(block, asize);
+    arena->zero_from = max_addr(arena->zero_from, (char *)find_next(block));
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return block;
+}
+
+/**
+ * @brief Cuts count allocated blocks of asize bytes off the front of a free
+ *        block, taking it off its seglist only once.
+ *
+ * The blocks are written back to back, and the last one takes the rest of
+ * the free block for split_block to give back, as in place_block.
+ *
+ * @param[in] block A free block of at least asize * count bytes
+ * @param[in] asize The adjusted block size
+ * @param[in] count Number of blocks to cut, at least 1
+ * @param[out] out Receives the payload of each block, in address order
+ */
+static void carve_blocks(block_t *block, size_t asize, size_t count,
+                         void **out) {
+    dbg_assert(!get_alloc(block));
+    size_t size = get_size(block);
+    dbg_requires(size >= asize * count);
+
+    disconnect(block);
+    // Every block but the first follows an allocated block of asize bytes
+    tag_t carved = pack(asize, true) | pre_alloc_mask;
+    if (asize == dsize) {
+        carved |= pre_dsize_mask;
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        write_size_alloc(block, asize, true);
+        out[i] = header_to_payload(block);
+        block = find_next(block);
+        block->header = carved;
+        size -= asize;
+    }
+    write_size_alloc(block, size, true);
+    out[count - 1] = header_to_payload(block);
+    split_block(block, asize);
+    arena->zero_from = max_addr(arena->zero_from, (char *)find_next(block));
+}
+
+// Allocate up to n blocks of asize bytes in the current arena, carving as
+// many as possible from each fit. Returns how many were allocated.
+static size_t malloc_blocks(size_t asize, size_t n, void **out) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+
+    size_t per_fit = max(batch_fit_size / asize, 1);
+    size_t done = 0;
+    while (done < n) {
+        size_t count = min(n - done, per_fit);
+        block_t *block = find_fit(asize * count);
+        if (block == NULL && count > 1) {
+            // Use up smaller fits before growing the heap
+            per_fit = count / 2;
+            continue;
+        }
+        if (block == NULL && quick_flush()) {
+            per_fit = max(batch_fit_size / asize, 1);
+            continue;
+        }
+        if (block == NULL) {
+            count = min(n - done, max(batch_fit_size / asize, 1));
+            block = grow_heap(asize * count);
+        }
+        if (block == NULL && count > 1) {
+            count = 1;
+            block = grow_heap(asize);
+        }
+        if (block == NULL) {
+            break;
+        }
+        carve_blocks(block, asize, count, out + done);
+        done += count;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return done;
+}
+
+/**
+ * @brief Gives the free block at the end of the current arena back to memlib.
+ *
+ * Only the arena whose epilogue is the last word of the heap can shrink.
+ * The block keeps pad bytes (at least min_block_size, if any) and the
+ * epilogue moves down behind it, recording the status of the new last block.
+ *
+ * @param[in] pad Bytes of the free block to keep
+ * @return True if the heap was shrunk
+ */
+static bool trim_arena(size_t pad) {
+    block_t *epilogue = arena->epilogue;
+    if (get_pre_alloc(epilogue)) {
+        return false;
+    }
+    block_t *last = find_prev(epilogue);
+    size_t size = get_size(last);
+    size_t keep = round_up(pad, dsize);
+    if (keep > 0 && keep < min_block_size) {
+        keep = min_block_size;
+    }
+    if (keep >= size) {
+        return false;
+    }
+#ifdef MM_THREADS
+    pthread_mutex_lock(&sbrk_lock);
+#endif
+    bool at_break = (char *)epilogue + tsize == (char *)mem_heap_hi() + 1;
+    if (at_break) {
+        disconnect(last);
+        mem_sbrk(-(intptr_t)(size - keep));
+        arena->grow_step = chunksize;
+        stat_add(STAT_TRIMS, 1);
+        trace_event(MM_TRACE_TRIM, (char *)epilogue + tsize - (size - keep),
+                    size - keep, 0);
+        shm_heap();
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&sbrk_lock);
+#endif
+    if (!at_break) {
+        return false;
+    }
+
+    if (keep == 0) {
+        // The epilogue takes over the header of the last block
+        bool pre_alloc = get_pre_alloc(last);
+        bool pre_dsize = get_dsize_mask(last);
+        write_epilogue(last);
+        write_pre_alloc(last, pre_alloc);
+        write_pre_dsize(last, pre_dsize);
+        arena->epilogue = last;
+        return true;
+    }
+    write_size_alloc(last, keep, false);
+    last->pointer = to_link(NULL);
+    (*(&last->pointer + 1)) = to_link(NULL);
+#ifndef MM_TLSF
+    if (keep >= tree_min_size) {
+        last->node.parent = to_link(NULL); // Not in the tree yet
+    }
+#endif
+    link_to_the_list(last);
+    block_t *block_next = find_next(last);
+    write_epilogue(block_next);
+    write_pre_alloc(block_next, false);
+    write_pre_dsize(block_next, keep == dsize);
+    arena->epilogue = block_next;
+    return true;
+}
+
+/**
+ * @brief Allocates a block in a mapping of its own.
+ *
+ * The payload is placed at the first align boundary at least dsize bytes
+ * into the mapping, and the block takes the rest of it. The word dsize bytes
+ * before the payload holds the number of bytes of the mapping in front of
+ * that word, so the mapping can be found again. Mapped blocks have no
+ * neighbours and belong to no arena.
+ *
+ * @param[in] asize The adjusted block size
+ * @param[in] align The payload alignment, a power of two, at least dsize
+ * @return The allocated block, or NULL if mem_map fails
+ */
+static block_t *map_block(size_t asize, size_t align) {
+    size_t length = round_up(asize + align, mem_pagesize());
+    if (length < asize) {
+        return NULL;
+    }
+#ifdef MM_COMPACT
+    if (length > compact_max) {
+        return NULL; // Too large for a 32-bit header
+    }
+#endif
+    char *start = mem_map(length);
+    if (start == NULL) {
+        return NULL;
+    }
+    char *payload = (char *)round_up((uintptr_t)start + dsize, align);
+    size_t lead = (size_t)(payload - dsize - start);
+    block_t *block = payload_to_header(payload);
+    *(word_t *)(payload - dsize) = lead;
+    block->header = pack(length - dsize - lead, true) | mapped_mask;
+    shm_heap();
+    return block;
+}
+
+// Return a mapped block to memlib.
+static void unmap_block(block_t *block) {
+    dbg_requires(is_mapped(block));
+    size_t lead = *(word_t *)(block->payload - dsize);
+    mem_unmap(block->payload - dsize - lead, get_size(block) + dsize + lead);
+    shm_heap();
+}
+
+// Return an allocated block to the seglists of the current arena.
+static void free_block(block_t *block) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    write_size_alloc(block, size, false);
+    block->pointer = to_link(NULL);
+    if (size >= min_block_size) {
+        (*(&block->pointer + 1)) = to_link(NULL);
+    }
+#ifndef MM_TLSF
+    if (size >= tree_min_size) {
+        block->node.parent = to_link(NULL); // Not in the tree yet
+    }
+#endif
+    block_t *block_next = find_next(block);
+    write_pre_alloc(block_next, false);
+    if (!get_alloc(block_next)) {
+        // The tags of the next block end up inside the merged one
+        arena->zero_from = max_addr(arena->zero_from,
+                                    (char *)block_next + min_block_size);
+    }
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+    size = get_size(block);
+
+    // Give a large free tail back rather than hold on to it
+    if (size >= trim_threshold && find_next(block) == arena->epilogue) {
+        trim_arena(trim_pad);
+    }
+    if (size >= quick_flush_size) {
+        quick_flush();
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief Returns every block on the quick lists of the current arena to the
+ *        seglists, coalescing each with its neighbours.
+ *
+ * The lists are all taken off before any block is freed, so that when
+ * free_block coalesces a large block and asks for a flush itself, it finds
+ * them empty rather than starting a nested pass.
+ *
+ * @return False if the quick lists were empty
+ */
+static bool quick_flush(void) {
+    if (arena->quick_blocks == 0) {
+        return false;
+    }
+    arena->quick_flushes++;
+    arena->quick_flushed += arena->quick_blocks;
+    // The blocks stay allocated until they are freed
+    block_t *lists[QUICK_BINS];
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        lists[i] = arena->quick[i];
+        arena->quick[i] = NULL;
+        arena->quick_count[i] = 0;
+    }
+    arena->quick_blocks = 0;
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        block_t *block = lists[i];
+        while (block != NULL) {
+            block_t *next = to_block(block->pointer);
+            free_block(block);
+            block = next;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Frees a block of the current arena, leaving small blocks on their
+ *        quick list rather than coalescing them.
+ *
+ * The same few small sizes tend to be freed and allocated again and again,
+ * and a quick list hands them back without a coalesce and a split. Blocks
+ * on a quick list stay marked allocated, so their neighbours do not merge
+ * with them either, until the lists are consolidated: when one of them
+ * overflows, or when no free block fits a request.
+ *
+ * MM_TLSF frees every block at once: consolidating a full list takes up to
+ * QUICK_BINS * quick_depth calls to free_block, which would undo the bound
+ * on the work of a single free or malloc.
+ *
+ * @param[in] block An allocated block
+ */
+static void release_block(block_t *block) {
+#ifdef MM_TLSF
+    free_block(block);
+#else
+    size_t size = get_size(block);
+    if (size > QUICK_BINS * dsize) {
+        free_block(block);
+        return;
+    }
+    size_t bin = size / dsize - 1;
+    if (arena->quick_count[bin] >= quick_depth) {
+        quick_flush();
+    }
+    block->pointer = to_link(arena->quick[bin]);
+    arena->quick[bin] = block;
+    arena->quick_count[bin]++;
+    arena->quick_blocks++;
+#endif
+}
+
+/**
+ * @brief Frees count blocks that lie back to back, starting at block.
+ *
+ * The run is first made into one allocated block, so it is linked and
+ * coalesced with its neighbours only once.
+ *
+ * @param[in] block The first allocated block of the run
+ * @param[in] count Number of blocks in the run
+ */
+static void free_run(block_t *block, size_t count) {
+    if (count > 1) {
+        size_t size = 0;
+        block_t *next = block;
+        for (size_t i = 0; i < count; i++) {
+            dbg_assert(get_alloc(next));
+            size += get_size(next);
+            next = find_next(next);
+        }
+        write_size_alloc(block, size, true);
+        write_pre_dsize(next, false);
+    }
+    free_block(block);
+}
+
+/**
+ * @brief Resizes an allocated block in place.
+ *
+ * A block grows by absorbing a free successor, and when it is the last
+ * block of the arena by extending the heap behind it. Whatever it does not
+ * need is split off its tail with split_block. The payload is not touched.
+ *
+ * @param[in] block An allocated block of the current arena
+ * @param[in] asize The adjusted block size wanted
+ * @param[in] shrink Whether to give back the tail when asize is smaller
+ * @return False, with the block unchanged, if it would have to move
+ */
+static bool resize_block(block_t *block, size_t asize, bool shrink) {
+    dbg_requires(get_alloc(block));
+    size_t size = get_size(block);
+    block_t *next = find_next(block);
+    if (asize == size || (asize < size && !shrink)) {
+        return true;
+    }
+    if (asize > size) {
+        size_t available = size;
+        block_t *after = next;
+        if (!get_alloc(next)) {
+            available += get_size(next);
+            after = find_next(next);
+        }
+        if (available < asize) {
+            // Only the last block of the arena can grow into new memory
+            if (after != arena->epilogue) {
+                return false;
+            }
+            block_t *fresh = extend_heap(asize - available);
+            if (fresh == NULL || fresh != find_next(block)) {
+                return false;
+            }
+            next = fresh;
+        }
+    }
+    if (!get_alloc(next)) {
+        // Absorb the free successor, as if the whole block were free. Its
+        // tags may end up in the free block split off the tail.
+        arena->zero_from = max_addr(arena->zero_from,
+                                    (char *)next + min_block_size);
+        disconnect(next);
+        size += get_size(next);
+        write_size_alloc(block, size, true);
+        next = find_next(block);
+    }
+    write_pre_alloc(next, false);
+    write_pre_dsize(next, false);
+    split_block(block, asize);
+    arena->zero_from = max_addr(arena->zero_from, (char *)find_next(block));
+    return true;
+}
+
+#ifdef MM_THREADS
+// Free a block under the lock of the arena that owns it.
+static void free_to_owner(block_t *block) {
+    arena_t *owner = extent_owner(block);
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    release_block(block);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+/**
+ * @brief Hands a block to the remote-free queue of the arena that owns it.
+ *
+ * Blocks owned by the caller's home arena are freed directly. Anything else
+ * is pushed without locking, and is coalesced later by a thread allocating
+ * from the owning arena.
+ *
+ * @param[in] block An allocated block
+ */
+static void free_remote(block_t *block) {
+    arena_t *owner = extent_owner(block);
+    if (owner == tcache.home) {
+        free_to_owner(block);
+        return;
+    }
+    block_t *head = atomic_load_explicit(&owner->remote_frees,
+                                         memory_order_relaxed);
+    do {
+        block->pointer = to_link(head);
+    } while (!atomic_compare_exchange_weak_explicit(
+        &owner->remote_frees, &head, block, memory_order_release,
+        memory_order_relaxed));
+}
+
+/**
+ * @brief Frees every block queued on the current arena by other threads.
+ *
+ * The caller must hold the arena lock. The queue is emptied with a single
+ * exchange, so pushes that race with the drain simply wait for the next one.
+ */
+static void remote_drain(void) {
+    if (atomic_load_explicit(&arena->remote_frees, memory_order_relaxed) ==
+        NULL) {
+        return;
+    }
+    block_t *block = atomic_exchange_explicit(&arena->remote_frees, NULL,
+                                              memory_order_acquire);
+    while (block != NULL) {
+        block_t *next = to_block(block->pointer);
+        release_block(block);
+        block = next;
+    }
+}
+#endif
+
+#ifdef MM_SLAB
+/**
+ * @brief Makes room in the slab table for one more run.
+ *
+ * The table is kept at most half full. It lives in an ordinary block, so
+ * growing it is a malloc of the new table and a free of the old one.
+ *
+ * @return False if the new table cannot be allocated
+ */
+static bool slab_table_reserve(void) {
+    if (2 * (arena->slab_entries + 2) <= arena->slab_capacity) {
+        return true;
+    }
+    size_t capacity = max(2 * arena->slab_capacity, 64);
+    block_t *block = malloc_block(
+        round_up(capacity * sizeof(slab_entry_t) + tsize, dsize), NULL);
+    if (block == NULL) {
+        return false;
+    }
+    slab_entry_t *old_table = arena->slab_table;
+    size_t old_capacity = arena->slab_capacity;
+    arena->slab_table = header_to_payload(block);
+    arena->slab_capacity = capacity;
+    arena->slab_entries = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        arena->slab_table[i].granule = 0;
+        arena->slab_table[i].slab = NULL;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_table[i].slab != NULL) {
+            slab_table_insert(old_table[i].granule, old_table[i].slab);
+        }
+    }
+    if (old_table != NULL) {
+        free_block(payload_to_header(old_table));
+    }
+    return true;
+}
+
+/**
+ * @brief Carves a new run for one size class and puts it on the class's
+ *        partial list.
+ *
+ * A run is only started in a free block that already exists. When the free
+ * space is all in fragments smaller than a run, growing the heap for a run
+ * would strand those fragments, so the caller falls back to an ordinary
+ * block, which can use them.
+ *
+ * @param[in] c The size class
+ * @return The new run, or NULL if no free block is large enough
+ */
+static slab_t *slab_create(size_t c) {
+    size_t asize = round_up(SLAB_RUN_SIZE + tsize, dsize);
+    block_t *block = find_fit(asize);
+    if (block == NULL || !slab_table_reserve()) {
+        return NULL;
+    }
+    // Growing the table may have used or split the block that was found
+    block = find_fit(asize);
+    if (block == NULL) {
+        return NULL;
+    }
+    place_block(block, asize, NULL);
+    slab_t *slab = header_to_payload(block);
+    size_t slots = slab_slot_count((c + 1) * dsize);
+    for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+        size_t bits = (slots > 64 * w) ? slots - 64 * w : 0;
+        slab->free_map[w] = (bits >= 64) ? ~(word_t)0
+                                         : ((word_t)1 << bits) - 1;
+    }
+    slab->slot_size = (uint32_t)((c + 1) * dsize);
+    slab->free_count = (uint32_t)slots;
+    slab->prev = NULL;
+    slab->next = arena->slab_partial[c];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->slab_partial[c] = slab;
+    for (word_t g = slab_first_granule(slab); g <= slab_last_granule(slab);
+         g++) {
+        slab_table_insert(g, slab);
+    }
+    return slab;
+}
+
+/**
+ * @brief Allocates a slot of at least `size` bytes from a slab run.
+ *
+ * The first run on the class's partial list always has a free slot, and the
+ * lowest one is found with a count-trailing-zeros on its bitmap. A run that
+ * becomes full leaves the partial list.
+ *
+ * @param[in] size Requested payload size, at most SLAB_CLASSES * dsize
+ * @return The slot, or NULL if there is no run to take it from
+ */
+static void *slab_malloc(size_t size) {
+    size_t c = (size - 1) / dsize;
+    slab_t *slab = arena->slab_partial[c];
+    if (slab == NULL && (slab = slab_create(c)) == NULL) {
+        return NULL;
+    }
+    size_t w = 0;
+    while (slab->free_map[w] == 0) {
+        w++;
+    }
+    size_t bit = (size_t)__builtin_ctzll(slab->free_map[w]);
+    slab->free_map[w] &= slab->free_map[w] - 1;
+    if (--slab->free_count == 0) {
+        arena->slab_partial[c] = slab->next;
+        if (slab->next != NULL) {
+            slab->next->prev = NULL;
+        }
+        slab->next = NULL;
+    }
+    return slab_slots(slab) + (64 * w + bit) * slab->slot_size;
+}
+
+/**
+ * @brief Allocates up to n slots of at least `size` bytes, emptying the
+ *        bitmap of one run after another.
+ *
+ * Each run leaves the partial list at most once, when it has given up its
+ * last free slot, however many slots were taken from it.
+ *
+ * @param[in] size Requested payload size, at most SLAB_CLASSES * dsize
+ * @param[in] n Number of slots wanted
+ * @param[out] out Receives the slots
+ * @return How many slots were stored in out
+ */
+static size_t slab_malloc_batch(size_t size, size_t n, void **out) {
+    size_t c = (size - 1) / dsize;
+    size_t done = 0;
+    while (done < n) {
+        slab_t *slab = arena->slab_partial[c];
+        if (slab == NULL && (slab = slab_create(c)) == NULL) {
+            break;
+        }
+        char *slots = slab_slots(slab);
+        for (size_t w = 0; w < SLAB_MAP_WORDS && done < n; w++) {
+            word_t map = slab->free_map[w];
+            while (map != 0 && done < n) {
+                size_t bit = (size_t)__builtin_ctzll(map);
+                map &= map - 1;
+                out[done++] = slots + (64 * w + bit) * slab->slot_size;
+                slab->free_count--;
+            }
+            slab->free_map[w] = map;
+        }
+        if (slab->free_count == 0) {
+            arena->slab_partial[c] = slab->next;
+            if (slab->next != NULL) {
+                slab->next->prev = NULL;
+            }
+            slab->next = NULL;
+        }
+    }
+    return done;
+}
+
+/**
+ * @brief Returns a slot to its run.
+ *
+ * A run that was full goes back on its partial list. A run that becomes
+ * empty is given straight back to the seglists: keeping empty runs around
+ * pins the middle of the heap and stops large blocks from coalescing there.
+ *
+ * @param[in] slab The run found by slab_lookup
+ * @param[in] bp The slot being freed
+ */
+static void slab_free(slab_t *slab, void *bp) {
+    size_t c = slab->slot_size / dsize - 1;
+    size_t slot = (size_t)((char *)bp - slab_slots(slab)) / slab->slot_size;
+    slab->free_map[slot / 64] |= (word_t)1 << (slot % 64);
+    if (slab->free_count++ == 0) {
+        slab->prev = NULL;
+        slab->next = arena->slab_partial[c];
+        if (slab->next != NULL) {
+            slab->next->prev = slab;
+        }
+        arena->slab_partial[c] = slab;
+    }
+    if (slab->free_count == slab_slot_count(slab->slot_size)) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        } else {
+            arena->slab_partial[c] = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+        for (word_t g = slab_first_granule(slab); g <= slab_last_granule(slab);
+             g++) {
+            slab_table_remove(g, slab);
+        }
+        free_block(payload_to_header(slab));
+        if (arena->slab_entries == 0) {
+            // Do not let an empty table pin the middle of the heap
+            slab_entry_t *table = arena->slab_table;
+            arena->slab_table = NULL;
+            arena->slab_capacity = 0;
+            free_block(payload_to_header(table));
+        }
+    }
+}
+#endif
+
+// Initialize the heap on first use. Returns false if mm_init fails.
+static bool heap_ready(void) {
+#ifdef MM_THREADS
+    if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+        pthread_mutex_lock(&init_lock);
+        if (!atomic_load_explicit(&initialized, memory_order_relaxed)) {
+            mm_init();
+        }
+        pthread_mutex_unlock(&init_lock);
+        return atomic_load_explicit(&initialized, memory_order_acquire);
+    }
+    return true;
+#else
+    return arena != NULL || mm_init();
+#endif
+}
+
+/**
+ * @brief Allocates size bytes, and tells how many of them may be nonzero.
+ *
+ * Only blocks carved past the arena's zero_from, and mapped blocks, are
+ * known to be mostly zero; slab slots and cached blocks are always dirty.
+ *
+ * @param[in] size The payload size wanted
+ * @param[out] dirty Leading payload bytes that may be nonzero, or NULL
+ * @return The payload, or NULL
+ */
+static void *allocate(size_t size, size_t *dirty) {
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
+    if (dirty != NULL) {
+        *dirty = size;
+    }
+
+    // Initialize heap if it isn't initialized
+    if (!heap_ready()) {
+        return bp;
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        return bp;
+    }
+
+#ifdef MM_SLAB
+    // Small requests are carved from slab runs, with no header at all
+    if (size <= SLAB_CLASSES * dsize && (bp = slab_malloc(size)) != NULL) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        shm_count(round_up(size, dsize), false);
+        return bp;
+    }
+#endif
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + tsize, dsize);
+    if (asize < size) {
+        return bp; // size + tsize overflowed
+    }
+
+    // Huge requests bypass the heap, if they can be mapped
+    if (asize >= map_threshold && (block = map_block(asize, dsize)) != NULL) {
+        if (dirty != NULL) {
+            *dirty = 0; // Mappings are zero-filled
+        }
+        shm_count(get_payload_size(block), false);
+        return header_to_payload(block);
+    }
+
+#ifdef MM_THREADS
+    block = tcache_get(asize);
+    if (block == NULL) {
+        arena_t *home = thread_arena();
+        pthread_mutex_lock(&home->lock);
+        arena = home;
+        block = malloc_block(asize, dirty);
+        pthread_mutex_unlock(&home->lock);
+    }
+#else
+    block = malloc_block(asize, dirty);
+#endif
+    if (block == NULL) {
+        return bp;
+    }
+
+    shm_count(get_payload_size(block), false);
+    bp = header_to_payload(block);
+    return bp;
+}
+
+// malloc without its MM_TRACE event, for realloc, which records its own.
+static void *malloc_untraced(size_t size) {
+    if (prof_due(size)) {
+        return prof_malloc(allocate(size, NULL), size);
+    }
+    return allocate(size, NULL);
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * It allocates a space with size.
+ * <What are the function's arguments?>
+ * It inputs the allocated size.
+ * <What is the function's return value?>
+ * It will return the payload address for the allocated space.
+ * <Are there any preconditions or postconditions?>
+ * It must work after the initialization of the heap. With MM_THREADS, a
+ * cached block of the right size is handed out without taking any lock;
+ * otherwise the thread's home arena is locked for the search.
+ *
+ * @param[in] size
+ * @return
+ */
+void *malloc(size_t size) {
+    trace_event(MM_TRACE_MALLOC, NULL, size, 0);
+    return malloc_untraced(size);
+}
+
+// free of a payload other than NULL, without its MM_TRACE event, for
+// realloc, which records its own.
+static void free_untraced(void *bp) {
+    prof_free(bp);
+
+#ifdef MM_SLAB
+    slab_t *slab = slab_lookup(bp);
+    if (slab != NULL) {
+        shm_count(slab->slot_size, true);
+        slab_free(slab, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
+    block_t *block = payload_to_header(bp);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+    shm_count(get_payload_size(block), true);
+
+    if (is_mapped(block)) {
+        unmap_block(block);
+        return;
+    }
+
+#ifdef MM_THREADS
+    if (!tcache_put(block)) {
+        free_remote(block);
+    }
+#else
+    release_block(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+#endif
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * It frees a allocated space.
+ * <What are the function's arguments?>
+ * It inputs the payload address.
+ * <What is the function's return value?>
+ * It will return void.
+ * <Are there any preconditions or postconditions?>
+ * bp should not bu NULL. After freeing, we should coalesce the possible free
+ blocks. payload_to_header. With MM_THREADS the block goes to the caller's
+ thread cache if there is room, and otherwise to the arena that owns it.
+ * @param[in] bp
+ */
+void free(void *bp) {
+    if (bp == NULL) {
+        return;
+    }
+    trace_event(MM_TRACE_FREE, bp, 0, 0);
+    free_untraced(bp);
+}
+
+/**
+ * @brief Resizes the allocation at bp to hold size bytes without moving it.
+ *
+ * Slab slots and mapped blocks cannot grow, so they only succeed if they
+ * are large enough already. With MM_THREADS the arena that owns the block
+ * is locked.
+ *
+ * @param[in] bp A payload returned by malloc
+ * @param[in] size The payload size wanted
+ * @param[in] shrink Whether to give back memory when size is smaller
+ * @return Whether the allocation now holds size bytes
+ */
+static bool resize_in_place(void *bp, size_t size, bool shrink) {
+#ifdef MM_SLAB
+    slab_t *slab = slab_lookup(bp);
+    if (slab != NULL) {
+        return size <= slab->slot_size;
+    }
+#endif
+    block_t *block = payload_to_header(bp);
+    size_t asize = round_up(size + tsize, dsize);
+    if (asize < size) {
+        return false; // size + tsize overflowed
+    }
+    if (is_mapped(block)) {
+        // A mapping cannot grow, and is only kept when mostly in use
+        return asize <= get_size(block) &&
+               (!shrink || asize > get_size(block) / 2);
+    }
+    bool resized;
+    size_t before = get_payload_size(block);
+#ifdef MM_THREADS
+    arena_t *owner = extent_owner(block);
+    pthread_mutex_lock(&owner->lock);
+    arena = owner;
+    resized = resize_block(block, asize, shrink);
+    pthread_mutex_unlock(&owner->lock);
+#else
+    resized = resize_block(block, asize, shrink);
+#endif
+    if (resized) {
+        shm_resize(before, get_payload_size(block));
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+    return resized;
+}
+
+#ifndef BUILD_CFLAGS
+#define BUILD_CFLAGS "unknown"
+#endif
+
+/**
+ * @brief Returns the compiler and flags this file was built with, which
+ *        the Makefile passes in as BUILD_CFLAGS, so that a driver's results
+ *        name the build of mm.c they measured.
+ */
+const char *mm_build_cflags(void) {
+    return BUILD_CFLAGS;
+}
+
+/**
+ * @brief Returns free memory at the end of the heap to memlib.
+ *
+ * The quick lists are consolidated first. With MM_THREADS every arena is
+ * trimmed in turn, after it has taken back the blocks other threads freed,
+ * but only the arena at the break can actually shrink the heap.
+ *
+ * @param[in] pad Bytes of free memory to leave at the end of the heap
+ * @return True if the heap was shrunk
+ */
+bool mm_trim(size_t pad) {
+#ifdef MM_THREADS
+    if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+        return false;
+    }
+    arena_t *all[MAX_ARENAS];
+    pthread_mutex_lock(&sbrk_lock);
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        all[i] = arenas[i];
+    }
+    pthread_mutex_unlock(&sbrk_lock);
+
+    bool trimmed = false;
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        if (all[i] == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&all[i]->lock);
+        arena = all[i];
+        remote_drain();
+        quick_flush();
+        trimmed = trim_arena(pad) || trimmed;
+        pthread_mutex_unlock(&all[i]->lock);
+    }
+    return trimmed;
+#else
+    if (arena == NULL) {
+        return false;
+    }
+    quick_flush();
+    return trim_arena(pad);
+#endif
+}
+
+// Add the quick list counters of the current arena to stats.
+static void add_quick_stats(struct mm_quick_stats *stats) {
+    stats->hits += arena->quick_hits;
+    stats->cached += arena->quick_blocks;
+    stats->flushes += arena->quick_flushes;
+    stats->flushed += arena->quick_flushed;
+}
+
+/**
+ * @brief Reports how often the quick lists served a malloc, and how often
+ *        they had to be consolidated, since mm_init.
+ *
+ * Every hit is a malloc that took a block without splitting one, after a
+ * free that did not coalesce it. With MM_THREADS the counters of all
+ * arenas are added up.
+ *
+ * @param[out] stats Receives the counters
+ */
+void mm_quick_stats(struct mm_quick_stats *stats) {
+    stats->hits = 0;
+    stats->cached = 0;
+    stats->flushes = 0;
+    stats->flushed = 0;
+#ifdef MM_THREADS
+    if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+        return;
+    }
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&sbrk_lock);
+        arena_t *a = arenas[i];
+        pthread_mutex_unlock(&sbrk_lock);
+        if (a == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&a->lock);
+        arena = a;
+        add_quick_stats(stats);
+        pthread_mutex_unlock(&a->lock);
+    }
+#else
+    if (arena != NULL) {
+        add_quick_stats(stats);
+    }
+#endif
+}
+
+#ifdef MM_STATS
+// Add the counters of the current arena to stats. Probe maxima are the
+// largest of any arena, list lengths and peaks the sum over arenas.
+static void add_stats(struct mm_stats *stats) {
+    const arena_stats_t *own = arena_stats();
+    stats->fit_searches += own->count[STAT_FIT_SEARCHES];
+    stats->fit_probes += own->count[STAT_FIT_PROBES];
+    stats->fit_max_probes = max(stats->fit_max_probes, own->max_probes);
+    stats->fit_misses += own->count[STAT_FIT_MISSES];
+    stats->splits += own->count[STAT_SPLITS];
+    stats->coalesce_none += own->count[STAT_COALESCE_NONE];
+    stats->coalesce_prev += own->count[STAT_COALESCE_PREV];
+    stats->coalesce_next += own->count[STAT_COALESCE_NEXT];
+    stats->coalesce_both += own->count[STAT_COALESCE_BOTH];
+    stats->extends += own->count[STAT_EXTENDS];
+    stats->extend_bytes += own->count[STAT_EXTEND_BYTES];
+    stats->trims += own->count[STAT_TRIMS];
+    for (int i = 0; i < NUM_SEGLISTS; i++) {
+        stats->list_blocks[i] += own->blocks[i];
+        stats->list_peak[i] += own->peak[i];
+    }
+    stats->tree_blocks += own->blocks[NUM_SEGLISTS];
+    stats->tree_peak += own->peak[NUM_SEGLISTS];
+}
+#endif
+
+/**
+ * @brief Reports the counters of the MM_STATS build since mm_init: how long
+ *        find_fit searched, how often blocks were split, coalesced and the
+ *        heap grown or trimmed, and how many blocks each seglist holds.
+ *
+ * Without MM_STATS nothing is counted, and stats is only cleared. With
+ * MM_THREADS the counters of all arenas are added up.
+ *
+ * @param[out] stats Receives the counters
+ * @return Whether mm.c was built with MM_STATS
+ */
+bool mm_stats(struct mm_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef MM_STATS
+    stats->lists = NUM_SEGLISTS;
+#ifdef MM_THREADS
+    if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+        return true;
+    }
+    for (size_t i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&sbrk_lock);
+        arena_t *a = arenas[i];
+        pthread_mutex_unlock(&sbrk_lock);
+        if (a == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&a->lock);
+        arena = a;
+        add_stats(stats);
+        pthread_mutex_unlock(&a->lock);
+    }
+#else
+    if (arena != NULL) {
+        add_stats(stats);
+    }
+#endif
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Writes the rings of the MM_TRACE build to path, in the format of
+ *        struct mm_trace_header: for every thread that recorded anything,
+ *        its latest TRACE_EVENTS events, oldest first.
+ *
+ * Neither stdio nor malloc is used, so this may be called from anywhere,
+ * but events recorded by other threads while it runs may come out torn.
+ * The events of a thread that has exited are written by one dump only;
+ * its ring then goes to the next new thread.
+ *
+ * @param[in] path The file to write
+ * @return Whether the file was written; always false without MM_TRACE
+ */
+bool mm_trace_dump(const char *path) {
+#ifdef MM_TRACE
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+#ifdef MM_THREADS
+    trace_ring_t *rings =
+        atomic_load_explicit(&trace_rings, memory_order_acquire);
+#else
+    trace_ring_t *rings = trace_rings;
+#endif
+    struct mm_trace_header header;
+    memcpy(header.magic, MM_TRACE_MAGIC, sizeof(header.magic));
+    header.ticks0 = trace_ticks0;
+    header.ns0 = trace_ns0;
+    header.ticks1 = trace_clock();
+    header.ns1 = trace_ns();
+    header.rings = 0;
+
+    // The count of rings is filled in once they are written, since a ring
+    // can gain its first event, or be taken over, in the meantime.
+    bool ok = write_all(fd, &header, sizeof(header));
+    for (trace_ring_t *ring = rings; ring != NULL && ok; ring = ring->next) {
+#ifdef MM_THREADS
+        bool exited = atomic_load_explicit(&ring->state,
+                                           memory_order_acquire) ==
+                      TRACE_RING_EXITED;
+#endif
+        uint64_t head = ring->head;
+        if (head == 0) {
+            continue;
         }
-        size_t blocksize = get_size(block);
-        size_t payloadsize = get_payload_size(block);
-        if (payloadsize % dsize != 0 || blocksize % dsize != 0 ||
-            blocksize < min_block_size ||
-            payloadsize < (min_block_size - dsize)) {
-            return false;
+        // Once the ring has wrapped, the oldest event is the one the head
+        // points at.
+        uint64_t count = min(head, TRACE_EVENTS);
+        size_t first = (head - count) & (TRACE_EVENTS - 1);
+        size_t part = min(count, TRACE_EVENTS - first);
+        uint64_t info[2] = {ring->tid, count};
+        ok = write_all(fd, info, sizeof(info)) &&
+             write_all(fd, &ring->event[first],
+                       part * sizeof(struct mm_trace_event)) &&
+             write_all(fd, &ring->event[0],
+                       (count - part) * sizeof(struct mm_trace_event));
+        header.rings++;
+#ifdef MM_THREADS
+        if (ok && exited) {
+            ring->head = 0;
+            atomic_store_explicit(&ring->state, TRACE_RING_FREE,
+                                  memory_order_release);
         }
+#endif
     }
-    return true;
+    ok = ok && pwrite(fd, &header.rings, sizeof(header.rings),
+                      offsetof(struct mm_trace_header, rings)) ==
+                   (ssize_t)sizeof(header.rings);
+    return close(fd) == 0 && ok;
+#else
+    return false;
+#endif
 }
 
-// Helper function: Test the validity of each seglist line.
-bool check_line(block_t *root, int index) {
-    block_t *testblock = NULL;
-    block_t *testblocknext = NULL;
-    int testindex = 0;
-    size_t blocksize;
-    if (index == 0) {
-        testblock = root;
-        while (root != NULL) {
-            if (!check_block_valid(testblock)) {
-                return false;
-            }
-            if (extract_alloc(testblock->header)) {
-                return false;
-            }
-            blocksize = get_size(testblock);
-            testindex = findindex(blocksize);
-            if (testindex != index) {
-                return false;
-            }
-            testblocknext = testblock->pointer;
-            testblock = testblocknext;
-        }
-        return true;
-    } else {
-        if (root != NULL) {
-            testblock = root;
-            while (testblock != NULL) {
-                if (!check_block_valid(testblock)) {
-                    return false;
-                }
-                if (extract_alloc(testblock->header) ||
-                    extract_alloc(*(header_to_footer(testblock)))) {
-                    return false;
-                }
-                blocksize = get_size(testblock);
-                testindex = findindex(blocksize);
-                if (testindex != index) {
-                    return false;
-                }
-                testblocknext = testblock->pointer;
-
-                if (testblocknext != NULL) {
-                    if (*(&testblocknext->pointer + 1) != testblock) {
-                        return false;
-                    }
-                }
-
-                testblock = testblocknext;
-            }
-        }
-        return true;
+#if defined(MM_TRACE) && !defined(DRIVER)
+// Dump the rings to the file MM_TRACE_FILE names, if it is set, when the
+// program exits.
+__attribute__((destructor)) static void trace_dump_at_exit(void) {
+    const char *path = getenv("MM_TRACE_FILE");
+    if (path != NULL) {
+        mm_trace_dump(path);
     }
 }
+#endif
 
 /**
- * @brief
- *
- * <What does this function do?>
- * This function acts as the debug funtion to check the correctness of the heap.
- * <What are the function's arguments?>
- * It put in the heap line number.
- * <What is the function's return value?>
- * It will return bool value for whether the heap is correct.
- * <Are there any preconditions or postconditions?>
- * Take notice of the epilogue header and prologue footer. Check the correctness
- * for each block and each seglist.
+ * @brief Writes the heap profile of the MM_PROFILE build to path: for each
+ *        call site of the sampled allocations, the estimated bytes and
+ *        allocations live now, live at the peak and made in all, ranked by
+ *        live bytes.
  *
- * @param[in] line
- * @return
+ * @param[in] path The file to write
+ * @return Whether the file was written; always false without MM_PROFILE,
+ *         or with MM_PROFILE_RATE=0
  */
-bool mm_checkheap(int line) {
-    word_t *epilogue_footer = find_prev_footer(heap_start);
-    block_t *testblock = NULL;
-    block_t *testlineroot = NULL;
-    if (!is_epilogue_footer(
-            epilogue_footer)) { // Check the previous footer of heap start is
-                                // prologue footer.
+bool mm_profile_dump(const char *path) {
+#ifdef MM_PROFILE
+    if (prof_rate == 0) {
         return false;
     }
-    if (!is_epilogue_header(
-            heap_start)) { // The case when it is already working (The heap
-                           // start is not epilogue header).
-        testblock = heap_start;
-        while (!is_epilogue_header(testblock) && testblock != NULL) {
-            if (!check_block_valid(testblock)) {
-                return false;
-            }
-            testblock = find_next(testblock);
-        } // Traverse through the whole heap and check the validity of each
-          // block.
-        for (int i = 0; i < 4; i++) {
-            testlineroot = segregatehead[i];
-            if (!check_line(testlineroot, i)) {
-                return false;
-            } // Test each seglist.
-        }
-    }
+    prof_busy = true;
+    bool ok = prof_dump(path);
+    prof_busy = false;
+    return ok;
+#else
+    return false;
+#endif
+}
 
-    return true;
+#ifdef MM_PROFILE
+// Dump the profile to prof_path when the program exits.
+__attribute__((destructor)) static void prof_dump_at_exit(void) {
+    if (prof_rate > 0) {
+        prof_dump(prof_path);
+    }
 }
+#endif
 
 /**
- * @brief
+ * @brief Grows the allocation at ptr to at least size bytes, in place.
  *
- * <What does this function do?>
- * This function initializes the heap.
- * <What are the function's arguments?>
- * Void input.
- * <What is the function's return value?>
- * It will return an initialized free heap with chunksize.
- * <Are there any preconditions or postconditions?>
- * No.
+ * Unlike realloc, the block is never moved and never made smaller, so
+ * pointers into it stay valid whatever the result.
  *
- * @return
+ * @param[in] ptr A payload returned by malloc
+ * @param[in] size The payload size wanted
+ * @return True if the allocation now holds size bytes, false if it would
+ *         have to move
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-    if (start == (void *)-1) {
+bool mm_expand(void *ptr, size_t size) {
+    if (ptr == NULL || !resize_in_place(ptr, size, false)) {
         return false;
     }
-    for (int i = 0; i < 14; i++) {
-        segregatehead[i] = NULL;
-    }
-    start[0] = pack(0, true); // Heap prologue (block footer)
-    start[1] = pack(
-        0,
-        true); // Heap epilogue (block header)
-               // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-    last_block_prealloc = true;
-    block_t *extendheap = extend_heap(chunksize);
-    // Extend the empty heap with a free block of bytes
-    if (extendheap == NULL) {
-        return false;
+    prof_free(ptr);
+    if (prof_due(size)) {
+        prof_malloc(ptr, size);
     }
-    int index = findindex(get_size(extendheap));
-    segregatehead[index] = extendheap;
-    extendheap->pointer = NULL;
-    (*(&extendheap->pointer + 1)) = NULL;
-    write_pre_alloc(extendheap, true);
-    last_block_prealloc = false;
     return true;
 }
 
 /**
- * @brief
+ * @brief Returns how many bytes the allocation at ptr can actually hold.
  *
- * <What does this function do?>
- * It allocates a space with size.
- * <What are the function's arguments?>
- * It inputs the allocated size.
- * <What is the function's return value?>
- * It will return the payload address for the allocated space.
- * <Are there any preconditions or postconditions?>
- * It must work after the initialization of the heap.
+ * This is the payload of the block (all of it but the header), or the
+ * whole slot for a slab slot, and is at least what was asked for.
  *
- * @param[in] size
- * @return
+ * @param[in] ptr A payload returned by malloc, or NULL
+ * @return The usable size in bytes, or 0 for NULL
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
-    }
-
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
     }
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+#ifdef MM_SLAB
+    slab_t *slab = slab_lookup(ptr);
+    if (slab != NULL) {
+        return slab->slot_size;
     }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-
-    write_size_alloc(block, block_size, true);
-    disconnect(block);
-    // Try to split the block if too large
-    split_block(block, asize);
-
-    bp = header_to_payload(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+#endif
+    return get_payload_size(payload_to_header(ptr));
 }
 
 /**
- * @brief
+ * @brief Returns the usable size malloc would give a request of size bytes.
  *
- * <What does this function do?>
- * It frees a allocated space.
- * <What are the function's arguments?>
- * It inputs the payload address.
- * <What is the function's return value?>
- * It will return void.
- * <Are there any preconditions or postconditions?>
- * bp should not bu NULL. After freeing, we should coalesce the possible free
- blocks. payload_to_header
- * @param[in] bp
+ * Block sizes are rounded up the way malloc does it: to a slab slot for
+ * small requests, to a dsize multiple that holds the header for blocks in
+ * the heap, and to whole pages for mapped blocks. split_block never leaves
+ * a block larger than asize, so the answer is exact, except that a small
+ * request gets a heap block instead when no slab run can be carved out of
+ * the free blocks (slab_create never grows the heap).
+ *
+ * @param[in] size A request size
+ * @return The payload size malloc(size) would provide, or 0 for 0
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    if (bp == NULL) {
-        return;
+size_t mm_good_size(size_t size) {
+    if (size == 0) {
+        return 0;
     }
-
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    write_size_alloc(block, size, false);
-    block->pointer = NULL;
-    if (size >= min_block_size) {
-        (*(&block->pointer + 1)) = NULL;
+#ifdef MM_SLAB
+    if (size <= SLAB_CLASSES * dsize) {
+        return round_up(size, dsize);
     }
-    block_t *block_next = find_next(block);
-    write_pre_alloc(block_next, false);
-    if (is_epilogue_header(block_next)) {
-        last_block_prealloc = false;
+#endif
+    size_t asize = round_up(size + tsize, dsize);
+    if (asize < size) {
+        return size; // size + tsize overflowed; malloc will fail
     }
+    if (asize >= map_threshold) {
+        asize = round_up(asize + dsize, mem_pagesize()) - dsize;
+    }
+    return asize - tsize;
+}
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
+#ifndef DRIVER
+// The names libc (malloc_usable_size) and other systems (malloc_good_size)
+// know these by.
 
-    dbg_ensures(mm_checkheap(__LINE__));
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
+
+size_t malloc_good_size(size_t size) {
+    return mm_good_size(size);
 }
+#endif
 
 /**
  * @brief
@@ -1354,30 +5171,43 @@ void free(void *bp) {
  * It will return void.
  * <Are there any preconditions or postconditions?>
  * It returns NULL for invalid size and becomes malloc if payload address is
- * NULL.
+ * NULL. The block is resized in place when it can be, and only moved, with
+ * a copy, when its neighbours are in the way.
  *
  * @param[in] ptr
  * @param[in] size
  * @return
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
     size_t copysize;
     void *newptr;
 
+    trace_event(MM_TRACE_REALLOC, ptr, size, 0);
+
     // If size == 0, then free block and return NULL
     if (size == 0) {
-        free(ptr);
+        if (ptr != NULL) {
+            free_untraced(ptr);
+        }
         return NULL;
     }
 
     // If ptr is NULL, then equivalent to malloc
     if (ptr == NULL) {
-        return malloc(size);
+        return malloc_untraced(size);
+    }
+
+    // Try to resize in place first
+    if (resize_in_place(ptr, size, true)) {
+        prof_free(ptr);
+        if (prof_due(size)) {
+            prof_malloc(ptr, size);
+        }
+        return ptr;
     }
 
     // Otherwise, proceed with reallocation
-    newptr = malloc(size);
+    newptr = malloc_untraced(size);
 
     // If malloc fails, the original block is left untouched
     if (newptr == NULL) {
@@ -1385,14 +5215,14 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    copysize = mm_usable_size(ptr); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
     memcpy(newptr, ptr, copysize);
 
     // Free the old block
-    free(ptr);
+    free_untraced(ptr);
 
     return newptr;
 }
@@ -1426,17 +5256,262 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    bp = malloc(asize);
+    size_t dirty;
+    trace_event(MM_TRACE_MALLOC, NULL, asize, 0);
+    bp = allocate(asize, &dirty);
     if (bp == NULL) {
         return NULL;
     }
+    if (prof_due(asize)) {
+        prof_malloc(bp, asize);
+    }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, skipping memory known to be zero
+    memset(bp, 0, min(dirty, asize));
 
     return bp;
 }
 
+/**
+ * @brief Allocates size bytes with the payload aligned to align.
+ *
+ * Alignments up to dsize are what malloc gives anyway. Larger ones skip the
+ * slab runs and the thread cache, and carve the block out of a fit large
+ * enough to hold it at any offset; see malloc_aligned_block. Huge blocks
+ * get a mapping placed so that the payload is aligned.
+ *
+ * @param[in] align The alignment, a power of two
+ * @param[in] size The payload size wanted
+ * @return The payload, or NULL if align is not a power of two, size is 0
+ *         or there is no memory
+ */
+void *mm_memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc(size);
+    }
+    trace_event(MM_TRACE_MALLOC, NULL, size, align);
+    if (size == 0 || !heap_ready()) {
+        return NULL;
+    }
+    size_t asize = round_up(size + tsize, dsize);
+    if (asize < size || asize + align + min_block_size < asize) {
+        return NULL; // Overflowed
+    }
+
+    block_t *block;
+    if (asize >= map_threshold && (block = map_block(asize, align)) != NULL) {
+        shm_count(get_payload_size(block), false);
+        if (prof_due(size)) {
+            prof_malloc(header_to_payload(block), size);
+        }
+        return header_to_payload(block);
+    }
+#ifdef MM_THREADS
+    arena_t *home = thread_arena();
+    pthread_mutex_lock(&home->lock);
+    arena = home;
+    block = malloc_aligned_block(asize, align);
+    pthread_mutex_unlock(&home->lock);
+#else
+    block = malloc_aligned_block(asize, align);
+#endif
+    if (block == NULL) {
+        return NULL;
+    }
+    shm_count(get_payload_size(block), false);
+    if (prof_due(size)) {
+        prof_malloc(header_to_payload(block), size);
+    }
+    return header_to_payload(block);
+}
+
+#ifndef DRIVER
+// The aligned allocation functions of libc, so that programs run with
+// LD_PRELOAD never hand their blocks to another allocator.
+
+void *memalign(size_t align, size_t size) {
+    return mm_memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    void *bp = mm_memalign(align, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    return mm_memalign(align, size);
+}
+
+void *valloc(size_t size) {
+    return mm_memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+    return mm_memalign(mem_pagesize(), round_up(size, mem_pagesize()));
+}
+#endif
+
+/**
+ * @brief Allocates n blocks of size bytes each.
+ *
+ * Blocks are carved back to back out of as few free blocks as possible, so
+ * each fit is searched for and split only once, instead of once per block.
+ * Small sizes take every free slot of one slab run after another instead,
+ * and blocks too large for the heap are mapped one at a time as by malloc.
+ *
+ * @param[in] size The payload size of every block
+ * @param[in] n The number of blocks wanted
+ * @param[out] out Receives the payloads
+ * @return How many payloads were stored in out, fewer than n only if the
+ *         heap ran out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0 || n == 0 || !heap_ready()) {
+        return 0;
+    }
+    size_t asize = round_up(size + tsize, dsize);
+    if (asize < size) {
+        return 0; // size + tsize overflowed
+    }
+
+    size_t done = 0;
+    if (asize >= map_threshold) {
+        for (; done < n; done++) {
+            if ((out[done] = malloc(size)) == NULL) {
+                break;
+            }
+        }
+        return done;
+    }
+
+#ifdef MM_SLAB
+    if (size <= SLAB_CLASSES * dsize) {
+        done = slab_malloc_batch(size, n, out);
+    }
+#endif
+
+#ifdef MM_THREADS
+    arena_t *home = thread_arena();
+    pthread_mutex_lock(&home->lock);
+    arena = home;
+    done += malloc_blocks(asize, n - done, out + done);
+    pthread_mutex_unlock(&home->lock);
+#else
+    if (done < n) {
+        done += malloc_blocks(asize, n - done, out + done);
+    }
+#endif
+#ifdef MM_SHM_STATS
+    for (size_t i = 0; i < done; i++) {
+        shm_count(mm_usable_size(out[i]), false);
+    }
+#endif
+#ifdef MM_PROFILE
+    for (size_t i = 0; i < done; i++) {
+        if (prof_due(size)) {
+            prof_malloc(out[i], size);
+        }
+    }
+#endif
+    return done;
+}
+
+// Orders payload pointers by address, for mm_free_batch.
+static int compare_address(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Frees every pointer in ptrs.
+ *
+ * Slab slots and mapped blocks are freed as they are met. The remaining
+ * blocks are gathered at the front of ptrs and sorted by address, and each
+ * run of blocks that lie back to back in the heap is freed as one block, so
+ * it is coalesced and linked once. With MM_THREADS the blocks go straight
+ * to the arenas that own them, bypassing the thread cache.
+ *
+ * @param[in,out] ptrs Payloads returned by malloc, or NULL; reordered
+ * @param[in] n The number of pointers in ptrs
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    size_t blocks = 0;
+    bool sorted = true;
+#ifdef MM_SLAB
+    slab_t *slab = NULL;
+#endif
+    for (size_t i = 0; i < n; i++) {
+        void *bp = ptrs[i];
+        if (bp == NULL) {
+            continue;
+        }
+        prof_free(bp);
+#ifdef MM_SLAB
+        // Slots of the run last seen need no lookup
+        if (slab == NULL || (char *)bp < slab_slots(slab) ||
+            (char *)bp >= (char *)slab + SLAB_RUN_SIZE) {
+            slab = slab_lookup(bp);
+        }
+        if (slab != NULL) {
+            shm_count(slab->slot_size, true);
+            slab_free(slab, bp);
+            continue;
+        }
+#endif
+        block_t *block = payload_to_header(bp);
+        dbg_assert(get_alloc(block));
+        shm_count(get_payload_size(block), true);
+        if (is_mapped(block)) {
+            unmap_block(block);
+            continue;
+        }
+        if (blocks > 0 && (uintptr_t)ptrs[blocks - 1] > (uintptr_t)bp) {
+            sorted = false;
+        }
+        ptrs[blocks++] = bp;
+    }
+    // Batches from mm_malloc_batch mostly come in address order already
+    if (!sorted) {
+        qsort(ptrs, blocks, sizeof(*ptrs), compare_address);
+    }
+
+    size_t i = 0;
+    while (i < blocks) {
+        // Count the blocks that follow this one directly
+        block_t *block = payload_to_header(ptrs[i]);
+        block_t *last = block;
+        size_t count = 1;
+        while (i + count < blocks &&
+               ptrs[i + count] == header_to_payload(find_next(last))) {
+            last = find_next(last);
+            count++;
+        }
+
+#ifdef MM_THREADS
+        arena_t *owner = extent_owner(block);
+        pthread_mutex_lock(&owner->lock);
+        arena = owner;
+        free_run(block, count);
+        pthread_mutex_unlock(&owner->lock);
+#else
+        free_run(block, count);
+#endif
+        i += count;
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
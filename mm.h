@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef DRIVER
 
@@ -56,8 +57,248 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes aligned to `align`, like mm_memalign.
+ */
+extern void *memalign(size_t align, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes aligned to `align` and store them in `memptr`.
+ *
+ * @return  0 on success, EINVAL if `align` is not a power of two multiple
+ *          of sizeof(void *), ENOMEM if out of memory.
+ */
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes aligned to `align`, like mm_memalign.
+ */
+extern void *aligned_alloc(size_t align, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes aligned to the page size.
+ */
+extern void *valloc(size_t size);
+
+/**
+ * @brief  Allocate `size` bytes rounded up to whole pages, page-aligned.
+ */
+extern void *pvalloc(size_t size);
+
+/**
+ * @brief  Return the usable size of an allocation, like mm_usable_size.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  Return the usable size a request would get, like mm_good_size.
+ */
+extern size_t malloc_good_size(size_t size);
 #endif
 
+/**
+ * @brief  Allocate memory whose address is a multiple of `align`.
+ *
+ * @param[in] align  The alignment, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          `align` is not a power of two or there is no memory.
+ */
+extern void *mm_memalign(size_t align, size_t size);
+
+/**
+ * @brief  Find how many bytes an allocated block can actually hold.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The number of usable bytes, at least the size requested, or 0
+ *          if `ptr` is NULL.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief  Find how many usable bytes a request for `size` bytes would get.
+ *
+ * @param[in] size  The size of a request.
+ *
+ * @return  The usable size of the block malloc(size) would return.
+ */
+extern size_t mm_good_size(size_t size);
+
+/**
+ * @brief  Grow an allocated block in place, without moving it.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The new minimum size of the payload.
+ *
+ * @return  True if the payload now holds `size` bytes, False if it could
+ *          only grow by moving, in which case it is left unchanged.
+ */
+extern bool mm_expand(void *ptr, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of `size` bytes each in one call.
+ *
+ * @param[in] size  The minimum size of bytes of every block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] out  An array of `n` pointers that receives the blocks.
+ *
+ * @return  The number of blocks stored in `out`, less than `n` only when
+ *          the heap is out of memory.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Free `n` allocated blocks in one call.
+ *
+ * @param[in,out] ptrs  The payloads to free; NULL entries are skipped. The
+ *                      array is reordered.
+ * @param[in] n  The number of pointers in `ptrs`.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Counters of the quick lists, which keep small freed blocks
+ *         uncoalesced for the next malloc of the same size.
+ */
+struct mm_quick_stats {
+    size_t hits;    /* Mallocs served from a quick list, each saving a
+                       coalesce and a split */
+    size_t cached;  /* Blocks on the quick lists now */
+    size_t flushes; /* Consolidations of all quick lists */
+    size_t flushed; /* Blocks coalesced by the consolidations */
+};
+
+/**
+ * @brief  Read the quick list counters, which start from zero at mm_init.
+ *
+ * @param[out] stats  Receives the counters.
+ */
+extern void mm_quick_stats(struct mm_quick_stats *stats);
+
+/** @brief Room for the seglists of any build in struct mm_stats */
+#define MM_STATS_LISTS 256
+
+/**
+ * @brief  Counters of the free block search, splitting, coalescing and heap
+ *         growth, kept only when mm.c is built with -DMM_STATS.
+ */
+struct mm_stats {
+    size_t fit_searches;   /* find_fit calls */
+    size_t fit_probes;     /* Free blocks those calls looked at */
+    size_t fit_max_probes; /* Most free blocks a single call looked at */
+    size_t fit_misses;     /* Calls that found no block that fits */
+    size_t splits;         /* Free blocks split to fit a request */
+    size_t coalesce_none;  /* Coalesces with no free neighbour */
+    size_t coalesce_prev;  /* Coalesces with the previous block only */
+    size_t coalesce_next;  /* Coalesces with the next block only */
+    size_t coalesce_both;  /* Coalesces with both neighbours */
+    size_t extends;        /* Times the heap was grown */
+    size_t extend_bytes;   /* Bytes the heap was grown by */
+    size_t trims;          /* Times the heap was shrunk */
+    size_t lists;          /* Seglists in use, at most MM_STATS_LISTS */
+    size_t list_blocks[MM_STATS_LISTS]; /* Blocks on each seglist now */
+    size_t list_peak[MM_STATS_LISTS];   /* Most blocks each ever held */
+    size_t tree_blocks;    /* Blocks in the large-block tree now */
+    size_t tree_peak;      /* Most blocks the tree ever held */
+};
+
+/**
+ * @brief  Read the allocator counters, which start from zero at mm_init.
+ *
+ * @param[out] stats  Receives the counters, all zero without MM_STATS.
+ *
+ * @return  True if mm.c was built with -DMM_STATS, False otherwise.
+ */
+extern bool mm_stats(struct mm_stats *stats);
+
+/**
+ * @brief  Kinds of event recorded when mm.c is built with -DMM_TRACE. `addr`
+ *         and the two sizes of an event mean, by kind:
+ */
+enum mm_trace_type {
+    MM_TRACE_MALLOC = 1,    /* Entry: size requested, align (0 if none) */
+    MM_TRACE_FREE,          /* Entry: addr is the payload */
+    MM_TRACE_REALLOC,       /* Entry: the old payload, size requested */
+    MM_TRACE_FIT,           /* find_fit: block found (0 if none), size wanted */
+    MM_TRACE_SPLIT,         /* split_block: block, size kept, size split off */
+    MM_TRACE_COALESCE_NONE, /* Free block, its size, size freed */
+    MM_TRACE_COALESCE_PREV, /* Merged block, its size, size freed */
+    MM_TRACE_COALESCE_NEXT, /* Merged block, its size, size freed */
+    MM_TRACE_COALESCE_BOTH, /* Merged block, its size, size freed */
+    MM_TRACE_EXTEND,        /* extend_heap: new memory, bytes added */
+    MM_TRACE_TRIM,          /* Heap shrunk: new end of heap, bytes given back */
+    MM_TRACE_TYPES
+};
+
+/** @brief One recorded event, 24 bytes */
+struct mm_trace_event {
+    uint64_t stamp; /* Kind in the top 8 bits, clock ticks in the rest */
+    uint64_t addr;  /* Block or payload address */
+    uint32_t size;  /* First size, at most UINT32_MAX */
+    uint32_t arg;   /* Second size, at most UINT32_MAX */
+};
+
+/** @brief Identifies a dump of the event rings */
+#define MM_TRACE_MAGIC "MMTRACE1"
+
+/**
+ * @brief  Start of a dump. To convert ticks to nanoseconds, the clock was
+ *         read along with CLOCK_MONOTONIC when tracing started and again
+ *         when the dump was taken. For every thread that recorded events,
+ *         the header is followed by its thread id and event count, both
+ *         uint64_t, and that many struct mm_trace_event, oldest first.
+ */
+struct mm_trace_header {
+    char magic[8];   /* MM_TRACE_MAGIC, without the terminating NUL */
+    uint64_t ticks0; /* Clock ticks when tracing started */
+    uint64_t ns0;    /* CLOCK_MONOTONIC nanoseconds at the same time */
+    uint64_t ticks1; /* Clock ticks when the dump was taken */
+    uint64_t ns1;    /* CLOCK_MONOTONIC nanoseconds at the same time */
+    uint64_t rings;  /* Threads whose events follow */
+};
+
+/**
+ * @brief  Write the events in every thread's ring buffer to a file. Each
+ *         ring keeps the latest events of its thread; mm_init empties them.
+ *
+ * @param[in] path  The file to create or overwrite.
+ *
+ * @return  True if the file was written, False on error or if mm.c was not
+ *          built with -DMM_TRACE.
+ */
+extern bool mm_trace_dump(const char *path);
+
+/**
+ * @brief  Write the heap profile of mm.c built with -DMM_PROFILE: the call
+ *         sites of sampled allocations, ranked by the bytes they have live,
+ *         with the bytes they had live at the heap's peak. It is also
+ *         dumped at exit, and on SIGUSR2 or MM_PROFILE_SIGNAL.
+ *
+ * @param[in] path  The file to create or overwrite.
+ *
+ * @return  True if the file was written, False on error or if mm.c was not
+ *          built with -DMM_PROFILE.
+ */
+extern bool mm_profile_dump(const char *path);
+
+/**
+ * @brief  Return the compiler and flags mm.c was built with, as the
+ *         Makefile passes them in, or "unknown".
+ */
+extern const char *mm_build_cflags(void);
+
+/**
+ * @brief  Give free memory at the end of the heap back to the system.
+ *
+ * @param[in] pad  The number of free bytes to keep at the end of the heap.
+ *
+ * @return  True if the heap was shrunk, False otherwise.
+ */
+extern bool mm_trim(size_t pad);
+
 /**
  * @brief  Initialize the heap.
  *
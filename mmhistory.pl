@@ -0,0 +1,155 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use JSON::PP;
+
+##############################################################################
+#
+# Reports the trend of every trace over the runs that "mdriver --json FILE"
+# appended to FILE, one JSON line each. The runs are the columns, oldest
+# first, with a table of when, on which commit and on which CPU each was
+# taken; the traces are the rows, ending with the change from the first run
+# shown to the last. Runs of different drivers (builds of mm.c) or CPUs
+# are not comparable, so pick them with -d and -c.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-m METRIC] [-n RUNS] [-d DRIVER] " .
+        "[-c CPU] [-t TRACE] FILE\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h         Print this message\n";
+    printf STDERR "  -m METRIC  tput (default), util, secs, heap_peak, " .
+        "heap_final or heap_avg\n";
+    printf STDERR "  -n RUNS    Show the last RUNS runs (default 8)\n";
+    printf STDERR "  -d DRIVER  Only runs of this driver, e.g. mdriver-tlsf\n";
+    printf STDERR "  -c CPU     Only runs on CPUs whose type contains CPU\n";
+    printf STDERR "  -t TRACE   Only traces whose names contain TRACE\n";
+    die "\n";
+}
+
+# How to print every metric, and whether a higher value is better
+%metrics = (
+    "tput"       => ["Throughput in Kops/s",  "%.0f", 1],
+    "util"       => ["Utilization in %",      "%.1f", 1],
+    "secs"       => ["Time in msecs",         "%.3f", 0],
+    "heap_peak"  => ["Peak heap in KB",       "%.0f", 0],
+    "heap_final" => ["Final heap in KB",      "%.0f", 0],
+    "heap_avg"   => ["Average heap in KB",    "%.0f", 0]);
+
+getopts('hm:n:d:c:t:');
+
+if ($opt_h || @ARGV != 1) {
+    usage($0);
+}
+$metric = defined($opt_m) ? $opt_m : "tput";
+usage("Unknown metric $metric") if (!defined($metrics{$metric}));
+($unit, $format, $higher) = @{$metrics{$metric}};
+$limit = defined($opt_n) ? $opt_n : 8;
+
+# The value of the metric in a trace or run record, in the unit printed
+sub value
+{
+    my ($record) = @_;
+    my $v = $$record{$metric};
+    return undef if (!defined($v));
+    return $v * 100 if ($metric eq "util");
+    return $v * 1000 if ($metric eq "secs");
+    return $v / 1024 if ($metric =~ /^heap/);
+    return $v;
+}
+
+$infile = $ARGV[0];
+open(IN, "<", $infile) or die "Couldn't open $infile: $!\n";
+@runs = ();
+while (<IN>) {
+    next if (/^\s*$/);
+    my $run = eval { decode_json($_) };
+    if (!defined($run)) {
+        warn "$infile:$.: skipping a line that is not JSON\n";
+        next;
+    }
+    next if (defined($opt_d) && $$run{driver} ne $opt_d);
+    next if (defined($opt_c) && index($$run{cpu}, $opt_c) < 0);
+    push(@runs, $run);
+}
+close(IN);
+die "No runs in $infile match\n" if (@runs == 0);
+splice(@runs, 0, @runs - $limit) if (@runs > $limit);
+
+# The traces in the order the runs first list them
+@traces = ();
+%seen = ();
+foreach $run (@runs) {
+    foreach $t (@{$$run{traces}}) {
+        my $name = $$t{trace};
+        $name =~ s|.*/||;
+        next if (defined($opt_t) && index($name, $opt_t) < 0);
+        push(@traces, $name) if (!$seen{$name}++);
+    }
+}
+
+printf "%s, over %d run%s in %s:\n\n", $unit, scalar(@runs),
+    @runs == 1 ? "" : "s", $infile;
+printf "%4s  %-20s  %-16s  %-14s  %s\n", "run", "time", "commit", "driver",
+    "cpu";
+for ($r = 0; $r < @runs; $r++) {
+    my $run = $runs[$r];
+    printf "%4d  %-20s  %-16s  %-14s  %s\n", $r + 1, $$run{time},
+        $$run{commit}, $$run{driver}, $$run{cpu};
+}
+
+$width = 24;
+foreach $name (@traces) {
+    $width = length($name) + 2 if (length($name) + 2 > $width);
+}
+printf "\n%-${width}s", "trace";
+printf "%10d", $_ + 1 foreach (0 .. $#runs);
+printf "%9s\n", "change";
+
+# One row: the values, "--" where a run lacks the trace or it failed, and
+# the change from the first value to the last, marked ! if it is for the
+# worse by more than 5%
+sub row
+{
+    my ($label, @values) = @_;
+    my ($first, $last);
+    printf "%-${width}s", $label;
+    foreach $v (@values) {
+        if (!defined($v)) {
+            printf "%10s", "--";
+            next;
+        }
+        printf "%10s", sprintf($format, $v);
+        $first = $v if (!defined($first));
+        $last = $v;
+    }
+    if (defined($first) && $first != 0 && @values > 1) {
+        my $change = ($last - $first) / $first * 100;
+        my $worse = $higher ? $change < -5 : $change > 5;
+        printf "%+8.1f%%%s", $change, $worse ? " !" : "";
+    }
+    print "\n";
+}
+
+foreach $name (@traces) {
+    my @values;
+    foreach $run (@runs) {
+        my $v;
+        foreach $t (@{$$run{traces}}) {
+            my $tname = $$t{trace};
+            $tname =~ s|.*/||;
+            next if ($tname ne $name);
+            $v = value($t) if ($$t{valid});
+            last;
+        }
+        push(@values, $v);
+    }
+    row($name, @values);
+}
+
+# The averages the driver scores (throughput is the harmonic mean)
+if (($metric eq "tput" || $metric eq "util") && !defined($opt_t)) {
+    row("average", map { value($_) } @runs);
+}
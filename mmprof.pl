@@ -0,0 +1,151 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# Prints a heap profile that mm.c built with -DMM_PROFILE dumps (mm-prof.so
+# at exit or on SIGUSR2) with its call stacks turned into functions and
+# source lines. Sites are ranked by the bytes they have live, or with -p by
+# the bytes they had live when the heap was at its peak. The return
+# addresses are looked up with addr2line in the files the memory map at the
+# end of the profile names, so the program and its libraries must still be
+# where they were, and need debug information for line numbers.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hp] [-n SITES] PROFILE\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h        Print this message\n";
+    printf STDERR "  -p        Rank the sites by bytes live at the peak\n";
+    printf STDERR "  -n SITES  Print only the first SITES sites (default 20)\n";
+    die "\n";
+}
+
+getopts('hpn:');
+
+if ($opt_h || @ARGV != 1) {
+    usage($0);
+}
+$limit = defined($opt_n) ? $opt_n : 20;
+
+$infile = $ARGV[0];
+open(IN, "<", $infile) or die "Couldn't open $infile: $!\n";
+
+# Summary lines, then the sites, then the memory map
+@summary = ();
+@sites = ();
+@maps = ();
+$section = 0;
+while (<IN>) {
+    chomp;
+    if ($_ eq "MAPPED_LIBRARIES:") {
+        $section = 2;
+    } elsif ($section == 2) {
+        # start-end perms offset dev inode path
+        my @f = split(' ', $_, 6);
+        next if (@f != 6 || $f[5] !~ m|^/|);
+        my ($start, $end) = split(/-/, $f[0]);
+        push(@maps, [hex($start), hex($end), hex($f[2]), $f[5]]);
+    } elsif (/^\s+(\d+)\s+(\d+)\s+(\d+)\s+(\d+)\s+(\d+)\s+(\d+)\s+@ (.*)/) {
+        push(@sites, [$1, $2, $3, $4, $5, $6, [split(' ', $7)]]);
+        $section = 1;
+    } elsif ($section == 0 && $_ ne "" && !/^\s+live bytes/) {
+        push(@summary, $_);
+    }
+}
+close(IN);
+die "$infile is not an mm heap profile\n"
+    if (@summary == 0 || $summary[0] !~ /^mm heap profile/);
+
+# Where each file is loaded: the start of its mapping at file offset 0,
+# which is 0 for executables that are not position independent
+%base = ();
+foreach $m (@maps) {
+    my ($start, $end, $offset, $path) = @$m;
+    if (!defined($base{$path}) || $start - $offset < $base{$path}) {
+        $base{$path} = $start - $offset;
+    }
+}
+foreach $path (keys %base) {
+    my $type = 0;
+    if (open(ELF, "<", $path)) {
+        binmode(ELF);
+        my $head;
+        if (read(ELF, $head, 18) == 18 && substr($head, 0, 4) eq "\x7fELF") {
+            $type = unpack("v", substr($head, 16, 2)); # e_type, 2 is ET_EXEC
+        }
+        close(ELF);
+    }
+    $base{$path} = 0 if ($type == 2);
+}
+
+# Returns the file a return address is in and its address in that file,
+# pointing into the call rather than after it
+sub locate
+{
+    my ($addr) = @_;
+    foreach $m (@maps) {
+        my ($start, $end, $offset, $path) = @$m;
+        return ($path, $addr - 1 - $base{$path})
+            if ($addr >= $start && $addr < $end);
+    }
+    return (undef, undef);
+}
+
+# Every frame of the sites printed, looked up with one addr2line per file
+@sites = sort { $$b[0] <=> $$a[0] || $$b[2] <=> $$a[2] } @sites;
+@sites = sort { $$b[2] <=> $$a[2] || $$b[0] <=> $$a[0] } @sites if ($opt_p);
+splice(@sites, $limit) if (@sites > $limit);
+
+%wanted = ();
+foreach $s (@sites) {
+    foreach $frame (@{$$s[6]}) {
+        my ($path, $offset) = locate(hex($frame));
+        $wanted{$path}{$offset} = 1 if (defined($path));
+    }
+}
+%symbol = ();
+foreach $path (keys %wanted) {
+    my @offsets = keys %{$wanted{$path}};
+    my $list = join(" ", map { sprintf("0x%x", $_) } @offsets);
+    my @lines = `addr2line -f -C -e '$path' $list 2>/dev/null`;
+    next if ($? != 0 || @lines != 2 * @offsets);
+
+    # A function name and a file:line for every address, in order
+    for (my $i = 0; $i < @offsets; $i++) {
+        my ($func, $line) = ($lines[2 * $i], $lines[2 * $i + 1]);
+        chomp($func);
+        chomp($line);
+        $line =~ s/ \(discriminator \d+\)//;
+        $symbol{$path}{$offsets[$i]} = "$func $line";
+    }
+}
+
+sub describe
+{
+    my ($frame) = @_;
+    my ($path, $offset) = locate(hex($frame));
+    return $frame if (!defined($path));
+    my $name = $symbol{$path}{$offset};
+    if (!defined($name) || $name =~ /^\?\? /) {
+        $path =~ s|.*/||;
+        return sprintf("%s+0x%x", $path, $offset + 1);
+    }
+    $name =~ s/ \?\?:[0?]$//;
+    return $name;
+}
+
+print "$_\n" foreach (@summary);
+printf "\nRanked by bytes %s:\n", $opt_p ? "live at the peak" : "live now";
+foreach $s (@sites) {
+    my ($live, $live_objs, $peak, $peak_objs, $total, $total_objs, $frames) =
+        @$s;
+    printf "\n%.1f MiB live in %d allocations, %.1f MiB in %d at the peak, " .
+           "%.1f MiB in %d in all\n",
+        $live / 1048576, $live_objs, $peak / 1048576, $peak_objs,
+        $total / 1048576, $total_objs;
+    print "    ", describe($_), "\n" foreach (@$frames);
+}
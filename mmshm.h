@@ -0,0 +1,55 @@
+/**
+ * @file mmshm.h
+ * @brief Layout of the statistics page that mm.so publishes under /dev/shm
+ *
+ * mm.c built with -DMM_SHM_STATS creates /dev/shm/mm.<pid> when the heap is
+ * first initialized, maps it shared, and keeps it up to date while the
+ * program runs; the file is removed when the program exits. mmtop attaches
+ * to it read-only.
+ *
+ * Every counter is written with relaxed atomics. The counters that change
+ * on every malloc and free are kept per arena, so that threads on different
+ * arenas never write the same cache line, and a reader adds the slots up.
+ * A reader therefore sees each counter on its own exactly, but not all of
+ * them at the same instant.
+ */
+
+#ifndef MMSHM_H
+#define MMSHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Identifies a page of this layout */
+#define MM_SHM_MAGIC 0x316d68736d6dULL /* "mmshm1" */
+
+/** @brief Directory and name prefix of the page; the pid follows */
+#define MM_SHM_PREFIX "/dev/shm/mm."
+
+/** @brief Number of per-arena slots, at least the arenas of mm.c */
+#define MM_SHM_SLOTS 16
+
+/** @brief Room for the free list classes of any build */
+#define MM_SHM_CLASSES 256
+
+/** @brief Counters of one arena, on cache lines of their own */
+struct mm_shm_slot {
+    _Atomic size_t mallocs;    /* Successful mallocs */
+    _Atomic size_t frees;      /* Frees of a non-NULL pointer */
+    _Atomic size_t live_bytes; /* Usable bytes allocated and not yet freed,
+                                  modulo 2^64; only the sum is meaningful */
+    _Atomic size_t free_bytes[MM_SHM_CLASSES]; /* Bytes on each free list */
+} __attribute__((aligned(64)));
+
+/** @brief The whole page */
+struct mm_shm_page {
+    uint64_t magic;   /* MM_SHM_MAGIC once the page is set up */
+    int64_t pid;      /* Process that publishes it */
+    uint64_t classes; /* Free list classes in use */
+    uint64_t class_min[MM_SHM_CLASSES]; /* Smallest block size of each */
+    _Atomic size_t heap_bytes;   /* Bytes obtained with mem_sbrk */
+    _Atomic size_t mapped_bytes; /* Bytes in mappings of huge blocks */
+    struct mm_shm_slot slot[MM_SHM_SLOTS];
+};
+
+#endif /* MMSHM_H */
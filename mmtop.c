@@ -0,0 +1,233 @@
+/*
+ * mmtop.c - Live view of the statistics page of a program running on mm.so
+ *
+ * mm.c built with -DMM_SHM_STATS (mm-shm.so) publishes its counters in
+ * /dev/shm/mm.<pid>. mmtop maps that page read-only and redraws the heap
+ * size, live and free bytes, malloc and free rates, and the free bytes of
+ * every non-empty free list class once per interval, until the program
+ * exits:
+ *
+ *     unix> LD_PRELOAD=./mm-shm.so ./mtbench -t 4 &
+ *     unix> ./mmtop $!
+ *
+ * Reading the page takes no lock and never stops the program.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmshm.h"
+
+/* Defaults, overridable on the command line */
+#define DEFAULT_INTERVAL 1.0
+
+/* One reading of the page, with the per-arena slots added up */
+typedef struct
+{
+    double time;       /* When it was taken, in seconds */
+    size_t heap_bytes;
+    size_t mapped_bytes;
+    size_t mallocs;
+    size_t frees;
+    size_t live_bytes;
+    size_t free_bytes; /* Over all classes */
+    size_t class_bytes[MM_SHM_CLASSES];
+} sample_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * attach - Map the statistics page at path read-only, and check that it
+ *     has been set up.
+ */
+static const struct mm_shm_page *attach(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct mm_shm_page))
+    {
+        fprintf(stderr, "%s is not an mm statistics page\n", path);
+        exit(1);
+    }
+    const struct mm_shm_page *page = mmap(NULL, sizeof(struct mm_shm_page),
+                                          PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        fprintf(stderr, "Couldn't map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (page->magic != MM_SHM_MAGIC || page->classes > MM_SHM_CLASSES)
+    {
+        fprintf(stderr, "%s is not an mm statistics page\n", path);
+        exit(1);
+    }
+    return page;
+}
+
+/*
+ * load - Read a counter the allocator may be updating. The page is mapped
+ *     read-only, so the atomic is only ever loaded.
+ */
+static size_t load(const _Atomic size_t *counter)
+{
+    return atomic_load_explicit((_Atomic size_t *)counter,
+                                memory_order_relaxed);
+}
+
+/* read_page - Take a sample, adding up the counters of every slot */
+static void read_page(const struct mm_shm_page *page, sample_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->time = now();
+    s->heap_bytes = load(&page->heap_bytes);
+    s->mapped_bytes = load(&page->mapped_bytes);
+    for (int i = 0; i < MM_SHM_SLOTS; i++)
+    {
+        const struct mm_shm_slot *slot = &page->slot[i];
+        s->mallocs += load(&slot->mallocs);
+        s->frees += load(&slot->frees);
+        s->live_bytes += load(&slot->live_bytes);
+        for (size_t c = 0; c < page->classes; c++)
+            s->class_bytes[c] += load(&slot->free_bytes[c]);
+    }
+    for (size_t c = 0; c < page->classes; c++)
+        s->free_bytes += s->class_bytes[c];
+}
+
+/* mib - Bytes in MiB */
+static double mib(size_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+/* show - Print one screen; rates are taken against the previous sample */
+static void show(const struct mm_shm_page *page, const sample_t *s,
+                 const sample_t *prev, bool batch)
+{
+    double secs = s->time - prev->time;
+    double malloc_rate = secs > 0 ? (s->mallocs - prev->mallocs) / secs : 0;
+    double free_rate = secs > 0 ? (s->frees - prev->frees) / secs : 0;
+
+    if (!batch)
+        printf("\033[H\033[2J");
+    printf("mmtop - pid %lld\n\n", (long long)page->pid);
+    printf("heap   %10.2f MiB   mapped %10.2f MiB\n", mib(s->heap_bytes),
+           mib(s->mapped_bytes));
+    printf("live   %10.2f MiB   free   %10.2f MiB  (%.1f%% of the heap)\n",
+           mib(s->live_bytes), mib(s->free_bytes),
+           s->heap_bytes ? 100.0 * s->free_bytes / s->heap_bytes : 0.0);
+    printf("malloc %10zu %8.0f/s   free %10zu %8.0f/s   in use %zu\n\n",
+           s->mallocs, malloc_rate, s->frees, free_rate,
+           s->mallocs - s->frees);
+    printf("%6s %12s %14s %7s\n", "class", "from bytes", "free bytes",
+           "share");
+    for (size_t c = 0; c < page->classes; c++)
+    {
+        if (s->class_bytes[c] == 0)
+            continue;
+        printf("%6zu %12llu %14zu %6.1f%%\n", c,
+               (unsigned long long)page->class_min[c], s->class_bytes[c],
+               100.0 * s->class_bytes[c] / s->free_bytes);
+    }
+    if (batch)
+        printf("\n");
+    fflush(stdout);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-b] [-d <secs>] [-n <count>] "
+                    "<pid | file>\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d <secs>   Seconds between updates (default %.0f).\n",
+            DEFAULT_INTERVAL);
+    fprintf(stderr, "\t-n <count>  Stop after count updates.\n");
+    fprintf(stderr, "\t-b          Print every update below the last, "
+                    "without clearing the screen.\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    double interval = DEFAULT_INTERVAL;
+    long count = -1;
+    bool batch = false;
+    char path[256];
+    int c;
+
+    while ((c = getopt(argc, argv, "hbd:n:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'b':
+            batch = true;
+            break;
+        case 'd':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || interval <= 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* A bare pid names the page of that process */
+    if (strchr(argv[optind], '/') == NULL)
+        snprintf(path, sizeof(path), "%s%s", MM_SHM_PREFIX, argv[optind]);
+    else
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+    const struct mm_shm_page *page = attach(path);
+
+    static sample_t prev, cur;
+    read_page(page, &prev);
+    while (count != 0)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)interval;
+        ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+
+        if (kill((pid_t)page->pid, 0) != 0 && errno == ESRCH)
+        {
+            printf("Process %lld has exited\n", (long long)page->pid);
+            break;
+        }
+        read_page(page, &cur);
+        show(page, &cur, &prev, batch);
+        prev = cur;
+        if (count > 0)
+            count--;
+    }
+    return 0;
+}
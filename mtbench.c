@@ -0,0 +1,186 @@
+/*
+ * mtbench.c - Multi-threaded malloc/free throughput benchmark
+ *
+ * Each thread keeps a private working set of slots and repeatedly picks a
+ * random slot, freeing it if it is occupied and filling it with a new block
+ * of random size otherwise.  The benchmark is run with 1, 2, 4, ... up to
+ * the requested number of threads, and reports the aggregate and per-thread
+ * operation rates for each thread count.
+ *
+ * The program calls the ordinary malloc and free, so the allocator under
+ * test is chosen at run time:
+ *
+ *     unix> ./mtbench                          (libc malloc)
+ *     unix> LD_PRELOAD=./mm-mt.so ./mtbench    (multi-arena mm.c)
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defaults, overridable on the command line */
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 1000000
+#define DEFAULT_SLOTS 1024
+#define DEFAULT_MAXSIZE 512
+
+/* Parameters for one worker thread */
+typedef struct
+{
+    pthread_t tid;
+    unsigned int seed; /* Private random number generator state */
+    long ops;          /* Number of malloc/free operations to perform */
+    int slots;         /* Size of the working set */
+    size_t maxsize;    /* Largest request size */
+} worker_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * worker - Perform a stream of mallocs and frees over a private working set,
+ *     touching the first byte of every block so the memory is really used.
+ */
+static void *worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    char **slot = calloc(w->slots, sizeof(char *));
+    long i;
+
+    if (slot == NULL)
+    {
+        fprintf(stderr, "calloc failed in worker\n");
+        exit(1);
+    }
+    for (i = 0; i < w->ops; i++)
+    {
+        int s = rand_r(&w->seed) % w->slots;
+        if (slot[s] != NULL)
+        {
+            free(slot[s]);
+            slot[s] = NULL;
+        }
+        else
+        {
+            size_t size = 1 + rand_r(&w->seed) % w->maxsize;
+            if ((slot[s] = malloc(size)) == NULL)
+            {
+                fprintf(stderr, "malloc(%zu) failed in worker\n", size);
+                exit(1);
+            }
+            slot[s][0] = (char)s;
+        }
+    }
+    for (i = 0; i < w->slots; i++)
+        free(slot[i]);
+    free(slot);
+    return NULL;
+}
+
+/*
+ * run - Time `nthreads` concurrent workers and return the elapsed seconds
+ */
+static double run(int nthreads, long ops, int slots, size_t maxsize)
+{
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    double start;
+    int i;
+
+    if (workers == NULL)
+    {
+        fprintf(stderr, "calloc failed in run\n");
+        exit(1);
+    }
+    start = now();
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].seed = 12345 + i;
+        workers[i].ops = ops;
+        workers[i].slots = slots;
+        workers[i].maxsize = maxsize;
+        if (pthread_create(&workers[i].tid, NULL, worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].tid, NULL);
+    double secs = now() - start;
+    free(workers);
+    return secs;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-t <n>] [-n <ops>] [-w <slots>] "
+                    "[-s <size>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t <n>      Largest thread count (default %d).\n",
+            DEFAULT_THREADS);
+    fprintf(stderr, "\t-n <ops>    Operations per thread (default %d).\n",
+            DEFAULT_OPS);
+    fprintf(stderr, "\t-w <slots>  Working set per thread (default %d).\n",
+            DEFAULT_SLOTS);
+    fprintf(stderr, "\t-s <size>   Largest request size (default %d).\n",
+            DEFAULT_MAXSIZE);
+    fprintf(stderr, "\t-h          Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int maxthreads = DEFAULT_THREADS;
+    long ops = DEFAULT_OPS;
+    int slots = DEFAULT_SLOTS;
+    size_t maxsize = DEFAULT_MAXSIZE;
+    int c;
+
+    while ((c = getopt(argc, argv, "ht:n:w:s:")) != EOF)
+    {
+        switch (c)
+        {
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'w':
+            slots = atoi(optarg);
+            break;
+        case 's':
+            maxsize = (size_t)atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (maxthreads < 1 || ops < 1 || slots < 1 || maxsize < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    printf("%8s %14s %14s %10s\n", "threads", "Kops/s", "Kops/s/thread",
+           "secs");
+    for (int n = 1; n <= maxthreads; n *= 2)
+    {
+        double secs = run(n, ops, slots, maxsize);
+        double kops = (double)ops * n / (secs * 1000.0);
+        printf("%8d %14.0f %14.0f %10.3f\n", n, kops, kops / n, secs);
+        if (n < maxthreads && n * 2 > maxthreads)
+            n = maxthreads / 2; /* Always finish with maxthreads */
+    }
+    return 0;
+}
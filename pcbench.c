@@ -0,0 +1,228 @@
+/*
+ * pcbench.c - Producer/consumer benchmark for cross-thread frees
+ *
+ * Each of the -p pairs runs a producer thread that mallocs messages and
+ * passes them through a single-producer single-consumer ring to a consumer
+ * thread, which frees them.  Every free is therefore a remote free, and
+ * every malloc may have to absorb blocks freed by the other side.
+ *
+ * The benchmark reports the message rate and the latency distribution of
+ * the individual malloc and free calls, so the cost of cross-thread frees
+ * shows up in the tail and not just in the average:
+ *
+ *     unix> ./pcbench                          (libc malloc)
+ *     unix> LD_PRELOAD=./mm-mt.so ./pcbench    (multi-arena mm.c)
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defaults, overridable on the command line */
+#define DEFAULT_PAIRS 4
+#define DEFAULT_MSGS 1000000
+#define DEFAULT_MAXSIZE 256
+
+/* Messages in flight per pair (power of two) */
+#define RING_SIZE 1024
+
+/* One producer/consumer pair and the ring between them */
+typedef struct
+{
+    pthread_t producer, consumer;
+    unsigned int seed;      /* Producer's random number generator state */
+    long msgs;              /* Number of messages to pass */
+    size_t maxsize;         /* Largest message size */
+    uint32_t *malloc_ns;    /* Latency of every malloc, in ns */
+    uint32_t *free_ns;      /* Latency of every free, in ns */
+    char *ring[RING_SIZE];
+    atomic_long head;       /* Next slot the producer fills */
+    atomic_long tail;       /* Next slot the consumer empties */
+} pair_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Clamp a latency to the 32 bits a sample holds */
+static uint32_t sample(uint64_t ns)
+{
+    return (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+}
+
+static void *producer(void *arg)
+{
+    pair_t *p = (pair_t *)arg;
+
+    for (long i = 0; i < p->msgs; i++)
+    {
+        size_t size = 1 + rand_r(&p->seed) % p->maxsize;
+        uint64_t start = now_ns();
+        char *msg = malloc(size);
+        p->malloc_ns[i] = sample(now_ns() - start);
+        if (msg == NULL)
+        {
+            fprintf(stderr, "malloc(%zu) failed in producer\n", size);
+            exit(1);
+        }
+        msg[0] = (char)i;
+
+        /* Wait for room in the ring */
+        while (i - atomic_load_explicit(&p->tail, memory_order_acquire) >=
+               RING_SIZE)
+            sched_yield();
+        p->ring[i & (RING_SIZE - 1)] = msg;
+        atomic_store_explicit(&p->head, i + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    pair_t *p = (pair_t *)arg;
+
+    for (long i = 0; i < p->msgs; i++)
+    {
+        /* Wait for a message */
+        while (atomic_load_explicit(&p->head, memory_order_acquire) <= i)
+            sched_yield();
+        char *msg = p->ring[i & (RING_SIZE - 1)];
+        atomic_store_explicit(&p->tail, i + 1, memory_order_release);
+
+        uint64_t start = now_ns();
+        free(msg);
+        p->free_ns[i] = sample(now_ns() - start);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * report - Print the latency distribution of n samples, sorting them in place
+ */
+static void report(const char *op, uint32_t *ns, size_t n)
+{
+    double sum = 0;
+
+    qsort(ns, n, sizeof(uint32_t), cmp_u32);
+    for (size_t i = 0; i < n; i++)
+        sum += ns[i];
+    printf("%-8s %10.1f %10u %10u %10u %10u\n", op, sum / n, ns[n / 2],
+           ns[(size_t)(n * 0.99)], ns[(size_t)(n * 0.999)], ns[n - 1]);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-p <pairs>] [-n <msgs>] [-s <size>]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-p <pairs>  Producer/consumer pairs (default %d).\n",
+            DEFAULT_PAIRS);
+    fprintf(stderr, "\t-n <msgs>   Messages per pair (default %d).\n",
+            DEFAULT_MSGS);
+    fprintf(stderr, "\t-s <size>   Largest message size (default %d).\n",
+            DEFAULT_MAXSIZE);
+    fprintf(stderr, "\t-h          Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int npairs = DEFAULT_PAIRS;
+    long msgs = DEFAULT_MSGS;
+    size_t maxsize = DEFAULT_MAXSIZE;
+    int c;
+
+    while ((c = getopt(argc, argv, "hp:n:s:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'p':
+            npairs = atoi(optarg);
+            break;
+        case 'n':
+            msgs = atol(optarg);
+            break;
+        case 's':
+            maxsize = (size_t)atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (npairs < 1 || msgs < 1 || maxsize < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* Everything the threads touch is allocated before timing starts */
+    size_t total = (size_t)npairs * msgs;
+    pair_t *pairs = calloc(npairs, sizeof(pair_t));
+    uint32_t *malloc_ns = malloc(total * sizeof(uint32_t));
+    uint32_t *free_ns = malloc(total * sizeof(uint32_t));
+    if (pairs == NULL || malloc_ns == NULL || free_ns == NULL)
+    {
+        fprintf(stderr, "Out of memory for %zu samples\n", total);
+        exit(1);
+    }
+
+    double start = now();
+    for (int i = 0; i < npairs; i++)
+    {
+        pair_t *p = &pairs[i];
+        p->seed = 12345 + i;
+        p->msgs = msgs;
+        p->maxsize = maxsize;
+        p->malloc_ns = malloc_ns + (size_t)i * msgs;
+        p->free_ns = free_ns + (size_t)i * msgs;
+        atomic_init(&p->head, 0);
+        atomic_init(&p->tail, 0);
+        if (pthread_create(&p->consumer, NULL, consumer, p) != 0 ||
+            pthread_create(&p->producer, NULL, producer, p) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < npairs; i++)
+    {
+        pthread_join(pairs[i].producer, NULL);
+        pthread_join(pairs[i].consumer, NULL);
+    }
+    double secs = now() - start;
+
+    printf("%d pairs, %ld messages each, %.3f secs, %.0f Kmsgs/s\n", npairs,
+           msgs, secs, total / (secs * 1000.0));
+    printf("%-8s %10s %10s %10s %10s %10s\n", "op", "mean(ns)", "p50",
+           "p99", "p99.9", "max");
+    report("malloc", malloc_ns, total);
+    report("free", free_ns, total);
+
+    free(malloc_ns);
+    free(free_ns);
+    free(pairs);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* perfctr.c
+ * Reads the performance counters of the calling thread around a piece of
+ * code with perf_event_open(2).  Each counter is opened on its own rather
+ * than in a group, so that one the processor lacks does not take the rest
+ * with it; the kernel time-shares the hardware between them if there are
+ * more counters than registers, and the counts are scaled back up.
+ */
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+const char *perfctr_names[PERFCTR_COUNT] = {
+    "cycles", "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss",
+    "cpu-ns", "faults", "ctx-sw"};
+
+/* The perf_event type and config of every counter */
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} events[PERFCTR_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+/* File descriptors of the open counters, -1 for the rest */
+static int fds[PERFCTR_COUNT] = {-1, -1, -1, -1, -1, -1, -1, -1, -1};
+
+/* The software counters from getrusage at perfctr_start, for when even
+   they are denied */
+static double rusage_start[PERFCTR_COUNT];
+
+static void rusage_read(double values[PERFCTR_COUNT])
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        memset(&usage, 0, sizeof(usage));
+    values[PERFCTR_TASK_CLOCK] =
+        (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+    values[PERFCTR_PAGE_FAULTS] = usage.ru_minflt + usage.ru_majflt;
+    values[PERFCTR_CONTEXT_SWITCHES] = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int perfctr_open(void)
+{
+    struct perf_event_attr attr;
+    int i, hardware = 0;
+
+    perfctr_close();
+    for (i = 0; i < PERFCTR_COUNT; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0 && events[i].type != PERF_TYPE_SOFTWARE)
+            hardware++;
+    }
+    return hardware;
+}
+
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_COUNT; i++)
+    {
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    rusage_read(rusage_start);
+}
+
+void perfctr_stop(double values[PERFCTR_COUNT])
+{
+    /* The count, then the time enabled and the time actually counting */
+    uint64_t data[3];
+    double rusage_now[PERFCTR_COUNT];
+    int i;
+
+    for (i = 0; i < PERFCTR_COUNT; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERFCTR_COUNT; i++)
+    {
+        values[i] = -1;
+        if (fds[i] < 0 ||
+            read(fds[i], data, sizeof(data)) != (ssize_t)sizeof(data))
+            continue;
+        /* A counter that never got the hardware is unknown, not zero */
+        if (data[2] != 0)
+            values[i] = (double)data[0] * ((double)data[1] / data[2]);
+    }
+    rusage_read(rusage_now);
+    for (i = PERFCTR_TASK_CLOCK; i < PERFCTR_COUNT; i++)
+        if (values[i] < 0)
+            values[i] = rusage_now[i] - rusage_start[i];
+}
+
+void perfctr_close(void)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_COUNT; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
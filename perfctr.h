@@ -0,0 +1,41 @@
+/* Perfctr reads the processor's performance counters, through Linux's
+   perf_event_open, around a piece of code in the calling thread.  Only
+   user-space events are counted, so an unprivileged user can read them
+   under the default perf_event_paranoid setting.  Where the kernel denies
+   a counter, or the processor (often a virtual machine's) has none, it is
+   left out, and the software counters fall back on getrusage.
+*/
+
+/* The counters, in the order perfctr_stop reports them */
+typedef enum
+{
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_L1D_MISSES,    /* L1 data cache read misses */
+    PERFCTR_LLC_MISSES,    /* Last level cache misses */
+    PERFCTR_DTLB_MISSES,   /* Data TLB read misses */
+    PERFCTR_BRANCH_MISSES, /* Mispredicted branches */
+    PERFCTR_TASK_CLOCK,    /* CPU time in ns; this and the rest are
+                              software counters, always available */
+    PERFCTR_PAGE_FAULTS,
+    PERFCTR_CONTEXT_SWITCHES,
+    PERFCTR_COUNT
+} perfctr_t;
+
+/* Short names of the counters, for column headers */
+extern const char *perfctr_names[PERFCTR_COUNT];
+
+/* Open the counters.  Returns the number of hardware counters the kernel
+   gave, 0 if only the software ones can be read. */
+int perfctr_open(void);
+
+/* Reset and start every counter that was opened */
+void perfctr_start(void);
+
+/* Stop the counters and store what they counted since perfctr_start in
+   values, scaled up if the kernel had to share the hardware between them,
+   or -1 for a counter that could not be opened or never ran. */
+void perfctr_stop(double values[PERFCTR_COUNT]);
+
+/* Close the counters */
+void perfctr_close(void);
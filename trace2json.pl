@@ -0,0 +1,144 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# Converts the allocator events that mm.c built with -DMM_TRACE dumps
+# (mm_trace_dump, mdriver -R, or MM_TRACE_FILE with mm-trace.so) into the
+# Chrome trace-event JSON format, which chrome://tracing and Perfetto open.
+# Every event becomes an instant event on the track of the thread that
+# recorded it, with its addresses and sizes as arguments, and the bytes the
+# heap has grown by since mm_init are drawn as a counter.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-o OUTFILE] DUMPFILE\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h          Print this message\n";
+    printf STDERR "  -o OUTFILE  Write the JSON to OUTFILE (default stdout)\n";
+    die "\n";
+}
+
+# Layout of struct mm_trace_header, the per-thread ring header and struct
+# mm_trace_event in mm.h
+$header_format = "a8 Q5";
+$header_size = 48;
+$ring_format = "Q2";
+$ring_size = 16;
+$event_format = "Q Q L L";
+$event_size = 24;
+$ticks_mask = (1 << 56) - 1;
+
+# Names of the events by enum mm_trace_type, and of their address and two
+# size fields (an empty name leaves the field out)
+@names = (undef,
+    ["malloc",         "",      "size",  "align"],
+    ["free",           "ptr",   "",      ""],
+    ["realloc",        "ptr",   "size",  ""],
+    ["find_fit",       "block", "asize", ""],
+    ["split",          "block", "asize", "remainder"],
+    ["coalesce_none",  "block", "size",  "freed"],
+    ["coalesce_prev",  "block", "size",  "freed"],
+    ["coalesce_next",  "block", "size",  "freed"],
+    ["coalesce_both",  "block", "size",  "freed"],
+    ["extend_heap",    "addr",  "bytes", ""],
+    ["trim",           "end",   "bytes", ""]);
+
+getopts('ho:');
+
+if ($opt_h || @ARGV != 1) {
+    usage($0);
+}
+
+$infile = $ARGV[0];
+open(IN, "<", $infile) or die "Couldn't open $infile: $!\n";
+binmode(IN);
+
+sub read_bytes
+{
+    my ($n) = @_;
+    my $buf;
+    my $got = read(IN, $buf, $n);
+    die "$infile is truncated\n" if (!defined($got) || $got != $n);
+    return $buf;
+}
+
+($magic, $ticks0, $ns0, $ticks1, $ns1, $rings) =
+    unpack($header_format, read_bytes($header_size));
+die "$infile is not an mm event dump\n" if ($magic ne "MMTRACE1");
+
+# Nanoseconds per clock tick, from the two readings in the header
+$ticks0 &= $ticks_mask;
+$ticks1 &= $ticks_mask;
+$scale = ($ticks1 > $ticks0 && $ns1 > $ns0) ?
+    ($ns1 - $ns0) / ($ticks1 - $ticks0) : 1.0;
+
+if ($opt_o) {
+    open(OUT, ">", $opt_o) or die "Couldn't create $opt_o: $!\n";
+} else {
+    open(OUT, ">&", STDOUT) or die "Couldn't write to stdout: $!\n";
+}
+
+print OUT "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+$first = 1;
+
+sub emit
+{
+    print OUT ($first ? "" : ",\n"), $_[0];
+    $first = 0;
+}
+
+$heap = 0;
+$events = 0;
+@growth = ();
+for ($r = 0; $r < $rings; $r++) {
+    my ($tid, $count) = unpack($ring_format, read_bytes($ring_size));
+    emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":$tid," .
+         "\"args\":{\"name\":\"thread $tid\"}}");
+    for (my $i = 0; $i < $count; $i++) {
+        my ($stamp, $addr, $size, $arg) =
+            unpack($event_format, read_bytes($event_size));
+        my $type = $stamp >> 56;
+        my $ticks = ($stamp & $ticks_mask) - $ticks0;
+        my $ts = sprintf("%.3f", $ticks * $scale / 1000);
+        my $name = $names[$type];
+        if (!defined($name)) {
+            warn "Skipping event of unknown type $type\n";
+            next;
+        }
+
+        my @args;
+        push(@args, sprintf("\"%s\":\"0x%x\"", $$name[1], $addr))
+            if ($$name[1] ne "");
+        push(@args, "\"$$name[2]\":$size") if ($$name[2] ne "");
+        push(@args, "\"$$name[3]\":$arg") if ($$name[3] ne "");
+        my $label = $$name[0];
+        $label .= " miss" if ($label eq "find_fit" && $addr == 0);
+        emit("{\"name\":\"$label\",\"cat\":\"mm\",\"ph\":\"i\",\"s\":\"t\"," .
+             "\"ts\":$ts,\"pid\":0,\"tid\":$tid," .
+             "\"args\":{" . join(",", @args) . "}}");
+        $events++;
+
+        # Every change of the heap size is an extension or a trim
+        if ($$name[0] eq "extend_heap") {
+            push(@growth, [$ts, $size]);
+        } elsif ($$name[0] eq "trim") {
+            push(@growth, [$ts, -$size]);
+        }
+    }
+}
+
+# The threads' extensions and trims, in time order, give the heap size
+foreach $g (sort { $$a[0] <=> $$b[0] } @growth) {
+    $heap += $$g[1];
+    emit("{\"name\":\"heap growth\",\"ph\":\"C\",\"ts\":$$g[0]," .
+         "\"pid\":0,\"args\":{\"bytes\":$heap}}");
+}
+print OUT "\n]}\n";
+close(OUT);
+close(IN);
+
+printf STDERR "%d events from %d threads\n", $events, $rings;